@@ -0,0 +1,88 @@
+/*
+ * AstraOS - Local APIC Implementation
+ * Inter-processor interrupts through the local APIC
+ *
+ * Device interrupts still go through the 8259 PIC: LINT0 is set to
+ * ExtINT, so the PIC reaches the processor through the local APIC as
+ * before. The local APIC is only used for IPIs, which carry work such as
+ * TLB shootdowns between CPUs.
+ */
+
+#include "apic.h"
+#include "cpu.h"
+#include "../../mm/vmm.h"
+
+/*
+ * Register window (NULL until apic_init() succeeds)
+ */
+static volatile uint32_t *apic_regs = NULL;
+
+static inline uint32_t apic_read(uint32_t reg) {
+    return apic_regs[reg / 4];
+}
+
+static inline void apic_write(uint32_t reg, uint32_t value) {
+    apic_regs[reg / 4] = value;
+}
+
+/*
+ * Initialize
+ */
+bool apic_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpu_cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & (1 << 9))) return false;
+
+    uint64_t base = cpu_rdmsr(MSR_APIC_BASE);
+    uint64_t phys = base & APIC_BASE_ADDR_MASK;
+    if (!(base & APIC_BASE_ENABLE)) {
+        cpu_wrmsr(MSR_APIC_BASE, base | APIC_BASE_ENABLE);
+    }
+
+    /* The register page is not RAM, so the HHDM may not cover it */
+    uint64_t virt = (uint64_t)vmm_phys_to_virt(phys);
+    if (vmm_virt_to_phys(NULL, virt) == 0 &&
+        !vmm_map_page(NULL, virt, phys, PTE_WRITABLE | PTE_CACHE_UC | PTE_NX)) {
+        return false;
+    }
+    apic_regs = (volatile uint32_t *)virt;
+
+    /* Virtual wire mode: PIC on LINT0, NMI on LINT1 */
+    apic_write(APIC_REG_LVT_LINT0, APIC_LVT_EXTINT);
+    apic_write(APIC_REG_LVT_LINT1, APIC_LVT_NMI);
+    apic_write(APIC_REG_TPR, 0);
+    apic_write(APIC_REG_SVR, APIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+    return true;
+}
+
+/*
+ * Availability
+ */
+bool apic_available(void) {
+    return apic_regs != NULL;
+}
+
+/*
+ * Send IPI
+ */
+void apic_send_ipi(uint32_t apic_id, uint8_t vector) {
+    if (!apic_regs) return;
+
+    uint64_t flags = cpu_save_flags();
+    cpu_cli();
+
+    while (apic_read(APIC_REG_ICR_LOW) & APIC_ICR_PENDING) {
+        cpu_pause();
+    }
+    apic_write(APIC_REG_ICR_HIGH, apic_id << 24);
+    apic_write(APIC_REG_ICR_LOW, APIC_ICR_ASSERT | vector);
+
+    cpu_restore_flags(flags);
+}
+
+/*
+ * End of interrupt
+ */
+void apic_eoi(void) {
+    if (apic_regs) apic_write(APIC_REG_EOI, 0);
+}
@@ -0,0 +1,71 @@
+/*
+ * AstraOS - Local APIC Header
+ * Inter-processor interrupts through the local APIC
+ */
+
+#ifndef _ASTRA_ARCH_APIC_H
+#define _ASTRA_ARCH_APIC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * IA32_APIC_BASE MSR
+ */
+#define MSR_APIC_BASE           0x1B
+#define APIC_BASE_ENABLE        (1ULL << 11)
+#define APIC_BASE_ADDR_MASK     0x000FFFFFFFFFF000ULL
+
+/*
+ * Register offsets
+ */
+#define APIC_REG_ID             0x020
+#define APIC_REG_TPR            0x080
+#define APIC_REG_EOI            0x0B0
+#define APIC_REG_SVR            0x0F0
+#define APIC_REG_ICR_LOW        0x300
+#define APIC_REG_ICR_HIGH       0x310
+#define APIC_REG_LVT_LINT0      0x350
+#define APIC_REG_LVT_LINT1      0x360
+
+/*
+ * Register bits
+ */
+#define APIC_SVR_ENABLE         (1 << 8)
+#define APIC_LVT_EXTINT         (7 << 8)
+#define APIC_LVT_NMI            (4 << 8)
+#define APIC_ICR_PENDING        (1 << 12)   /* Delivery status */
+#define APIC_ICR_ASSERT         (1 << 14)
+
+/*
+ * Vectors (48-63, above the remapped PIC IRQs)
+ * The spurious vector must end in 0xF for older processors.
+ */
+#define IPI_VECTOR_TLB          48
+#define APIC_SPURIOUS_VECTOR    63
+#define APIC_VECTOR_BASE        48
+#define APIC_VECTOR_END         64
+
+/*
+ * Map and enable the local APIC of the bootstrap processor
+ * External interrupts keep coming from the 8259 PIC through LINT0
+ * (virtual wire mode). Returns false if there is no local APIC.
+ */
+bool apic_init(void);
+
+/*
+ * Check whether IPIs can be sent
+ */
+bool apic_available(void);
+
+/*
+ * Send a fixed interrupt to the CPU with the given APIC ID
+ */
+void apic_send_ipi(uint32_t apic_id, uint8_t vector);
+
+/*
+ * Signal end of interrupt for an APIC vector
+ */
+void apic_eoi(void);
+
+#endif /* _ASTRA_ARCH_APIC_H */
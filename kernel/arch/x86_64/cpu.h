@@ -138,6 +138,16 @@ static inline void cpu_invlpg(uint64_t addr) {
     __asm__ volatile ("invlpg (%0)" : : "r"(addr) : "memory");
 }
 
+/*
+ * cpu_invpcid - Invalidate TLB entries by process-context identifier
+ * Types: 0 = one address in a PCID, 1 = a whole PCID,
+ * 2 = all PCIDs including global entries, 3 = all PCIDs except global
+ */
+static inline void cpu_invpcid(uint64_t type, uint64_t pcid, uint64_t addr) {
+    struct { uint64_t pcid; uint64_t addr; } desc = { pcid, addr };
+    __asm__ volatile ("invpcid %0, %1" : : "m"(desc), "r"(type) : "memory");
+}
+
 /*
  * cpu_rdmsr - Read Model Specific Register
  */
@@ -156,6 +166,32 @@ static inline void cpu_wrmsr(uint32_t msr, uint64_t value) {
     __asm__ volatile ("wrmsr" : : "c"(msr), "a"(low), "d"(high));
 }
 
+/*
+ * cpu_wbinvd - Write back and invalidate all caches
+ */
+static inline void cpu_wbinvd(void) {
+    __asm__ volatile ("wbinvd" : : : "memory");
+}
+
+/*
+ * cpu_rdtsc - Read Time Stamp Counter
+ */
+static inline uint64_t cpu_rdtsc(void) {
+    uint32_t low, high;
+    __asm__ volatile ("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+/*
+ * cpu_cpuid - Execute CPUID for a leaf (subleaf 0)
+ */
+static inline void cpu_cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx,
+                             uint32_t *ecx, uint32_t *edx) {
+    __asm__ volatile ("cpuid"
+                      : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                      : "a"(leaf), "c"(0));
+}
+
 /*
  * cpu_halt_forever - Halt CPU permanently (for panic)
  */
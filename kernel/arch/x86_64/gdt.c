@@ -18,6 +18,7 @@
 static struct gdt_entry gdt[7];
 static struct gdt_pointer gdtr;
 static struct tss tss;
+static uint8_t double_fault_stack[DOUBLE_FAULT_STACK_SIZE] __attribute__((aligned(16)));
 
 /* External assembly function to load GDT */
 extern void gdt_load(struct gdt_pointer *gdtr, uint16_t code_sel, uint16_t data_sel);
@@ -105,6 +106,7 @@ void gdt_init(void) {
 
     /* Initialize TSS */
     tss.iopb_offset = sizeof(tss);  /* No I/O permission bitmap */
+    tss.ist1 = (uint64_t)double_fault_stack + DOUBLE_FAULT_STACK_SIZE;
 
     /* Entry 5-6: TSS (spans 2 entries in 64-bit mode) */
     gdt_set_tss(5, (uint64_t)&tss, sizeof(tss) - 1);
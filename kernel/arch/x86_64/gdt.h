@@ -100,6 +100,13 @@ struct tss {
     uint16_t iopb_offset;    /* I/O Permission Bitmap offset */
 } __attribute__((packed));
 
+/*
+ * Interrupt stack used for double faults, so a kernel stack overflow
+ * is still reported when the faulting stack cannot take the frame
+ */
+#define TSS_IST_DOUBLE_FAULT    1
+#define DOUBLE_FAULT_STACK_SIZE 4096
+
 /*
  * Initialize the GDT
  */
@@ -99,6 +99,28 @@ ISR_NOERR 45    ; IRQ 13 - FPU
 ISR_NOERR 46    ; IRQ 14 - Primary ATA
 ISR_NOERR 47    ; IRQ 15 - Secondary ATA (spurious)
 
+;------------------------------------------------------------------------------
+; Local APIC Stubs (48-63)
+; Inter-processor interrupts and the spurious vector
+;------------------------------------------------------------------------------
+
+ISR_NOERR 48    ; IPI - TLB shootdown
+ISR_NOERR 49    ; Local APIC - Reserved
+ISR_NOERR 50    ; Local APIC - Reserved
+ISR_NOERR 51    ; Local APIC - Reserved
+ISR_NOERR 52    ; Local APIC - Reserved
+ISR_NOERR 53    ; Local APIC - Reserved
+ISR_NOERR 54    ; Local APIC - Reserved
+ISR_NOERR 55    ; Local APIC - Reserved
+ISR_NOERR 56    ; Local APIC - Reserved
+ISR_NOERR 57    ; Local APIC - Reserved
+ISR_NOERR 58    ; Local APIC - Reserved
+ISR_NOERR 59    ; Local APIC - Reserved
+ISR_NOERR 60    ; Local APIC - Reserved
+ISR_NOERR 61    ; Local APIC - Reserved
+ISR_NOERR 62    ; Local APIC - Reserved
+ISR_NOERR 63    ; Local APIC - Spurious
+
 ;------------------------------------------------------------------------------
 ; Common ISR Handler
 ; Saves all registers, calls C handler, restores registers
@@ -221,3 +243,21 @@ isr_stub_table:
     dq isr_stub_45
     dq isr_stub_46
     dq isr_stub_47
+
+    ; Local APIC (48-63)
+    dq isr_stub_48
+    dq isr_stub_49
+    dq isr_stub_50
+    dq isr_stub_51
+    dq isr_stub_52
+    dq isr_stub_53
+    dq isr_stub_54
+    dq isr_stub_55
+    dq isr_stub_56
+    dq isr_stub_57
+    dq isr_stub_58
+    dq isr_stub_59
+    dq isr_stub_60
+    dq isr_stub_61
+    dq isr_stub_62
+    dq isr_stub_63
@@ -5,9 +5,13 @@
 
 #include "isr.h"
 #include "idt.h"
+#include "gdt.h"
 #include "irq.h"
 #include "cpu.h"
+#include "apic.h"
 #include "../../panic.h"
+#include "../../mm/vma.h"
+#include "../../mm/vmalloc.h"
 #include "../../drivers/serial.h"
 #include "../../lib/string.h"
 
@@ -124,6 +128,12 @@ static void handle_exception(struct interrupt_frame *frame) {
         serial_puts("\n");
     }
 
+    /* A #PF that could not push its frame escalates to #DF */
+    if ((frame->int_no == EXCEPTION_PF || frame->int_no == EXCEPTION_DF) &&
+        vmalloc_is_guard(cpu_read_cr2())) {
+        serial_puts("Guard page hit (kernel stack overflow?)\n");
+    }
+
     /* Print register state */
     serial_puts("\nRegisters:\n");
     serial_puts("  RIP: "); print_hex(frame->rip); serial_puts("\n");
@@ -151,6 +161,11 @@ void isr_handler(struct interrupt_frame *frame) {
     uint64_t int_no = frame->int_no;
 
     if (int_no < 32) {
+        /* Page faults on reserved regions are committed on demand */
+        if (int_no == EXCEPTION_PF && vma_handle_fault(cpu_read_cr2(), frame->error_code)) {
+            return;
+        }
+
         /* CPU Exception */
         handle_exception(frame);
     } else if (int_no < 48) {
@@ -162,6 +177,14 @@ void isr_handler(struct interrupt_frame *frame) {
 
         /* Send EOI */
         irq_eoi(irq);
+    } else if (int_no < APIC_VECTOR_END) {
+        /* Local APIC vectors (48-63); spurious ones take no EOI */
+        if (int_no == IPI_VECTOR_TLB) {
+            vmm_shootdown_ipi();
+        }
+        if (int_no != APIC_SPURIOUS_VECTOR) {
+            apic_eoi();
+        }
     } else {
         /* Other interrupt - just acknowledge */
         serial_puts("Unhandled interrupt: ");
@@ -174,16 +197,16 @@ void isr_handler(struct interrupt_frame *frame) {
  * Install all ISR stubs into the IDT
  */
 void isr_install(void) {
-    /* CPU Exceptions (0-31) */
+    /* CPU Exceptions (0-31); double faults get their own stack */
     for (int i = 0; i < 32; i++) {
         idt_set_entry(i, isr_stub_table[i],
             IDT_FLAG_PRESENT | IDT_FLAG_DPL0 | IDT_TYPE_INTERRUPT,
-            0
+            i == EXCEPTION_DF ? TSS_IST_DOUBLE_FAULT : 0
         );
     }
 
-    /* Hardware IRQs (32-47) */
-    for (int i = 32; i < 48; i++) {
+    /* Hardware IRQs (32-47) and local APIC vectors (48-63) */
+    for (int i = 32; i < APIC_VECTOR_END; i++) {
         idt_set_entry(i, isr_stub_table[i],
             IDT_FLAG_PRESENT | IDT_FLAG_DPL0 | IDT_TYPE_INTERRUPT,
             0
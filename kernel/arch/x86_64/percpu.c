@@ -0,0 +1,56 @@
+/*
+ * AstraOS - Per-CPU Data Implementation
+ * GS-based per-CPU area and CPU numbering
+ */
+
+#include "percpu.h"
+#include "cpu.h"
+
+/*
+ * Per-CPU areas, one per possible CPU
+ */
+static struct percpu percpu_areas[MAX_CPUS];
+static uint32_t cpu_count = 0;
+
+/* cpu_current_id() reads the ID at a fixed GS offset */
+_Static_assert(__builtin_offsetof(struct percpu, cpu_id) == 8,
+               "percpu cpu_id offset must match cpu_current_id()");
+
+/*
+ * Read the initial local APIC ID of the executing CPU
+ */
+static uint32_t read_apic_id(void) {
+    uint32_t eax, ebx, ecx, edx;
+    __asm__ volatile ("cpuid"
+                      : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+                      : "a"(1));
+    return ebx >> 24;
+}
+
+/*
+ * Initialize BSP per-CPU area
+ */
+void percpu_init(void) {
+    struct percpu *area = &percpu_areas[0];
+
+    area->self = area;
+    area->cpu_id = 0;
+    area->apic_id = read_apic_id();
+
+    cpu_wrmsr(MSR_GS_BASE, (uint64_t)area);
+    cpu_count = 1;
+}
+
+/*
+ * Get CPU count
+ */
+uint32_t percpu_cpu_count(void) {
+    return cpu_count;
+}
+
+/*
+ * Get APIC ID of a CPU
+ */
+uint32_t percpu_apic_id(uint32_t cpu) {
+    return percpu_areas[cpu].apic_id;
+}
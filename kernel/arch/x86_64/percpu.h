@@ -0,0 +1,68 @@
+/*
+ * AstraOS - Per-CPU Data Header
+ * GS-based per-CPU area and CPU numbering
+ */
+
+#ifndef _ASTRA_ARCH_PERCPU_H
+#define _ASTRA_ARCH_PERCPU_H
+
+#include <stdint.h>
+
+/*
+ * Maximum number of CPUs the kernel keeps per-CPU state for
+ */
+#define MAX_CPUS        16
+
+/*
+ * IA32_GS_BASE MSR
+ */
+#define MSR_GS_BASE     0xC0000101
+
+/*
+ * Per-CPU area, pointed to by the GS base of each CPU
+ * The self pointer must stay the first field.
+ */
+struct percpu {
+    struct percpu *self;        /* Linear address of this area */
+    uint32_t cpu_id;            /* Logical CPU number (0 = BSP) */
+    uint32_t apic_id;           /* Local APIC ID */
+    uint32_t numa_node;         /* Memory node local to this CPU */
+};
+
+/*
+ * Initialize the per-CPU area of the bootstrap processor
+ * Must run after gdt_init(), which reloads GS and clears its base
+ */
+void percpu_init(void);
+
+/*
+ * Get number of CPUs with an initialized per-CPU area
+ */
+uint32_t percpu_cpu_count(void);
+
+/*
+ * Get local APIC ID of a CPU by logical number
+ */
+uint32_t percpu_apic_id(uint32_t cpu);
+
+/*
+ * Get per-CPU area of the current CPU
+ */
+static inline struct percpu *percpu_get(void) {
+    struct percpu *self;
+    __asm__ volatile ("mov %%gs:0, %0" : "=r"(self));
+    return self;
+}
+
+/*
+ * Get logical number of the current CPU
+ * Callers that use the result to index per-CPU data must have
+ * interrupts disabled so they cannot migrate in between.
+ */
+static inline uint32_t cpu_current_id(void) {
+    uint32_t id;
+    __asm__ volatile ("movl %%gs:8, %0" : "=r"(id));
+    return id;
+}
+
+#endif /* _ASTRA_ARCH_PERCPU_H */
@@ -15,6 +15,7 @@
  * ACPI state
  */
 static bool acpi_available = false;
+static struct acpi_rsdp *root_rsdp = NULL;
 static struct acpi_fadt *fadt = NULL;
 static uint16_t slp_typa = 0;
 static uint16_t slp_typb = 0;
@@ -44,16 +45,24 @@ static void *phys_to_virt(uint64_t phys) {
 
 /*
  * Ensure a range of physical memory is mapped via HHDM
+ * Unmapped stretches are mapped in one go, so large aligned
+ * regions get huge pages.
  */
 static void acpi_map_range(uint64_t phys_start, size_t length) {
-    uint64_t start_page = phys_start & ~0xFFFULL;
+    uint64_t page = phys_start & ~0xFFFULL;
     uint64_t end = phys_start + length;
 
-    for (uint64_t page = start_page; page < end; page += PAGE_SIZE) {
-        uint64_t virt = page + acpi_hhdm_offset;
-        if (vmm_virt_to_phys(NULL, virt) == 0) {
-            vmm_map_page(NULL, virt, page, PTE_WRITABLE);
+    while (page < end) {
+        if (vmm_virt_to_phys(NULL, page + acpi_hhdm_offset) != 0) {
+            page += PAGE_SIZE;
+            continue;
         }
+
+        uint64_t run = page;
+        while (page < end && vmm_virt_to_phys(NULL, page + acpi_hhdm_offset) == 0) {
+            page += PAGE_SIZE;
+        }
+        vmm_map_range(NULL, run + acpi_hhdm_offset, run, page - run, PTE_WRITABLE);
     }
 }
 
@@ -254,6 +263,7 @@ bool acpi_init(void *rsdp_ptr, uint64_t hhdm) {
     }
 
     kprintf("ACPI: Found RSDP (revision %d)\n", rsdp->revision);
+    root_rsdp = rsdp;
 
     /* Find FADT */
     fadt = acpi_find_table(rsdp, "FACP");
@@ -279,6 +289,23 @@ bool acpi_init(void *rsdp_ptr, uint64_t hhdm) {
     return true;
 }
 
+/*
+ * Find ACPI table by signature (public interface)
+ */
+void *acpi_get_table(const char *signature) {
+    return acpi_find_table(root_rsdp, signature);
+}
+
+/*
+ * Drop every pointer into ACPI table memory
+ * Everything needed later (PM1 control ports, S5 sleep types) has
+ * already been copied out by acpi_init().
+ */
+void acpi_release_tables(void) {
+    root_rsdp = NULL;
+    fadt = NULL;
+}
+
 /*
  * Power off the system using ACPI
  */
@@ -86,6 +86,68 @@ struct acpi_fadt {
     /* More fields in ACPI 2.0+ but we don't need them */
 } __attribute__((packed));
 
+/*
+ * SRAT (System Resource Affinity Table)
+ * Followed by a list of variable-length affinity structures
+ */
+struct acpi_srat {
+    struct acpi_sdt_header header;
+    uint32_t reserved1;
+    uint64_t reserved2;
+} __attribute__((packed));
+
+#define ACPI_SRAT_TYPE_CPU_AFFINITY     0
+#define ACPI_SRAT_TYPE_MEMORY_AFFINITY  1
+#define ACPI_SRAT_TYPE_X2APIC_AFFINITY  2
+
+#define ACPI_SRAT_ENABLED               (1 << 0)
+
+struct acpi_srat_entry {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed));
+
+struct acpi_srat_cpu_affinity {
+    struct acpi_srat_entry entry;
+    uint8_t proximity_domain_lo;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t proximity_domain_hi[3];
+    uint32_t clock_domain;
+} __attribute__((packed));
+
+struct acpi_srat_memory_affinity {
+    struct acpi_srat_entry entry;
+    uint32_t proximity_domain;
+    uint16_t reserved1;
+    uint64_t base_address;
+    uint64_t length;
+    uint32_t reserved2;
+    uint32_t flags;
+    uint64_t reserved3;
+} __attribute__((packed));
+
+struct acpi_srat_x2apic_affinity {
+    struct acpi_srat_entry entry;
+    uint16_t reserved1;
+    uint32_t proximity_domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved2;
+} __attribute__((packed));
+
+/*
+ * SLIT (System Locality Information Table)
+ * locality_count x locality_count matrix of relative distances
+ */
+struct acpi_slit {
+    struct acpi_sdt_header header;
+    uint64_t locality_count;
+    uint8_t entries[];
+} __attribute__((packed));
+
 /*
  * Initialize ACPI subsystem
  * @param rsdp_ptr: Pointer to RSDP from bootloader (or NULL to search)
@@ -94,6 +156,19 @@ struct acpi_fadt {
  */
 bool acpi_init(void *rsdp_ptr, uint64_t hhdm);
 
+/*
+ * Find an ACPI table by its 4-character signature
+ * The whole table is mapped through the HHDM.
+ * Returns NULL if ACPI is not initialized or the table is absent
+ */
+void *acpi_get_table(const char *signature);
+
+/*
+ * Stop referencing ACPI tables so their memory can be reclaimed
+ * acpi_get_table() returns NULL afterwards
+ */
+void acpi_release_tables(void);
+
 /*
  * Power off the system using ACPI
  * This function does not return on success
@@ -10,6 +10,7 @@
 #include "vfs.h"
 #include "../drivers/ata.h"
 #include "../mm/heap.h"
+#include "../mm/slab.h"
 #include "../lib/string.h"
 #include "../lib/stdio.h"
 
@@ -46,10 +47,10 @@ static struct fat16_fs *g_fat = NULL;
 /* Static directory entry for readdir */
 static struct dirent g_dirent;
 
-/* Node cache (simple implementation) */
-#define MAX_NODES 64
-static struct vfs_node node_cache[MAX_NODES];
-static int next_node = 0;
+/* Object caches: VFS nodes, sector and cluster buffers */
+static struct kmem_cache *node_cache = NULL;
+static struct kmem_cache *sector_cache = NULL;
+static struct kmem_cache *cluster_cache = NULL;
 
 /*
  * Read sectors from disk
@@ -87,15 +88,19 @@ static uint32_t fat_cluster_to_lba(uint16_t cluster) {
  * Allocate a VFS node
  */
 static struct vfs_node *fat_alloc_node(void) {
-    if (next_node >= MAX_NODES) {
-        /* Simple wraparound - not ideal but works for demo */
-        next_node = 1;  /* Keep root at 0 */
-    }
-    struct vfs_node *node = &node_cache[next_node++];
-    memset(node, 0, sizeof(struct vfs_node));
+    struct vfs_node *node = kmem_cache_alloc(node_cache);
+    if (node) memset(node, 0, sizeof(struct vfs_node));
     return node;
 }
 
+/*
+ * Release a VFS node (close operation of every node but the root)
+ */
+static int fat_close(struct vfs_node *node) {
+    kmem_cache_free(node_cache, node);
+    return 0;
+}
+
 /*
  * Convert FAT 8.3 filename to normal string
  */
@@ -173,6 +178,7 @@ static struct vfs_node *fat_create_node(const struct fat16_dir_entry *entry) {
     node->read = fat_read;
     node->readdir = fat_readdir;
     node->finddir = fat_finddir;
+    node->close = fat_close;
 
     return node;
 }
@@ -196,9 +202,9 @@ static int fat_read(struct vfs_node *node, uint64_t offset, size_t size, uint8_t
     uint32_t cluster_size = g_fat->sectors_per_cluster * g_fat->bytes_per_sector;
     uint32_t bytes_read = 0;
 
-    /* Allocate sector buffer */
-    uint8_t *sector_buf = kmalloc(cluster_size);
-    if (!sector_buf) return -1;
+    /* Allocate cluster buffer */
+    uint8_t *cluster_buf = kmem_cache_alloc(cluster_cache);
+    if (!cluster_buf) return -1;
 
     /* Skip to starting cluster */
     while (offset >= cluster_size && !fat_is_end_cluster(cluster)) {
@@ -210,8 +216,8 @@ static int fat_read(struct vfs_node *node, uint64_t offset, size_t size, uint8_t
     while (bytes_read < size && !fat_is_end_cluster(cluster)) {
         /* Read cluster */
         uint32_t lba = fat_cluster_to_lba(cluster);
-        if (fat_read_sectors(lba, g_fat->sectors_per_cluster, sector_buf) < 0) {
-            kfree(sector_buf);
+        if (fat_read_sectors(lba, g_fat->sectors_per_cluster, cluster_buf) < 0) {
+            kmem_cache_free(cluster_cache, cluster_buf);
             return -1;
         }
 
@@ -222,14 +228,14 @@ static int fat_read(struct vfs_node *node, uint64_t offset, size_t size, uint8_t
             to_copy = size - bytes_read;
         }
 
-        memcpy(buffer + bytes_read, sector_buf + cluster_offset, to_copy);
+        memcpy(buffer + bytes_read, cluster_buf + cluster_offset, to_copy);
         bytes_read += to_copy;
         offset = 0;  /* After first cluster, start from beginning */
 
         cluster = fat_get_next_cluster(cluster);
     }
 
-    kfree(sector_buf);
+    kmem_cache_free(cluster_cache, cluster_buf);
     return bytes_read;
 }
 
@@ -240,7 +246,7 @@ static struct dirent *fat_readdir(struct vfs_node *node, uint32_t index) {
     if (!node || !g_fat) return NULL;
     if (!(node->flags & VFS_DIRECTORY)) return NULL;
 
-    uint8_t *sector_buf = kmalloc(g_fat->bytes_per_sector);
+    uint8_t *sector_buf = kmem_cache_alloc(sector_cache);
     if (!sector_buf) return NULL;
 
     uint32_t entry_count = 0;
@@ -253,7 +259,7 @@ static struct dirent *fat_readdir(struct vfs_node *node, uint32_t index) {
 
         for (uint32_t i = 0; i < g_fat->root_dir_sectors; i++) {
             if (fat_read_sectors(g_fat->root_dir_start_lba + i, 1, sector_buf) < 0) {
-                kfree(sector_buf);
+                kmem_cache_free(sector_cache, sector_buf);
                 return NULL;
             }
 
@@ -264,7 +270,7 @@ static struct dirent *fat_readdir(struct vfs_node *node, uint32_t index) {
 
                 /* End of directory */
                 if (entry->name[0] == 0x00) {
-                    kfree(sector_buf);
+                    kmem_cache_free(sector_cache, sector_buf);
                     return NULL;
                 }
 
@@ -277,7 +283,7 @@ static struct dirent *fat_readdir(struct vfs_node *node, uint32_t index) {
                 if (entry_count == index) {
                     fat_name_to_string(entry, g_dirent.name);
                     g_dirent.inode = entry->cluster_low;
-                    kfree(sector_buf);
+                    kmem_cache_free(sector_cache, sector_buf);
                     return &g_dirent;
                 }
 
@@ -290,17 +296,17 @@ static struct dirent *fat_readdir(struct vfs_node *node, uint32_t index) {
         uint32_t cluster_size = g_fat->sectors_per_cluster * g_fat->bytes_per_sector;
         uint32_t entries_per_cluster = cluster_size / sizeof(struct fat16_dir_entry);
 
-        uint8_t *cluster_buf = kmalloc(cluster_size);
+        uint8_t *cluster_buf = kmem_cache_alloc(cluster_cache);
         if (!cluster_buf) {
-            kfree(sector_buf);
+            kmem_cache_free(sector_cache, sector_buf);
             return NULL;
         }
 
         while (!fat_is_end_cluster(cluster)) {
             uint32_t lba = fat_cluster_to_lba(cluster);
             if (fat_read_sectors(lba, g_fat->sectors_per_cluster, cluster_buf) < 0) {
-                kfree(cluster_buf);
-                kfree(sector_buf);
+                kmem_cache_free(cluster_cache, cluster_buf);
+                kmem_cache_free(sector_cache, sector_buf);
                 return NULL;
             }
 
@@ -311,8 +317,8 @@ static struct dirent *fat_readdir(struct vfs_node *node, uint32_t index) {
 
                 /* End of directory */
                 if (entry->name[0] == 0x00) {
-                    kfree(cluster_buf);
-                    kfree(sector_buf);
+                    kmem_cache_free(cluster_cache, cluster_buf);
+                    kmem_cache_free(sector_cache, sector_buf);
                     return NULL;
                 }
 
@@ -325,8 +331,8 @@ static struct dirent *fat_readdir(struct vfs_node *node, uint32_t index) {
                 if (entry_count == index) {
                     fat_name_to_string(entry, g_dirent.name);
                     g_dirent.inode = entry->cluster_low;
-                    kfree(cluster_buf);
-                    kfree(sector_buf);
+                    kmem_cache_free(cluster_cache, cluster_buf);
+                    kmem_cache_free(sector_cache, sector_buf);
                     return &g_dirent;
                 }
 
@@ -336,10 +342,10 @@ static struct dirent *fat_readdir(struct vfs_node *node, uint32_t index) {
             cluster = fat_get_next_cluster(cluster);
         }
 
-        kfree(cluster_buf);
+        kmem_cache_free(cluster_cache, cluster_buf);
     }
 
-    kfree(sector_buf);
+    kmem_cache_free(sector_cache, sector_buf);
     return NULL;
 }
 
@@ -350,7 +356,7 @@ static struct vfs_node *fat_finddir(struct vfs_node *node, const char *name) {
     if (!node || !name || !g_fat) return NULL;
     if (!(node->flags & VFS_DIRECTORY)) return NULL;
 
-    uint8_t *sector_buf = kmalloc(g_fat->bytes_per_sector);
+    uint8_t *sector_buf = kmem_cache_alloc(sector_cache);
     if (!sector_buf) return NULL;
 
     struct fat16_dir_entry *entry = NULL;
@@ -362,7 +368,7 @@ static struct vfs_node *fat_finddir(struct vfs_node *node, const char *name) {
 
         for (uint32_t i = 0; i < g_fat->root_dir_sectors; i++) {
             if (fat_read_sectors(g_fat->root_dir_start_lba + i, 1, sector_buf) < 0) {
-                kfree(sector_buf);
+                kmem_cache_free(sector_cache, sector_buf);
                 return NULL;
             }
 
@@ -373,7 +379,7 @@ static struct vfs_node *fat_finddir(struct vfs_node *node, const char *name) {
 
                 /* End of directory */
                 if (entry->name[0] == 0x00) {
-                    kfree(sector_buf);
+                    kmem_cache_free(sector_cache, sector_buf);
                     return NULL;
                 }
 
@@ -385,7 +391,7 @@ static struct vfs_node *fat_finddir(struct vfs_node *node, const char *name) {
 
                 if (fat_name_match(entry, name)) {
                     struct vfs_node *found = fat_create_node(entry);
-                    kfree(sector_buf);
+                    kmem_cache_free(sector_cache, sector_buf);
                     return found;
                 }
             }
@@ -396,17 +402,17 @@ static struct vfs_node *fat_finddir(struct vfs_node *node, const char *name) {
         uint32_t cluster_size = g_fat->sectors_per_cluster * g_fat->bytes_per_sector;
         uint32_t entries_per_cluster = cluster_size / sizeof(struct fat16_dir_entry);
 
-        uint8_t *cluster_buf = kmalloc(cluster_size);
+        uint8_t *cluster_buf = kmem_cache_alloc(cluster_cache);
         if (!cluster_buf) {
-            kfree(sector_buf);
+            kmem_cache_free(sector_cache, sector_buf);
             return NULL;
         }
 
         while (!fat_is_end_cluster(cluster)) {
             uint32_t lba = fat_cluster_to_lba(cluster);
             if (fat_read_sectors(lba, g_fat->sectors_per_cluster, cluster_buf) < 0) {
-                kfree(cluster_buf);
-                kfree(sector_buf);
+                kmem_cache_free(cluster_cache, cluster_buf);
+                kmem_cache_free(sector_cache, sector_buf);
                 return NULL;
             }
 
@@ -417,8 +423,8 @@ static struct vfs_node *fat_finddir(struct vfs_node *node, const char *name) {
 
                 /* End of directory */
                 if (entry->name[0] == 0x00) {
-                    kfree(cluster_buf);
-                    kfree(sector_buf);
+                    kmem_cache_free(cluster_cache, cluster_buf);
+                    kmem_cache_free(sector_cache, sector_buf);
                     return NULL;
                 }
 
@@ -430,8 +436,8 @@ static struct vfs_node *fat_finddir(struct vfs_node *node, const char *name) {
 
                 if (fat_name_match(entry, name)) {
                     struct vfs_node *found = fat_create_node(entry);
-                    kfree(cluster_buf);
-                    kfree(sector_buf);
+                    kmem_cache_free(cluster_cache, cluster_buf);
+                    kmem_cache_free(sector_cache, sector_buf);
                     return found;
                 }
             }
@@ -439,10 +445,10 @@ static struct vfs_node *fat_finddir(struct vfs_node *node, const char *name) {
             cluster = fat_get_next_cluster(cluster);
         }
 
-        kfree(cluster_buf);
+        kmem_cache_free(cluster_cache, cluster_buf);
     }
 
-    kfree(sector_buf);
+    kmem_cache_free(sector_cache, sector_buf);
     return NULL;
 }
 
@@ -543,10 +549,27 @@ struct vfs_node *fat16_init(int drive, uint32_t partition_lba) {
         return NULL;
     }
 
-    /* Create root node */
-    struct vfs_node *root = &node_cache[0];
-    memset(root, 0, sizeof(struct vfs_node));
-    next_node = 1;
+    /* Buffers of one sector and one cluster are taken on every read */
+    uint32_t cluster_size = g_fat->sectors_per_cluster * g_fat->bytes_per_sector;
+    if (!node_cache) {
+        node_cache = kmem_cache_create("vfs_node", sizeof(struct vfs_node), 0, 0, NULL);
+    }
+    if (!sector_cache) {
+        sector_cache = kmem_cache_create("fat_sector", g_fat->bytes_per_sector, 0,
+                                         KMEM_HWALIGN, NULL);
+    }
+    if (!cluster_cache) {
+        cluster_cache = kmem_cache_create("fat_cluster", cluster_size, 0, KMEM_HWALIGN, NULL);
+    }
+
+    /* Create root node (never closed) */
+    struct vfs_node *root = fat_alloc_node();
+    if (!root || !sector_cache || !cluster_cache) {
+        kfree(g_fat->fat_table);
+        kfree(g_fat);
+        g_fat = NULL;
+        return NULL;
+    }
 
     strcpy(root->name, "/");
     root->flags = VFS_DIRECTORY;
@@ -556,8 +579,7 @@ struct vfs_node *fat16_init(int drive, uint32_t partition_lba) {
     root->finddir = fat_finddir;
 
     kprintf("FAT16: Mounted drive %d (%u clusters, %u bytes/cluster)\n",
-            drive, g_fat->total_clusters,
-            g_fat->sectors_per_cluster * g_fat->bytes_per_sector);
+            drive, g_fat->total_clusters, cluster_size);
 
     return root;
 }
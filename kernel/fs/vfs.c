@@ -152,8 +152,10 @@ struct vfs_node *vfs_resolve_path(const char *path) {
             continue;
         }
 
-        /* Find the entry in current directory */
-        current = vfs_finddir(current, token);
+        /* Find the entry in current directory, releasing the directory */
+        struct vfs_node *next = vfs_finddir(current, token);
+        if (current != vfs_root) vfs_close(current);
+        current = next;
 
         token = strtok_r(NULL, "/", &saveptr);
     }
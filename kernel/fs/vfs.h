@@ -112,7 +112,7 @@ struct vfs_node *vfs_get_root(void);
 /* Open file by path */
 struct vfs_node *vfs_open(const char *path);
 
-/* Close file */
+/* Close file (also releases nodes returned by vfs_finddir/vfs_resolve_path) */
 void vfs_close(struct vfs_node *node);
 
 /* Read from file */
@@ -0,0 +1,190 @@
+/*
+ * AstraOS - LZ4 Implementation
+ * LZ4 block format compression for in-memory data
+ *
+ * A block is a run of sequences: a token byte (literal length in the
+ * high nibble, match length minus 4 in the low one, 15 meaning more
+ * length bytes follow), the literals, a 16-bit little-endian match
+ * offset and the extra match length bytes. The last sequence has
+ * literals only. As the format requires, the last 5 bytes are always
+ * literals and no match starts within the last 12.
+ *
+ * The compressor is the single-pass greedy one: a hash of the next 4
+ * bytes gives the last position that had the same hash, and a match is
+ * taken whenever those 4 bytes really are equal. Table entries are
+ * checked before use, so the table never needs clearing between calls.
+ */
+
+#include <stdbool.h>
+#include "lz4.h"
+#include "string.h"
+
+#define LZ4_MIN_MATCH       4
+#define LZ4_LAST_LITERALS   5
+#define LZ4_MF_LIMIT        12
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t value;
+    __builtin_memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t hash32(uint32_t value) {
+    return (value * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+/*
+ * Write a length continuation (after a nibble of 15)
+ */
+static uint8_t *write_length(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/*
+ * Emit one sequence; match_len is the length minus LZ4_MIN_MATCH and
+ * is ignored for the last (literals only) sequence
+ * Returns the new output position, or NULL if dst is too small
+ */
+static uint8_t *emit_sequence(uint8_t *op, uint8_t *oend, const uint8_t *literals,
+                              size_t lit_len, uint16_t offset, size_t match_len, bool last) {
+    size_t need = 1 + lit_len + lit_len / 255 + 1;
+    if (!last) need += 2 + match_len / 255 + 1;
+    if (need > (size_t)(oend - op)) return NULL;
+
+    uint8_t *token = op++;
+    *token = (lit_len >= 15 ? 15 : lit_len) << 4;
+    if (lit_len >= 15) op = write_length(op, lit_len - 15);
+
+    memcpy(op, literals, lit_len);
+    op += lit_len;
+    if (last) return op;
+
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+
+    *token |= match_len >= 15 ? 15 : match_len;
+    if (match_len >= 15) op = write_length(op, match_len - 15);
+    return op;
+}
+
+/*
+ * Compress
+ */
+size_t lz4_compress(struct lz4_state *state, const void *src, size_t src_len,
+                    void *dst, size_t dst_cap) {
+    if (src_len > LZ4_MAX_INPUT) return 0;
+
+    const uint8_t *base = src;
+    const uint8_t *ip = base;
+    const uint8_t *anchor = base;
+    const uint8_t *iend = base + src_len;
+    uint8_t *op = dst;
+    uint8_t *oend = op + dst_cap;
+
+    if (src_len > LZ4_MF_LIMIT) {
+        const uint8_t *mflimit = iend - LZ4_MF_LIMIT;
+        const uint8_t *matchlimit = iend - LZ4_LAST_LITERALS;
+        uint32_t misses = 0;
+
+        while (ip < mflimit) {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash32(seq);
+            uint16_t pos = ip - base;
+            uint16_t cand = state->table[h];
+            state->table[h] = pos;
+
+            const uint8_t *ref = base + cand;
+            if (cand >= pos || read32(ref) != seq) {
+                /* Skip faster through data that does not compress */
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+
+            /* Extend backwards over pending literals, then forwards */
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *end = ip + LZ4_MIN_MATCH;
+            const uint8_t *rend = ref + LZ4_MIN_MATCH;
+            while (end < matchlimit && *end == *rend) {
+                end++;
+                rend++;
+            }
+
+            op = emit_sequence(op, oend, anchor, ip - anchor, ip - ref,
+                               end - ip - LZ4_MIN_MATCH, false);
+            if (!op) return 0;
+
+            ip = end;
+            anchor = ip;
+        }
+    }
+
+    op = emit_sequence(op, oend, anchor, iend - anchor, 0, 0, true);
+    if (!op) return 0;
+    return op - (uint8_t *)dst;
+}
+
+/*
+ * Decompress
+ */
+int lz4_decompress(const void *src, size_t src_len, void *dst, size_t dst_cap) {
+    const uint8_t *ip = src;
+    const uint8_t *iend = ip + src_len;
+    uint8_t *op = dst;
+    uint8_t *oend = op + dst_cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+
+        size_t lit_len = token >> 4;
+        if (lit_len == 15) {
+            uint8_t byte;
+            do {
+                if (ip >= iend) return -1;
+                byte = *ip++;
+                lit_len += byte;
+            } while (byte == 255);
+        }
+        if (lit_len > (size_t)(iend - ip) || lit_len > (size_t)(oend - op)) return -1;
+
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        /* The last sequence ends with its literals */
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst)) return -1;
+
+        size_t match_len = token & 15;
+        if (match_len == 15) {
+            uint8_t byte;
+            do {
+                if (ip >= iend) return -1;
+                byte = *ip++;
+                match_len += byte;
+            } while (byte == 255);
+        }
+        match_len += LZ4_MIN_MATCH;
+        if (match_len > (size_t)(oend - op)) return -1;
+
+        /* Byte by byte: the match may overlap the bytes it produces */
+        const uint8_t *ref = op - offset;
+        while (match_len--) {
+            *op++ = *ref++;
+        }
+    }
+
+    return op - (uint8_t *)dst;
+}
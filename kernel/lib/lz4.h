@@ -0,0 +1,41 @@
+/*
+ * AstraOS - LZ4 Header
+ * LZ4 block format compression for in-memory data
+ */
+
+#ifndef _ASTRA_LZ4_H
+#define _ASTRA_LZ4_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Largest input lz4_compress() accepts (match offsets are 16 bits)
+ */
+#define LZ4_MAX_INPUT   65535
+
+/*
+ * Compressor state: last position of each 4-byte hash
+ */
+#define LZ4_HASH_BITS   12
+
+struct lz4_state {
+    uint16_t table[1 << LZ4_HASH_BITS];
+};
+
+/*
+ * Compress src into dst as one LZ4 block
+ * Returns the compressed size, or 0 if it would exceed dst_cap or
+ * src_len exceeds LZ4_MAX_INPUT
+ */
+size_t lz4_compress(struct lz4_state *state, const void *src, size_t src_len,
+                    void *dst, size_t dst_cap);
+
+/*
+ * Decompress one LZ4 block
+ * Returns the decompressed size, or -1 if the block is malformed or
+ * would exceed dst_cap
+ */
+int lz4_decompress(const void *src, size_t src_len, void *dst, size_t dst_cap);
+
+#endif /* _ASTRA_LZ4_H */
@@ -16,13 +16,20 @@
 #include "drivers/keyboard.h"
 #include "arch/x86_64/cpu.h"
 #include "arch/x86_64/gdt.h"
+#include "arch/x86_64/percpu.h"
 #include "arch/x86_64/idt.h"
 #include "arch/x86_64/irq.h"
+#include "arch/x86_64/apic.h"
 #include "mm/pmm.h"
+#include "mm/numa.h"
+#include "mm/page.h"
 #include "mm/vmm.h"
+#include "mm/vmalloc.h"
+#include "mm/zram.h"
 #include "mm/heap.h"
 #include "proc/process.h"
 #include "proc/scheduler.h"
+#include "proc/idle.h"
 #include "drivers/ata.h"
 #include "drivers/acpi.h"
 #include "fs/vfs.h"
@@ -109,9 +116,30 @@ uint64_t hhdm_offset = 0;
 
 /*
  * Global framebuffer pointer
+ * Points at a private copy, since the Limine response lives in
+ * bootloader-reclaimable memory.
  */
+static struct limine_framebuffer framebuffer_info;
 static struct limine_framebuffer *g_framebuffer = NULL;
 
+/*
+ * Copy of the framebuffer in RAM (NULL until fb_enable_wc())
+ * Once the framebuffer is write-combining, reads from it are uncached,
+ * so scrolling reads the copy and only writes go to the screen.
+ */
+static uint8_t *fb_shadow = NULL;
+
+/*
+ * Kernel boot stack
+ * Limine's stack is bootloader-reclaimable memory too, so kmain moves
+ * onto this one before that memory is released.
+ */
+#define BOOT_STACK_SIZE     (64 * 1024)
+
+static uint8_t boot_stack[BOOT_STACK_SIZE] __attribute__((aligned(16)));
+
+static void kmain_late(void) __attribute__((noreturn));
+
 /*
  * Simple hex number to string conversion
  */
@@ -156,10 +184,10 @@ static void fb_putpixel(uint32_t x, uint32_t y, uint32_t color) {
     if (!g_framebuffer) return;
     if (x >= g_framebuffer->width || y >= g_framebuffer->height) return;
 
-    volatile uint32_t *pixel = (volatile uint32_t *)((uint8_t *)g_framebuffer->address +
-                                                      y * g_framebuffer->pitch +
-                                                      x * (g_framebuffer->bpp / 8));
+    uint64_t offset = y * g_framebuffer->pitch + x * (g_framebuffer->bpp / 8);
+    volatile uint32_t *pixel = (volatile uint32_t *)((uint8_t *)g_framebuffer->address + offset);
     *pixel = color;
+    if (fb_shadow) *(uint32_t *)(fb_shadow + offset) = color;
 }
 
 /*
@@ -265,11 +293,18 @@ static void fb_scroll(void) {
     uint64_t row_size = g_framebuffer->pitch * CHAR_HEIGHT;
     uint64_t total_size = g_framebuffer->pitch * g_framebuffer->height;
 
-    /* Move all rows up by one character height */
-    memmove(fb, fb + row_size, total_size - row_size);
+    if (fb_shadow) {
+        /* Scroll the copy, then write it out in one sequential pass */
+        memmove(fb_shadow, fb_shadow + row_size, total_size - row_size);
+        memset(fb_shadow + total_size - row_size, 0, row_size);
+        memcpy(fb, fb_shadow, total_size);
+    } else {
+        /* Move all rows up by one character height */
+        memmove(fb, fb + row_size, total_size - row_size);
 
-    /* Clear the last row */
-    memset(fb + total_size - row_size, 0, row_size);
+        /* Clear the last row */
+        memset(fb + total_size - row_size, 0, row_size);
+    }
 
     fb_cursor_y -= CHAR_HEIGHT;
 }
@@ -400,10 +435,34 @@ void fb_clear(void) {
 
     memset(g_framebuffer->address, 0,
            g_framebuffer->pitch * g_framebuffer->height);
+    if (fb_shadow) memset(fb_shadow, 0, g_framebuffer->pitch * g_framebuffer->height);
     fb_cursor_x = 0;
     fb_cursor_y = 0;
 }
 
+/*
+ * Map the framebuffer write-combining and start the RAM copy
+ * Needs the VMM and vmalloc. Returns false if the framebuffer keeps
+ * its boot mapping.
+ */
+static bool fb_enable_wc(void) {
+    if (!g_framebuffer) return false;
+
+    uint64_t size = g_framebuffer->pitch * g_framebuffer->height;
+    uint8_t *shadow = vmalloc(size, PAGE_OWNER_KERNEL);
+    if (!shadow) return false;
+
+    if (!vmm_set_cache(NULL, (uint64_t)g_framebuffer->address, size, PTE_CACHE_WC)) {
+        vfree(shadow);
+        return false;
+    }
+
+    /* The last uncached read of the screen */
+    memcpy(shadow, g_framebuffer->address, size);
+    fb_shadow = shadow;
+    return true;
+}
+
 /*
  * Print memory size in human-readable format
  */
@@ -487,7 +546,12 @@ void kmain(void) {
         panic("Failed to get framebuffer from bootloader");
     }
 
-    g_framebuffer = framebuffer_request.response->framebuffers[0];
+    framebuffer_info = *framebuffer_request.response->framebuffers[0];
+    framebuffer_info.edid_size = 0;
+    framebuffer_info.edid = NULL;
+    framebuffer_info.mode_count = 0;
+    framebuffer_info.modes = NULL;
+    g_framebuffer = &framebuffer_info;
 
     serial_puts("Framebuffer: ");
     uint64_to_dec(g_framebuffer->width, buf);
@@ -511,6 +575,11 @@ void kmain(void) {
     serial_puts("OK\n");
     fb_puts("GDT initialized\n");
 
+    /* Initialize per-CPU area (GDT load clears the GS base) */
+    serial_puts("Initializing per-CPU data... ");
+    percpu_init();
+    serial_puts("OK\n");
+
     /* Initialize IRQ subsystem (PIC) */
     serial_puts("Initializing IRQ (PIC)... ");
     irq_init();
@@ -584,8 +653,13 @@ void kmain(void) {
 
     /* Initialize Physical Memory Manager */
     serial_puts("\nInitializing PMM... ");
+    uint64_t pmm_start = cpu_rdtsc();
     pmm_init(memmap_request.response, hhdm_offset);
-    serial_puts("OK\n");
+    uint64_t pmm_cycles = cpu_rdtsc() - pmm_start;
+    serial_puts("OK (");
+    uint64_to_dec(pmm_cycles, buf);
+    serial_puts(buf);
+    serial_puts(" cycles)\n");
     fb_puts("Physical memory manager initialized\n");
 
     /* Initialize Virtual Memory Manager */
@@ -594,12 +668,34 @@ void kmain(void) {
     serial_puts("OK\n");
     fb_puts("Virtual memory manager initialized\n");
 
+    /* Per-frame descriptors (needs the VMM to map the array) */
+    serial_puts("Initializing page descriptors... ");
+    page_init(memmap_request.response);
+    serial_puts(page_map_ready ? "OK\n" : "FAILED\n");
+
     /* Initialize Kernel Heap */
     serial_puts("Initializing heap... ");
     heap_init();
     serial_puts("OK\n");
     fb_puts("Kernel heap initialized\n");
 
+    /* Write-combining console (needs vmalloc for the RAM copy) */
+    serial_puts("Mapping framebuffer write-combining... ");
+    serial_puts(fb_enable_wc() ? "OK\n" : "FAILED\n");
+
+    /*
+     * Keep zeroed pages and small free blocks available while idle, and
+     * compress cold heap pages once free memory runs low
+     */
+    idle_register(pmm_zero_idle);
+    idle_register(pmm_compact_idle);
+    idle_register(vmm_reap_idle);
+    idle_register(zram_reclaim_idle);
+
+    /* Local APIC for IPIs (needs the VMM to map its registers) */
+    serial_puts("Initializing local APIC... ");
+    serial_puts(apic_init() ? "OK\n" : "not present\n");
+
     /* Initialize PIT Timer */
     serial_puts("Initializing PIT timer... ");
     pit_init(1000);  /* 1000 Hz = 1ms per tick */
@@ -642,6 +738,9 @@ void kmain(void) {
         fb_puts("ACPI not available (using fallback shutdown)\n");
     }
 
+    /* Split physical memory by NUMA node (needs the SRAT) */
+    numa_init();
+
     /* Initialize ATA/Disk */
     serial_puts("Initializing ATA... ");
     ata_init();
@@ -678,6 +777,29 @@ void kmain(void) {
         fb_puts("No filesystem detected (ls/cat disabled)\n");
     }
 
+    /* Leave the bootloader stack so its memory can be reclaimed */
+    __asm__ volatile (
+        "mov %0, %%rsp\n\t"
+        "xor %%ebp, %%ebp\n\t"
+        "call *%1"
+        : : "r"(boot_stack + BOOT_STACK_SIZE), "r"(kmain_late) : "memory");
+    __builtin_unreachable();
+}
+
+/*
+ * Second half of kernel initialization, running on boot_stack
+ */
+static void kmain_late(void) {
+    char buf[32];
+
+    /* Nothing references bootloader or ACPI memory any more */
+    serial_puts("Reclaiming boot memory... ");
+    acpi_release_tables();
+    uint64_t reclaimed = pmm_reclaim_boot_memory();
+    uint64_to_dec(reclaimed / 1024, buf);
+    serial_puts(buf);
+    serial_puts(" KB\n");
+
     /* Display memory info */
     fb_puts("\nMemory: ");
     uint64_to_dec(pmm_get_free_memory() / (1024 * 1024), buf);
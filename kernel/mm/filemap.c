@@ -0,0 +1,242 @@
+/*
+ * AstraOS - Page Cache Implementation
+ * File pages shared between every mapping of a file
+ *
+ * Each open file gets a slot holding a private copy of its VFS node
+ * (nodes are freed on close) and a list of cached pages. A page is read
+ * once, on the first fault of any mapper, and every later mapping of
+ * the same file page maps that frame. The cache holds one reference to
+ * each frame and every mapping holds its own, so a page dropped from
+ * the cache lives on until its last mapping goes away.
+ *
+ * Files are identified by read operation, inode and size, which is
+ * unique within the read-only filesystems the VFS mounts. Slots and
+ * pages come from static pools; when the page pool is full the next
+ * page round-robin is dropped, and slots of files nobody uses are
+ * reclaimed with their pages.
+ */
+
+#include "filemap.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "page.h"
+#include "../lib/string.h"
+#include "../sync/spinlock.h"
+
+/*
+ * Cached file page
+ */
+struct filemap_page {
+    struct filemap *file;       /* NULL = free entry */
+    uint64_t index;
+    uint64_t phys;
+    struct filemap_page *next;
+};
+
+/*
+ * Cached file
+ */
+struct filemap {
+    struct vfs_node node;       /* Private copy */
+    uint32_t users;             /* Mappings and other holders */
+    bool used;
+    struct filemap_page *pages;
+};
+
+static struct filemap files[FILEMAP_MAX_FILES];
+static struct filemap_page page_pool[FILEMAP_MAX_PAGES];
+static uint32_t evict_hand = 0;
+static spinlock_t filemap_lock = SPINLOCK_INIT;
+
+static uint64_t cached_pages = 0;
+static uint64_t hit_count = 0;
+static uint64_t miss_count = 0;
+
+/*
+ * Unlink a page and drop the cache's reference (filemap_lock held)
+ */
+static void page_drop(struct filemap_page *entry) {
+    struct filemap_page **link = &entry->file->pages;
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+
+    page_put(page_of(entry->phys));
+    entry->file = NULL;
+    cached_pages--;
+}
+
+/*
+ * Find a cached page (filemap_lock held)
+ */
+static struct filemap_page *page_find(struct filemap *file, uint64_t index) {
+    for (struct filemap_page *entry = file->pages; entry; entry = entry->next) {
+        if (entry->index == index) return entry;
+    }
+    return NULL;
+}
+
+/*
+ * Get a free page entry, dropping a cached page if there is none
+ * (filemap_lock held)
+ */
+static struct filemap_page *page_entry_alloc(void) {
+    for (uint32_t i = 0; i < FILEMAP_MAX_PAGES; i++) {
+        if (!page_pool[i].file) return &page_pool[i];
+    }
+
+    struct filemap_page *victim = &page_pool[evict_hand];
+    evict_hand = (evict_hand + 1) % FILEMAP_MAX_PAGES;
+    page_drop(victim);
+    return victim;
+}
+
+/*
+ * Open
+ */
+struct filemap *filemap_open(struct vfs_node *node) {
+    if (!node || !(node->flags & VFS_FILE) || node->size == 0 || !node->read) return NULL;
+
+    uint64_t irqflags;
+    spinlock_acquire_irqsave(&filemap_lock, &irqflags);
+
+    struct filemap *free_slot = NULL;
+    struct filemap *unused = NULL;
+    for (int i = 0; i < FILEMAP_MAX_FILES; i++) {
+        struct filemap *file = &files[i];
+        if (!file->used) {
+            if (!free_slot) free_slot = file;
+            continue;
+        }
+
+        if (file->node.read == node->read && file->node.inode == node->inode &&
+            file->node.size == node->size) {
+            file->users++;
+            spinlock_release_irqrestore(&filemap_lock, irqflags);
+            return file;
+        }
+        if (file->users == 0 && !unused) unused = file;
+    }
+
+    /* Reclaim a file nobody maps */
+    if (!free_slot && unused) {
+        while (unused->pages) {
+            page_drop(unused->pages);
+        }
+        free_slot = unused;
+    }
+
+    if (free_slot) {
+        memcpy(&free_slot->node, node, sizeof(*node));
+        free_slot->users = 1;
+        free_slot->used = true;
+        free_slot->pages = NULL;
+    }
+
+    spinlock_release_irqrestore(&filemap_lock, irqflags);
+    return free_slot;
+}
+
+/*
+ * Duplicate
+ */
+void filemap_dup(struct filemap *file) {
+    uint64_t irqflags;
+    spinlock_acquire_irqsave(&filemap_lock, &irqflags);
+    file->users++;
+    spinlock_release_irqrestore(&filemap_lock, irqflags);
+}
+
+/*
+ * Close
+ */
+void filemap_close(struct filemap *file) {
+    if (!file) return;
+
+    uint64_t irqflags;
+    spinlock_acquire_irqsave(&filemap_lock, &irqflags);
+    file->users--;
+    spinlock_release_irqrestore(&filemap_lock, irqflags);
+}
+
+/*
+ * Size
+ */
+uint64_t filemap_size(struct filemap *file) {
+    return file->node.size;
+}
+
+/*
+ * Get a page
+ */
+uint64_t filemap_get_page(struct filemap *file, uint64_t index) {
+    if (index >= (file->node.size + PAGE_SIZE - 1) / PAGE_SIZE) return 0;
+
+    uint64_t irqflags;
+    spinlock_acquire_irqsave(&filemap_lock, &irqflags);
+    struct filemap_page *entry = page_find(file, index);
+    if (entry) {
+        uint64_t phys = entry->phys;
+        page_get(page_of(phys));
+        hit_count++;
+        spinlock_release_irqrestore(&filemap_lock, irqflags);
+        return phys;
+    }
+    spinlock_release_irqrestore(&filemap_lock, irqflags);
+
+    /* Read outside the lock; the tail past the end of the file stays zero */
+    void *frame = pmm_alloc_pages_flags(1, PMM_ZERO);
+    if (!frame) return 0;
+    page_set_owner((uint64_t)frame, 1, PAGE_OWNER_PAGECACHE);
+
+    if (vfs_read(&file->node, index * PAGE_SIZE, PAGE_SIZE, vmm_phys_to_virt((uint64_t)frame)) < 0) {
+        pmm_free_page(frame);
+        return 0;
+    }
+
+    spinlock_acquire_irqsave(&filemap_lock, &irqflags);
+    miss_count++;
+
+    /* Another mapper may have read it meanwhile */
+    entry = page_find(file, index);
+    if (entry) {
+        page_get(page_of(entry->phys));
+        uint64_t phys = entry->phys;
+        spinlock_release_irqrestore(&filemap_lock, irqflags);
+        pmm_free_page(frame);
+        return phys;
+    }
+
+    entry = page_entry_alloc();
+    entry->file = file;
+    entry->index = index;
+    entry->phys = (uint64_t)frame;
+    entry->next = file->pages;
+    file->pages = entry;
+    cached_pages++;
+
+    /* One reference for the cache, one for the caller */
+    page_get(page_of((uint64_t)frame));
+
+    spinlock_release_irqrestore(&filemap_lock, irqflags);
+    return (uint64_t)frame;
+}
+
+/*
+ * Statistics
+ */
+void filemap_get_stats(struct filemap_stats *stats) {
+    uint64_t irqflags;
+    spinlock_acquire_irqsave(&filemap_lock, &irqflags);
+
+    stats->files = 0;
+    for (int i = 0; i < FILEMAP_MAX_FILES; i++) {
+        if (files[i].used) stats->files++;
+    }
+    stats->pages = cached_pages;
+    stats->hits = hit_count;
+    stats->misses = miss_count;
+
+    spinlock_release_irqrestore(&filemap_lock, irqflags);
+}
@@ -0,0 +1,65 @@
+/*
+ * AstraOS - Page Cache Header
+ * File pages shared between every mapping of a file
+ */
+
+#ifndef _ASTRA_MM_FILEMAP_H
+#define _ASTRA_MM_FILEMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "../fs/vfs.h"
+
+/*
+ * Cache limits
+ */
+#define FILEMAP_MAX_FILES   32
+#define FILEMAP_MAX_PAGES   1024
+
+struct filemap;
+
+/*
+ * Get the cache of a regular file, taking a user reference
+ * Returns NULL if the node is not a non-empty file or every slot is
+ * held by files still in use
+ */
+struct filemap *filemap_open(struct vfs_node *node);
+
+/*
+ * Take another user reference
+ */
+void filemap_dup(struct filemap *file);
+
+/*
+ * Drop a user reference
+ * Cached pages stay until the slot or the pages are needed again.
+ */
+void filemap_close(struct filemap *file);
+
+/*
+ * File size in bytes
+ */
+uint64_t filemap_size(struct filemap *file);
+
+/*
+ * Get a page of the file, reading it on a miss
+ * Returns the physical address with a reference taken for the caller
+ * (drop it with page_put()), or 0 past the end of the file or on error.
+ * Reads through the VFS on a miss, so no spinlocks may be held.
+ */
+uint64_t filemap_get_page(struct filemap *file, uint64_t index);
+
+/*
+ * Page cache statistics
+ */
+struct filemap_stats {
+    uint64_t files;         /* Files with a cache slot */
+    uint64_t pages;         /* Pages cached */
+    uint64_t hits;          /* Lookups served from the cache */
+    uint64_t misses;        /* Lookups that read the file */
+};
+
+void filemap_get_stats(struct filemap_stats *stats);
+
+#endif /* _ASTRA_MM_FILEMAP_H */
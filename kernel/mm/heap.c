@@ -1,169 +1,476 @@
 /*
  * AstraOS - Kernel Heap Implementation
- * Simple first-fit block allocator
+ * Segregated-fit block allocator
+ *
+ * The heap is a run of blocks, each a 16-byte header followed by its
+ * data, tiling the range from HEAP_START to heap_top. Free blocks sit
+ * on one of HEAP_FL_COUNT x HEAP_SL_COUNT lists by size: the first
+ * level is the power of two, the second splits it into 8 equal steps
+ * (sizes below 128 bytes get one list per 16 bytes). Two bitmaps mark
+ * the non-empty lists, so finding a free block that fits is a couple
+ * of bit scans rather than a walk of the heap.
+ *
+ * A request is rounded up to the next list boundary first, which makes
+ * any block on the list found big enough. Free blocks also leave their
+ * size in the header of the block after them (a boundary tag), so kfree
+ * merges with both neighbours in constant time.
+ *
+ * Small blocks are cached per CPU in magazines (see below), so most
+ * kmalloc/kfree calls never take heap_lock.
  */
 
 #include "heap.h"
 #include "pmm.h"
 #include "vmm.h"
+#include "vma.h"
+#include "page.h"
 #include "../lib/string.h"
 #include "../sync/spinlock.h"
+#include "../arch/x86_64/cpu.h"
+#include "../arch/x86_64/percpu.h"
 
 /*
  * Heap configuration
  */
 #define HEAP_START          0xFFFF800100000000ULL
 #define HEAP_INITIAL_SIZE   (64 * PAGE_SIZE)    /* 256 KB initial */
+#define HEAP_MAX_SIZE       (1ULL << 30)        /* 1 GB reserved */
 #define HEAP_BLOCK_MAGIC    0xDEADBEEF
 #define MIN_BLOCK_SIZE      32
 #define ALIGNMENT           16
 
+/*
+ * Free list classes
+ */
+#define HEAP_SL_BITS        3
+#define HEAP_SL_COUNT       (1 << HEAP_SL_BITS)
+#define HEAP_FL_SHIFT       (HEAP_SL_BITS + 4)  /* First level 0: below 128 bytes */
+#define HEAP_FL_COUNT       24                  /* Last level: 512 MB - 1 GB */
+
+/*
+ * Block flags
+ */
+#define HEAP_FREE           (1 << 0)    /* On a free list */
+#define HEAP_CACHED         (1 << 1)    /* In a magazine */
+
+/*
+ * Per-CPU magazines
+ * A freed block of up to HEAP_MAG_MAX bytes goes onto a per-CPU stack
+ * for its exact size and is handed out again from there, which only
+ * disables interrupts. An empty magazine is refilled with HEAP_MAG_BATCH
+ * blocks and a full one flushes its HEAP_MAG_BATCH coldest, each under
+ * one acquisition of heap_lock. A block freed on another CPU than the
+ * one it came from just joins the freeing CPU's magazine. Blocks in
+ * magazines stay allocated as far as the free lists are concerned.
+ */
+#define HEAP_MAG_MAX        256         /* Largest block size cached */
+#define HEAP_MAG_CLASSES    (HEAP_MAG_MAX / ALIGNMENT - 1)
+#define HEAP_MAG_SIZE       16          /* Blocks per magazine */
+#define HEAP_MAG_BATCH      8           /* Blocks moved per refill/flush */
+
+struct heap_magazine {
+    uint32_t count;
+    struct heap_block *blocks[HEAP_MAG_SIZE];
+};
+
+struct heap_cpu {
+    struct heap_magazine mags[HEAP_MAG_CLASSES];
+    uint64_t cached;            /* Bytes in magazines */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t flushes;
+} __attribute__((aligned(64)));
+
+static struct heap_cpu heap_cpus[MAX_CPUS];
+
 /*
  * Block header structure
  */
 struct heap_block {
     uint32_t magic;             /* Magic number for validation */
     uint32_t size;              /* Size of data area (excluding header) */
-    struct heap_block *next;    /* Next block in list */
-    struct heap_block *prev;    /* Previous block in list */
-    uint8_t free;               /* Is this block free? */
-    uint8_t padding[7];         /* Padding for alignment */
+    uint32_t prev_size;         /* Data size of the previous block if free */
+    uint16_t flags;             /* HEAP_FREE, HEAP_CACHED */
+    uint16_t prev_free;         /* Previous block free, prev_size valid */
+};
+
+/*
+ * Free list linkage (data area of a free block)
+ */
+struct heap_links {
+    struct heap_block *next;
+    struct heap_block *prev;
 };
 
 /*
  * Heap state
  */
-static struct heap_block *heap_start = NULL;
-static struct heap_block *heap_end = NULL;
+static struct heap_block *free_lists[HEAP_FL_COUNT][HEAP_SL_COUNT];
+static uint32_t fl_bitmap = 0;
+static uint8_t sl_bitmap[HEAP_FL_COUNT];
+
+static struct heap_block *heap_end = NULL;     /* Last block */
 static uint64_t heap_top = HEAP_START;
 static size_t total_allocated = 0;
+static size_t total_free = 0;
+static uint64_t free_blocks = 0;
 static spinlock_t heap_lock = SPINLOCK_INIT;
 
+static inline struct heap_links *block_links(struct heap_block *block) {
+    return (struct heap_links *)(block + 1);
+}
+
 /*
- * Expand heap by mapping more pages
+ * Block after this one, or NULL for the last block
+ */
+static inline struct heap_block *block_next(struct heap_block *block) {
+    uint64_t next = (uint64_t)(block + 1) + block->size;
+    return next < heap_top ? (struct heap_block *)next : NULL;
+}
+
+/*
+ * List of a block size (rounded down)
+ */
+static void size_class(uint32_t size, uint32_t *fl, uint32_t *sl) {
+    if (size < (1u << HEAP_FL_SHIFT)) {
+        *fl = 0;
+        *sl = size / ALIGNMENT;
+        return;
+    }
+    uint32_t msb = 31 - __builtin_clz(size);
+    *fl = msb - HEAP_FL_SHIFT + 1;
+    *sl = (size >> (msb - HEAP_SL_BITS)) & (HEAP_SL_COUNT - 1);
+}
+
+/*
+ * Free list insertion and removal (heap_lock held)
+ */
+static void list_insert(struct heap_block *block) {
+    uint32_t fl, sl;
+    size_class(block->size, &fl, &sl);
+
+    struct heap_links *links = block_links(block);
+    links->prev = NULL;
+    links->next = free_lists[fl][sl];
+    if (links->next) block_links(links->next)->prev = block;
+    free_lists[fl][sl] = block;
+
+    fl_bitmap |= 1u << fl;
+    sl_bitmap[fl] |= 1u << sl;
+    total_free += block->size;
+    free_blocks++;
+}
+
+static void list_remove(struct heap_block *block) {
+    uint32_t fl, sl;
+    size_class(block->size, &fl, &sl);
+
+    struct heap_links *links = block_links(block);
+    if (links->prev) {
+        block_links(links->prev)->next = links->next;
+    } else {
+        free_lists[fl][sl] = links->next;
+        if (!links->next) {
+            sl_bitmap[fl] &= ~(1u << sl);
+            if (!sl_bitmap[fl]) fl_bitmap &= ~(1u << fl);
+        }
+    }
+    if (links->next) block_links(links->next)->prev = links->prev;
+
+    total_free -= block->size;
+    free_blocks--;
+}
+
+/*
+ * Find a free block of at least size bytes, or NULL
+ */
+static struct heap_block *find_free(uint32_t size) {
+    /* Round up to the next list boundary: every block there fits */
+    if (size >= (1u << HEAP_FL_SHIFT)) {
+        uint32_t msb = 31 - __builtin_clz(size);
+        size += (1u << (msb - HEAP_SL_BITS)) - 1;
+    }
+
+    uint32_t fl, sl;
+    size_class(size, &fl, &sl);
+    if (fl >= HEAP_FL_COUNT) return NULL;
+
+    uint32_t sl_map = sl_bitmap[fl] & (~0u << sl);
+    if (!sl_map) {
+        uint32_t fl_map = fl_bitmap & (~0u << (fl + 1));
+        if (!fl_map) return NULL;
+        fl = __builtin_ctz(fl_map);
+        sl_map = sl_bitmap[fl];
+    }
+    return free_lists[fl][__builtin_ctz(sl_map)];
+}
+
+/*
+ * Boundary tag: tell the next block whether this one is free
+ * The tag has fields of its own: the next block may be in a magazine,
+ * whose CPU changes its flags without heap_lock.
+ */
+static void tag_next(struct heap_block *block) {
+    struct heap_block *next = block_next(block);
+    if (!next) return;
+
+    if (block->flags & HEAP_FREE) {
+        next->prev_size = block->size;
+        next->prev_free = 1;
+    } else {
+        next->prev_free = 0;
+    }
+}
+
+/*
+ * Cut a block down to size, freeing the rest if it is worth a block
+ * The block must not be on a free list, and its next block in use.
+ */
+static void block_split(struct heap_block *block, uint32_t size) {
+    if (block->size < size + sizeof(struct heap_block) + MIN_BLOCK_SIZE) return;
+
+    struct heap_block *rest = (struct heap_block *)((uint8_t *)(block + 1) + size);
+    rest->magic = HEAP_BLOCK_MAGIC;
+    rest->size = block->size - size - sizeof(struct heap_block);
+    rest->flags = HEAP_FREE;
+    rest->prev_free = 0;
+    block->size = size;
+
+    if (block == heap_end) heap_end = rest;
+    list_insert(rest);
+    tag_next(rest);
+}
+
+/*
+ * Expand heap
+ * The whole heap range is reserved up front and pages are committed
+ * by the page fault handler on first touch. Whole 2 MB stretches are
+ * still mapped eagerly with a huge page when contiguous memory is
+ * free already (no compaction is run for it); those frames are not
+ * movable.
  */
 static int heap_expand(size_t min_size) {
     size_t pages_needed = (min_size + PAGE_SIZE - 1) / PAGE_SIZE;
     if (pages_needed < 4) pages_needed = 4;  /* Minimum expansion */
 
-    for (size_t i = 0; i < pages_needed; i++) {
-        void *page = pmm_alloc_page();
-        if (!page) return -1;
+    uint64_t new_top = heap_top + pages_needed * PAGE_SIZE;
+    if (new_top > HEAP_START + HEAP_MAX_SIZE) return -1;
 
-        if (!vmm_map_page(NULL, heap_top, (uint64_t)page, PTE_WRITABLE)) {
-            pmm_free_page(page);
-            return -1;
-        }
+    uint64_t virt = (heap_top + PAGE_SIZE_2M - 1) & ~(PAGE_SIZE_2M - 1);
+    while (virt + PAGE_SIZE_2M <= new_top) {
+        size_t huge_pages = PAGE_SIZE_2M / PAGE_SIZE;
+        void *block = pmm_alloc_pages_flags(huge_pages, PMM_NOCOMPACT);
+        if (!block) break;
 
-        heap_top += PAGE_SIZE;
+        page_set_owner((uint64_t)block, huge_pages, PAGE_OWNER_HEAP);
+        if (!vmm_map_range(NULL, virt, (uint64_t)block, PAGE_SIZE_2M, PTE_WRITABLE)) {
+            pmm_free_pages(block, huge_pages);
+            break;
+        }
+        virt += PAGE_SIZE_2M;
     }
 
+    heap_top = new_top;
     return 0;
 }
 
+/*
+ * Grow the heap by a block of at least size bytes
+ * Returns the new last block (merged with a free one before it), not
+ * on a free list, or NULL if the heap is exhausted
+ */
+static struct heap_block *heap_grow(uint32_t size) {
+    uint64_t old_top = heap_top;
+    if (heap_expand(size + sizeof(struct heap_block)) < 0) return NULL;
+
+    struct heap_block *block = (struct heap_block *)old_top;
+    block->magic = HEAP_BLOCK_MAGIC;
+    block->size = heap_top - old_top - sizeof(struct heap_block);
+    block->flags = 0;
+    block->prev_free = 0;
+
+    if (heap_end && (heap_end->flags & HEAP_FREE)) {
+        list_remove(heap_end);
+        heap_end->size += sizeof(struct heap_block) + block->size;
+        block->magic = 0;
+        block = heap_end;
+    }
+    heap_end = block;
+    return block;
+}
+
 /*
  * Initialize heap
  */
 void heap_init(void) {
-    /* Map initial heap pages */
-    for (size_t i = 0; i < HEAP_INITIAL_SIZE; i += PAGE_SIZE) {
-        void *page = pmm_alloc_page();
-        if (!page) return;
-
-        vmm_map_page(NULL, HEAP_START + i, (uint64_t)page, PTE_WRITABLE);
+    /* Reserve the heap range; pages are committed on first touch */
+    if (!vma_reserve(NULL, HEAP_START, HEAP_MAX_SIZE, PTE_WRITABLE,
+                     PAGE_OWNER_HEAP, VMA_MOVABLE)) {
+        return;
     }
 
-    heap_top = HEAP_START + HEAP_INITIAL_SIZE;
+    heap_top = HEAP_START;
+    if (heap_expand(HEAP_INITIAL_SIZE) < 0) return;
 
     /* Initialize first block spanning entire heap */
-    heap_start = (struct heap_block *)HEAP_START;
-    heap_start->magic = HEAP_BLOCK_MAGIC;
-    heap_start->size = HEAP_INITIAL_SIZE - sizeof(struct heap_block);
-    heap_start->next = NULL;
-    heap_start->prev = NULL;
-    heap_start->free = 1;
-
-    heap_end = heap_start;
+    struct heap_block *block = (struct heap_block *)HEAP_START;
+    block->magic = HEAP_BLOCK_MAGIC;
+    block->size = HEAP_INITIAL_SIZE - sizeof(struct heap_block);
+    block->flags = HEAP_FREE;
+    block->prev_free = 0;
+
+    heap_end = block;
+    list_insert(block);
 }
 
 /*
- * Allocate memory
+ * Allocate a block of an aligned size (heap_lock held)
  */
-void *kmalloc(size_t size) {
-    if (size == 0) return NULL;
+static struct heap_block *block_alloc(uint32_t size) {
+    struct heap_block *block = find_free(size);
+    if (block) {
+        list_remove(block);
+    } else {
+        /* No suitable block found, expand heap */
+        block = heap_grow(size);
+        if (!block) return NULL;
+    }
 
-    /* Align size */
-    size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
-    if (size < MIN_BLOCK_SIZE) size = MIN_BLOCK_SIZE;
+    block->flags &= ~HEAP_FREE;
+    tag_next(block);
+    block_split(block, size);
+    total_allocated += block->size;
+    return block;
+}
 
-    uint64_t flags;
-    spinlock_acquire_irqsave(&heap_lock, &flags);
+/*
+ * Free a block, merging it with free neighbours (heap_lock held)
+ */
+static void block_free(struct heap_block *block) {
+    total_allocated -= block->size;
 
-    /* First-fit search */
-    struct heap_block *block = heap_start;
-    while (block) {
-        if (block->free && block->size >= size) {
-            /* Check if we can split */
-            if (block->size >= size + sizeof(struct heap_block) + MIN_BLOCK_SIZE) {
-                /* Split block */
-                struct heap_block *new_block = (struct heap_block *)
-                    ((uint8_t *)block + sizeof(struct heap_block) + size);
-
-                new_block->magic = HEAP_BLOCK_MAGIC;
-                new_block->size = block->size - size - sizeof(struct heap_block);
-                new_block->next = block->next;
-                new_block->prev = block;
-                new_block->free = 1;
-
-                if (block->next) {
-                    block->next->prev = new_block;
-                }
-                block->next = new_block;
-                block->size = size;
-
-                if (block == heap_end) {
-                    heap_end = new_block;
-                }
-            }
-
-            block->free = 0;
-            total_allocated += block->size;
+    /* Coalesce with next block if free */
+    struct heap_block *next = block_next(block);
+    if (next && (next->flags & HEAP_FREE)) {
+        list_remove(next);
+        block->size += sizeof(struct heap_block) + next->size;
+        next->magic = 0;
+        if (next == heap_end) heap_end = block;
+    }
 
-            spinlock_release_irqrestore(&heap_lock, flags);
-            return (void *)((uint8_t *)block + sizeof(struct heap_block));
-        }
-        block = block->next;
+    /* Coalesce with previous block if free (found through its tag) */
+    if (block->prev_free) {
+        struct heap_block *prev = (struct heap_block *)
+            ((uint8_t *)block - block->prev_size - sizeof(struct heap_block));
+        list_remove(prev);
+        prev->size += sizeof(struct heap_block) + block->size;
+        block->magic = 0;
+        if (block == heap_end) heap_end = prev;
+        block = prev;
     }
 
-    /* No suitable block found, expand heap */
-    size_t expand_size = size + sizeof(struct heap_block);
-    if (heap_expand(expand_size) < 0) {
-        spinlock_release_irqrestore(&heap_lock, flags);
-        return NULL;
+    block->flags |= HEAP_FREE;
+    list_insert(block);
+    tag_next(block);
+}
+
+/*
+ * Magazine of a block size
+ */
+static inline struct heap_magazine *mag_of(struct heap_cpu *cpu, uint32_t size) {
+    return &cpu->mags[size / ALIGNMENT - MIN_BLOCK_SIZE / ALIGNMENT];
+}
+
+/*
+ * Allocate from this CPU's magazine, refilling it when empty
+ */
+static void *mag_alloc(uint32_t size) {
+    uint64_t flags = cpu_save_flags();
+    cpu_cli();
+
+    struct heap_cpu *cpu = &heap_cpus[cpu_current_id()];
+    struct heap_magazine *mag = mag_of(cpu, size);
+
+    if (mag->count == 0) {
+        cpu->misses++;
+        spinlock_acquire(&heap_lock);
+        while (mag->count < HEAP_MAG_BATCH) {
+            struct heap_block *block = block_alloc(size);
+            if (!block) break;
+            block->flags |= HEAP_CACHED;
+            cpu->cached += block->size;
+            mag->blocks[mag->count++] = block;
+        }
+        spinlock_release(&heap_lock);
+
+        if (mag->count == 0) {
+            cpu_restore_flags(flags);
+            return NULL;
+        }
+    } else {
+        cpu->hits++;
     }
 
-    /* Create new block at end */
-    struct heap_block *new_block = (struct heap_block *)
-        ((uint8_t *)heap_end + sizeof(struct heap_block) + heap_end->size);
+    struct heap_block *block = mag->blocks[--mag->count];
+    block->flags &= ~HEAP_CACHED;
+    cpu->cached -= block->size;
 
-    /* Check if this is in the newly mapped area */
-    if ((uint64_t)new_block >= heap_top) {
-        spinlock_release_irqrestore(&heap_lock, flags);
-        return NULL;
+    cpu_restore_flags(flags);
+    return block + 1;
+}
+
+/*
+ * Free into this CPU's magazine, flushing the coldest blocks when full
+ */
+static void mag_free(struct heap_block *block) {
+    uint64_t flags = cpu_save_flags();
+    cpu_cli();
+
+    struct heap_cpu *cpu = &heap_cpus[cpu_current_id()];
+    struct heap_magazine *mag = mag_of(cpu, block->size);
+
+    block->flags |= HEAP_CACHED;
+    cpu->cached += block->size;
+    mag->blocks[mag->count++] = block;
+
+    if (mag->count == HEAP_MAG_SIZE) {
+        spinlock_acquire(&heap_lock);
+        for (uint32_t i = 0; i < HEAP_MAG_BATCH; i++) {
+            struct heap_block *cold = mag->blocks[i];
+            cold->flags &= ~HEAP_CACHED;
+            cpu->cached -= cold->size;
+            block_free(cold);
+        }
+        spinlock_release(&heap_lock);
+
+        for (uint32_t i = HEAP_MAG_BATCH; i < HEAP_MAG_SIZE; i++) {
+            mag->blocks[i - HEAP_MAG_BATCH] = mag->blocks[i];
+        }
+        mag->count -= HEAP_MAG_BATCH;
+        cpu->flushes++;
     }
 
-    new_block->magic = HEAP_BLOCK_MAGIC;
-    new_block->size = heap_top - (uint64_t)new_block - sizeof(struct heap_block);
-    new_block->next = NULL;
-    new_block->prev = heap_end;
-    new_block->free = 1;
+    cpu_restore_flags(flags);
+}
+
+/*
+ * Allocate memory
+ */
+void *kmalloc(size_t size) {
+    if (size == 0 || size > HEAP_MAX_SIZE) return NULL;
 
-    heap_end->next = new_block;
-    heap_end = new_block;
+    /* Align size */
+    size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    if (size < MIN_BLOCK_SIZE) size = MIN_BLOCK_SIZE;
 
-    /* Retry allocation */
+    if (size <= HEAP_MAG_MAX) return mag_alloc(size);
+
+    uint64_t flags;
+    spinlock_acquire_irqsave(&heap_lock, &flags);
+    struct heap_block *block = block_alloc(size);
     spinlock_release_irqrestore(&heap_lock, flags);
-    return kmalloc(size);
+
+    return block ? block + 1 : NULL;
 }
 
 /*
@@ -188,8 +495,7 @@ void *krealloc(void *ptr, size_t new_size) {
         return NULL;
     }
 
-    struct heap_block *block = (struct heap_block *)
-        ((uint8_t *)ptr - sizeof(struct heap_block));
+    struct heap_block *block = (struct heap_block *)ptr - 1;
 
     if (block->magic != HEAP_BLOCK_MAGIC) {
         return NULL;  /* Invalid pointer */
@@ -199,6 +505,33 @@ void *krealloc(void *ptr, size_t new_size) {
         return ptr;  /* Already big enough */
     }
 
+    /* Grow in place into a free block after this one */
+    if (new_size <= HEAP_MAX_SIZE) {
+        uint32_t size = (new_size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+
+        uint64_t flags;
+        spinlock_acquire_irqsave(&heap_lock, &flags);
+
+        struct heap_block *next = block_next(block);
+        if (next && (next->flags & HEAP_FREE) &&
+            block->size + sizeof(struct heap_block) + next->size >= size) {
+            list_remove(next);
+            total_allocated -= block->size;
+            block->size += sizeof(struct heap_block) + next->size;
+            next->magic = 0;
+            if (next == heap_end) heap_end = block;
+
+            tag_next(block);
+            block_split(block, size);
+            total_allocated += block->size;
+
+            spinlock_release_irqrestore(&heap_lock, flags);
+            return ptr;
+        }
+
+        spinlock_release_irqrestore(&heap_lock, flags);
+    }
+
     /* Allocate new block and copy */
     void *new_ptr = kmalloc(new_size);
     if (new_ptr) {
@@ -214,61 +547,75 @@ void *krealloc(void *ptr, size_t new_size) {
 void kfree(void *ptr) {
     if (!ptr) return;
 
-    struct heap_block *block = (struct heap_block *)
-        ((uint8_t *)ptr - sizeof(struct heap_block));
+    struct heap_block *block = (struct heap_block *)ptr - 1;
 
     if (block->magic != HEAP_BLOCK_MAGIC) {
         return;  /* Invalid pointer */
     }
 
-    uint64_t flags;
-    spinlock_acquire_irqsave(&heap_lock, &flags);
-
-    block->free = 1;
-    total_allocated -= block->size;
-
-    /* Coalesce with next block if free */
-    if (block->next && block->next->free) {
-        block->size += sizeof(struct heap_block) + block->next->size;
-        block->next = block->next->next;
-        if (block->next) {
-            block->next->prev = block;
-        }
-        if (heap_end == block->next) {
-            heap_end = block;
-        }
+    if (block->flags & (HEAP_FREE | HEAP_CACHED)) {
+        return;  /* Already free */
     }
 
-    /* Coalesce with previous block if free */
-    if (block->prev && block->prev->free) {
-        block->prev->size += sizeof(struct heap_block) + block->size;
-        block->prev->next = block->next;
-        if (block->next) {
-            block->next->prev = block->prev;
-        }
-        if (heap_end == block) {
-            heap_end = block->prev;
-        }
+    if (block->size <= HEAP_MAG_MAX) {
+        mag_free(block);
+        return;
     }
 
+    uint64_t flags;
+    spinlock_acquire_irqsave(&heap_lock, &flags);
+    block_free(block);
     spinlock_release_irqrestore(&heap_lock, flags);
 }
 
 /*
  * Statistics
+ * Blocks in magazines count as free.
  */
+static uint64_t mag_cached_bytes(void) {
+    uint64_t cached = 0;
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        cached += heap_cpus[i].cached;
+    }
+    return cached;
+}
+
 size_t heap_get_used(void) {
-    return total_allocated;
+    return total_allocated - mag_cached_bytes();
 }
 
 size_t heap_get_free(void) {
-    size_t free = 0;
-    struct heap_block *block = heap_start;
-    while (block) {
-        if (block->free) {
-            free += block->size;
+    return total_free + mag_cached_bytes();
+}
+
+void heap_get_stats(struct heap_stats *stats) {
+    uint64_t flags;
+    spinlock_acquire_irqsave(&heap_lock, &flags);
+
+    stats->cached = mag_cached_bytes();
+    stats->size = heap_top - HEAP_START;
+    stats->used = total_allocated - stats->cached;
+    stats->free = total_free;
+    stats->free_blocks = free_blocks;
+
+    stats->mag_hits = 0;
+    stats->mag_misses = 0;
+    stats->mag_flushes = 0;
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        stats->mag_hits += heap_cpus[i].hits;
+        stats->mag_misses += heap_cpus[i].misses;
+        stats->mag_flushes += heap_cpus[i].flushes;
+    }
+
+    /* Largest free block: on the highest non-empty list */
+    stats->largest_free = 0;
+    if (fl_bitmap) {
+        uint32_t fl = 31 - __builtin_clz(fl_bitmap);
+        uint32_t sl = 31 - __builtin_clz(sl_bitmap[fl]);
+        for (struct heap_block *b = free_lists[fl][sl]; b; b = block_links(b)->next) {
+            if (b->size > stats->largest_free) stats->largest_free = b->size;
         }
-        block = block->next;
     }
-    return free;
+
+    spinlock_release_irqrestore(&heap_lock, flags);
 }
@@ -1,6 +1,6 @@
 /*
  * AstraOS - Kernel Heap Header
- * Simple block allocator for kmalloc/kfree
+ * Segregated-fit block allocator for kmalloc/kfree
  */
 
 #ifndef _ASTRA_MM_HEAP_H
@@ -40,4 +40,18 @@ void kfree(void *ptr);
 size_t heap_get_used(void);
 size_t heap_get_free(void);
 
+struct heap_stats {
+    uint64_t size;          /* Bytes of heap range in use */
+    uint64_t used;          /* Bytes allocated */
+    uint64_t free;          /* Bytes in free blocks */
+    uint64_t free_blocks;
+    uint64_t largest_free;  /* Largest free block */
+    uint64_t cached;        /* Bytes in per-CPU magazines */
+    uint64_t mag_hits;      /* Small requests served by a magazine */
+    uint64_t mag_misses;    /* ... that had to refill it */
+    uint64_t mag_flushes;   /* Full magazines flushed to the free lists */
+};
+
+void heap_get_stats(struct heap_stats *stats);
+
 #endif /* _ASTRA_MM_HEAP_H */
@@ -0,0 +1,259 @@
+/*
+ * AstraOS - NUMA Topology Implementation
+ * Memory and CPU node affinity from the ACPI SRAT/SLIT
+ *
+ * The SRAT is copied into small static tables at init, so nothing
+ * keeps referencing ACPI memory afterwards. ACPI proximity domains are
+ * renumbered into dense node IDs in the order they are first seen.
+ */
+
+#include "numa.h"
+#include "pmm.h"
+#include "../drivers/acpi.h"
+#include "../arch/x86_64/percpu.h"
+#include "../lib/stdio.h"
+
+/*
+ * Memory range owned by a node, in pages [start, end)
+ */
+struct numa_range {
+    uint64_t start;
+    uint64_t end;
+    uint32_t node;
+};
+
+/*
+ * CPU to node mapping
+ */
+struct numa_cpu {
+    uint32_t apic_id;
+    uint32_t node;
+};
+
+/*
+ * Topology state
+ */
+static struct numa_range ranges[NUMA_MAX_RANGES];
+static uint32_t range_count = 0;
+
+static struct numa_cpu cpus[MAX_CPUS * 4];
+static uint32_t cpu_count = 0;
+
+static uint32_t domains[NUMA_MAX_NODES];    /* Proximity domain of each node */
+static uint32_t node_count = 1;
+
+static uint8_t distances[NUMA_MAX_NODES][NUMA_MAX_NODES];
+static uint32_t fallback[NUMA_MAX_NODES][NUMA_MAX_NODES];
+
+/*
+ * Map a proximity domain to a node ID, allocating a new one if needed
+ * Returns NUMA_MAX_NODES if the table is full
+ */
+static uint32_t domain_to_node(uint32_t domain, uint32_t *count) {
+    for (uint32_t i = 0; i < *count; i++) {
+        if (domains[i] == domain) return i;
+    }
+    if (*count >= NUMA_MAX_NODES) return NUMA_MAX_NODES;
+    domains[*count] = domain;
+    return (*count)++;
+}
+
+/*
+ * Parse SRAT affinity structures
+ * Returns number of nodes found (0 if there is no usable SRAT)
+ */
+static uint32_t numa_parse_srat(void) {
+    struct acpi_srat *srat = acpi_get_table("SRAT");
+    if (!srat) return 0;
+
+    uint32_t nodes = 0;
+    uint8_t *ptr = (uint8_t *)srat + sizeof(struct acpi_srat);
+    uint8_t *end = (uint8_t *)srat + srat->header.length;
+
+    while (ptr + sizeof(struct acpi_srat_entry) <= end) {
+        struct acpi_srat_entry *entry = (struct acpi_srat_entry *)ptr;
+        if (entry->length < sizeof(struct acpi_srat_entry) || ptr + entry->length > end) {
+            break;
+        }
+
+        if (entry->type == ACPI_SRAT_TYPE_MEMORY_AFFINITY) {
+            struct acpi_srat_memory_affinity *mem = (void *)entry;
+            if ((mem->flags & ACPI_SRAT_ENABLED) && mem->length &&
+                range_count < NUMA_MAX_RANGES) {
+                uint32_t node = domain_to_node(mem->proximity_domain, &nodes);
+                if (node < NUMA_MAX_NODES) {
+                    ranges[range_count].start = PAGE_ALIGN_UP(mem->base_address) / PAGE_SIZE;
+                    ranges[range_count].end =
+                        PAGE_ALIGN_DOWN(mem->base_address + mem->length) / PAGE_SIZE;
+                    ranges[range_count].node = node;
+                    range_count++;
+                }
+            }
+        } else if (entry->type == ACPI_SRAT_TYPE_CPU_AFFINITY) {
+            struct acpi_srat_cpu_affinity *cpu = (void *)entry;
+            uint32_t domain = cpu->proximity_domain_lo |
+                              (cpu->proximity_domain_hi[0] << 8) |
+                              (cpu->proximity_domain_hi[1] << 16) |
+                              (cpu->proximity_domain_hi[2] << 24);
+            if ((cpu->flags & ACPI_SRAT_ENABLED) &&
+                cpu_count < sizeof(cpus) / sizeof(cpus[0])) {
+                uint32_t node = domain_to_node(domain, &nodes);
+                if (node < NUMA_MAX_NODES) {
+                    cpus[cpu_count].apic_id = cpu->apic_id;
+                    cpus[cpu_count].node = node;
+                    cpu_count++;
+                }
+            }
+        } else if (entry->type == ACPI_SRAT_TYPE_X2APIC_AFFINITY) {
+            struct acpi_srat_x2apic_affinity *cpu = (void *)entry;
+            if ((cpu->flags & ACPI_SRAT_ENABLED) &&
+                cpu_count < sizeof(cpus) / sizeof(cpus[0])) {
+                uint32_t node = domain_to_node(cpu->proximity_domain, &nodes);
+                if (node < NUMA_MAX_NODES) {
+                    cpus[cpu_count].apic_id = cpu->x2apic_id;
+                    cpus[cpu_count].node = node;
+                    cpu_count++;
+                }
+            }
+        }
+
+        ptr += entry->length;
+    }
+
+    return nodes;
+}
+
+/*
+ * Fill the distance matrix from the SLIT, or with defaults
+ */
+static void numa_parse_slit(void) {
+    for (uint32_t i = 0; i < node_count; i++) {
+        for (uint32_t j = 0; j < node_count; j++) {
+            distances[i][j] = (i == j) ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+        }
+    }
+
+    struct acpi_slit *slit = acpi_get_table("SLIT");
+    if (!slit) return;
+
+    uint64_t localities = slit->locality_count;
+    if (sizeof(struct acpi_slit) + localities * localities > slit->header.length) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < node_count; i++) {
+        for (uint32_t j = 0; j < node_count; j++) {
+            if (domains[i] < localities && domains[j] < localities) {
+                distances[i][j] = slit->entries[domains[i] * localities + domains[j]];
+            }
+        }
+    }
+}
+
+/*
+ * Fallback ordering: nearer first, the node itself first on ties
+ */
+static int fallback_before(uint32_t node, uint32_t a, uint32_t b) {
+    if (distances[node][a] != distances[node][b]) {
+        return distances[node][a] < distances[node][b];
+    }
+    if (a == node || b == node) {
+        return a == node;
+    }
+    return a < b;
+}
+
+/*
+ * Build per-node fallback lists sorted by distance
+ */
+static void numa_build_fallback(void) {
+    for (uint32_t node = 0; node < node_count; node++) {
+        /* Insertion sort */
+        for (uint32_t i = 0; i < node_count; i++) {
+            uint32_t j = i;
+            while (j > 0 && fallback_before(node, i, fallback[node][j - 1])) {
+                fallback[node][j] = fallback[node][j - 1];
+                j--;
+            }
+            fallback[node][j] = i;
+        }
+    }
+}
+
+/*
+ * Initialize NUMA topology
+ */
+void numa_init(void) {
+    node_count = 1;
+    range_count = 0;
+    cpu_count = 0;
+    distances[0][0] = NUMA_LOCAL_DISTANCE;
+    fallback[0][0] = 0;
+
+    uint32_t nodes = numa_parse_srat();
+    if (nodes <= 1 || range_count == 0) {
+        range_count = 0;
+        cpu_count = 0;
+        kprintf("NUMA: No SRAT topology, using a single node\n");
+        return;
+    }
+
+    node_count = nodes;
+    numa_parse_slit();
+    numa_build_fallback();
+
+    /* Place the boot CPU on its node */
+    struct percpu *cpu = percpu_get();
+    cpu->numa_node = numa_node_of_apic(cpu->apic_id);
+
+    for (uint32_t i = 0; i < range_count; i++) {
+        kprintf("NUMA: Node %u: 0x%llx - 0x%llx\n", ranges[i].node,
+                ranges[i].start * PAGE_SIZE, ranges[i].end * PAGE_SIZE);
+    }
+    kprintf("NUMA: %u nodes, boot CPU on node %u\n", node_count, cpu->numa_node);
+
+    /* Move free memory into per-node pools */
+    pmm_numa_rebuild();
+}
+
+/*
+ * Topology queries
+ */
+uint32_t numa_node_count(void) {
+    return node_count;
+}
+
+uint32_t numa_node_of_page(uint64_t page, uint64_t *range_end) {
+    uint64_t next_start = UINT64_MAX;
+
+    for (uint32_t i = 0; i < range_count; i++) {
+        if (page >= ranges[i].start && page < ranges[i].end) {
+            if (range_end) *range_end = ranges[i].end;
+            return ranges[i].node;
+        }
+        if (ranges[i].start > page && ranges[i].start < next_start) {
+            next_start = ranges[i].start;
+        }
+    }
+
+    /* Not described by the SRAT: treat as node 0 up to the next range */
+    if (range_end) *range_end = next_start;
+    return 0;
+}
+
+uint32_t numa_node_of_apic(uint32_t apic_id) {
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        if (cpus[i].apic_id == apic_id) return cpus[i].node;
+    }
+    return 0;
+}
+
+uint8_t numa_distance(uint32_t from, uint32_t to) {
+    if (from >= node_count || to >= node_count) return NUMA_REMOTE_DISTANCE;
+    return distances[from][to];
+}
+
+const uint32_t *numa_fallback_order(uint32_t node) {
+    if (node >= node_count) node = 0;
+    return fallback[node];
+}
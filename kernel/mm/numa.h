@@ -0,0 +1,58 @@
+/*
+ * AstraOS - NUMA Topology Header
+ * Memory and CPU node affinity from the ACPI SRAT/SLIT
+ */
+
+#ifndef _ASTRA_MM_NUMA_H
+#define _ASTRA_MM_NUMA_H
+
+#include <stdint.h>
+
+/*
+ * Topology limits
+ */
+#define NUMA_MAX_NODES          8
+#define NUMA_MAX_RANGES         32
+
+/*
+ * SLIT distances (10 = local)
+ */
+#define NUMA_LOCAL_DISTANCE     10
+#define NUMA_REMOTE_DISTANCE    20
+
+/*
+ * Parse SRAT/SLIT and split the PMM into per-node pools
+ * Must run after acpi_init(). Without an SRAT the system
+ * stays a single node 0 covering all memory.
+ */
+void numa_init(void);
+
+/*
+ * Get number of memory nodes (at least 1)
+ */
+uint32_t numa_node_count(void);
+
+/*
+ * Get node of a physical page (frame number)
+ * If range_end is not NULL it receives the first page past the
+ * contiguous stretch that belongs to the same node.
+ */
+uint32_t numa_node_of_page(uint64_t page, uint64_t *range_end);
+
+/*
+ * Get node of a CPU by local APIC ID
+ */
+uint32_t numa_node_of_apic(uint32_t apic_id);
+
+/*
+ * Get relative distance between two nodes
+ */
+uint8_t numa_distance(uint32_t from, uint32_t to);
+
+/*
+ * Get allocation fallback order for a node
+ * Returns numa_node_count() node IDs sorted by distance, nearest first
+ */
+const uint32_t *numa_fallback_order(uint32_t node);
+
+#endif /* _ASTRA_MM_NUMA_H */
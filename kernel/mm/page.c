@@ -0,0 +1,299 @@
+/*
+ * AstraOS - Page Descriptor Implementation
+ * Per-frame metadata (struct page) with refcounts and owners
+ *
+ * The descriptors form one virtually contiguous array at PAGE_MAP_VBASE
+ * indexed by frame number. Only the pages of the array that describe
+ * RAM from the memory map are mapped, so physical holes need no
+ * backing memory. A bitmap of the 2 MB chunks that are wholly RAM
+ * lets page_of() check a frame with one bit test; only frames in the
+ * chunks at the edges of RAM ranges search the range list.
+ */
+
+#include "page.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "../lib/string.h"
+
+_Static_assert(sizeof(struct page) == 32, "struct page must stay 32 bytes");
+
+/*
+ * Frame ranges covered by descriptors, [start, end)
+ */
+#define PAGE_MAX_RANGES     64
+
+struct page_range {
+    uint64_t start;
+    uint64_t end;
+};
+
+static struct page_range ranges[PAGE_MAX_RANGES];
+static uint32_t range_count = 0;
+
+/*
+ * 2 MB chunks covered by descriptors throughout
+ */
+#define PAGE_CHUNK_FRAMES   (PAGE_SIZE_2M / PAGE_SIZE)
+
+static uint64_t *chunk_map = NULL;
+static uint64_t chunk_count = 0;
+
+bool page_map_ready = false;
+
+/*
+ * Back the descriptors of frames [start, end) with zeroed pages
+ */
+static bool page_map_range(uint64_t start, uint64_t end) {
+    uint64_t virt = PAGE_ALIGN_DOWN((uint64_t)pfn_to_page(start));
+    uint64_t virt_end = PAGE_ALIGN_UP((uint64_t)pfn_to_page(end));
+
+    for (; virt < virt_end; virt += PAGE_SIZE) {
+        if (vmm_virt_to_phys(NULL, virt)) continue;
+
+        void *phys = pmm_alloc_pages_flags(1, PMM_ZERO);
+        if (!phys) return false;
+        if (!vmm_map_page(NULL, virt, (uint64_t)phys, PTE_WRITABLE | PTE_NX)) {
+            pmm_free_page(phys);
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Build the chunk bitmap from the ranges
+ * Without it page_of() falls back to searching the ranges.
+ */
+static void page_map_chunks(void) {
+    if (range_count == 0) return;
+
+    uint64_t count = ranges[range_count - 1].end / PAGE_CHUNK_FRAMES;
+    size_t pages = PAGE_ALIGN_UP((count + 63) / 64 * sizeof(uint64_t)) / PAGE_SIZE;
+    void *phys = pmm_alloc_pages_flags(pages, PMM_ZERO);
+    if (!phys) return;
+
+    uint64_t *map = vmm_phys_to_virt((uint64_t)phys);
+    for (uint32_t i = 0; i < range_count; i++) {
+        uint64_t chunk = (ranges[i].start + PAGE_CHUNK_FRAMES - 1) / PAGE_CHUNK_FRAMES;
+        uint64_t chunk_end = ranges[i].end / PAGE_CHUNK_FRAMES;
+        for (; chunk < chunk_end; chunk++) {
+            map[chunk / 64] |= 1ULL << (chunk % 64);
+        }
+    }
+
+    chunk_map = map;
+    chunk_count = count;
+}
+
+/*
+ * Check whether a memory map entry is RAM the PMM manages
+ */
+static bool page_entry_managed(struct limine_memmap_entry *entry) {
+    return entry->type == LIMINE_MEMMAP_USABLE ||
+           entry->type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE ||
+           entry->type == LIMINE_MEMMAP_ACPI_RECLAIMABLE;
+}
+
+/*
+ * Initialize the descriptor array
+ */
+void page_init(struct limine_memmap_response *memmap) {
+    range_count = 0;
+
+    /* Map the array first, since that allocates frames itself */
+    for (uint64_t i = 0; i < memmap->entry_count; i++) {
+        struct limine_memmap_entry *entry = memmap->entries[i];
+        if (!page_entry_managed(entry)) continue;
+
+        uint64_t start = PAGE_ALIGN_UP(entry->base) / PAGE_SIZE;
+        uint64_t end = PAGE_ALIGN_DOWN(entry->base + entry->length) / PAGE_SIZE;
+        if (start >= end) continue;
+        if (!page_map_range(start, end)) return;
+
+        /* Merge with the previous range when adjacent */
+        if (range_count > 0 && ranges[range_count - 1].end == start) {
+            ranges[range_count - 1].end = end;
+        } else if (range_count < PAGE_MAX_RANGES) {
+            ranges[range_count].start = start;
+            ranges[range_count].end = end;
+            range_count++;
+        }
+    }
+
+    /* Record what is already in use */
+    for (uint64_t i = 0; i < memmap->entry_count; i++) {
+        struct limine_memmap_entry *entry = memmap->entries[i];
+        if (!page_entry_managed(entry)) continue;
+
+        uint64_t start = PAGE_ALIGN_UP(entry->base) / PAGE_SIZE;
+        uint64_t end = PAGE_ALIGN_DOWN(entry->base + entry->length) / PAGE_SIZE;
+        bool usable = entry->type == LIMINE_MEMMAP_USABLE;
+
+        for (uint64_t pfn = start; pfn < end; pfn++) {
+            struct page *page = pfn_to_page(pfn);
+            if (!usable || pmm_page_in_use(pfn)) {
+                page->owner = usable ? PAGE_OWNER_KERNEL : PAGE_OWNER_BOOT;
+                page->refcount = 1;
+            }
+        }
+    }
+
+    page_map_chunks();
+    page_map_ready = true;
+
+    /* Tag the pages backing the array and the chunk bitmap */
+    if (chunk_map) {
+        size_t bytes = (chunk_count + 63) / 64 * sizeof(uint64_t);
+        page_set_owner(vmm_direct_to_phys(chunk_map), PAGE_ALIGN_UP(bytes) / PAGE_SIZE,
+                       PAGE_OWNER_PAGEMAP);
+    }
+    for (uint32_t i = 0; i < range_count; i++) {
+        uint64_t virt = PAGE_ALIGN_DOWN((uint64_t)pfn_to_page(ranges[i].start));
+        uint64_t virt_end = PAGE_ALIGN_UP((uint64_t)pfn_to_page(ranges[i].end));
+        for (; virt < virt_end; virt += PAGE_SIZE) {
+            page_set_owner(vmm_virt_to_phys(NULL, virt), 1, PAGE_OWNER_PAGEMAP);
+        }
+    }
+}
+
+/*
+ * Get descriptor of a physical address
+ */
+struct page *page_of(uint64_t phys) {
+    if (!page_map_ready) return NULL;
+
+    uint64_t pfn = phys / PAGE_SIZE;
+    uint64_t chunk = pfn / PAGE_CHUNK_FRAMES;
+    if (chunk < chunk_count && (chunk_map[chunk / 64] & (1ULL << (chunk % 64)))) {
+        return pfn_to_page(pfn);
+    }
+
+    /* Edge of a range, or not RAM */
+    for (uint32_t i = 0; i < range_count; i++) {
+        if (pfn >= ranges[i].start && pfn < ranges[i].end) {
+            return pfn_to_page(pfn);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Reference counting
+ */
+void page_get(struct page *page) {
+    if (!page) return;
+    __atomic_add_fetch(&page->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void page_put(struct page *page) {
+    if (!page) return;
+    if (__atomic_sub_fetch(&page->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        pmm_free_page((void *)page_to_phys(page));
+    }
+}
+
+/*
+ * Tag a run of allocated frames with an owner
+ */
+void page_set_owner(uint64_t phys, size_t count, uint16_t owner) {
+    struct page *page = page_of(phys);
+    if (!page) return;
+
+    for (size_t i = 0; i < count; i++) {
+        page[i].owner = owner;
+    }
+}
+
+/*
+ * Mark a frame as migratable
+ */
+void page_set_movable(uint64_t phys, uint64_t virt) {
+    struct page *page = page_of(phys);
+    if (!page) return;
+
+    /* Atomic: compaction may be marking the frame meanwhile */
+    __atomic_fetch_or(&page->flags, PAGE_FLAG_MOVABLE, __ATOMIC_RELAXED);
+    page->private = virt;
+}
+
+/*
+ * Movable frame scan
+ */
+struct page *page_next_movable(uint64_t *pfn, uint64_t max) {
+    if (!page_map_ready || range_count == 0) return NULL;
+
+    uint64_t next = *pfn + 1;
+    uint32_t i = 0;
+    while (i < range_count && next >= ranges[i].end) {
+        i++;
+    }
+
+    for (uint64_t n = 0; n < max; n++, next++) {
+        if (i == range_count) {
+            i = 0;
+            next = ranges[0].start;
+        } else if (next < ranges[i].start) {
+            next = ranges[i].start;
+        }
+
+        struct page *page = pfn_to_page(next);
+        if (page->flags & PAGE_FLAG_MOVABLE) {
+            *pfn = next;
+            return page;
+        }
+        if (next + 1 == ranges[i].end) i++;
+    }
+
+    *pfn = next - 1;
+    return NULL;
+}
+
+/*
+ * PMM hooks
+ */
+void page_mark_allocated(uint64_t pfn, size_t count) {
+    if (!page_map_ready) return;
+
+    for (size_t i = 0; i < count; i++) {
+        struct page *page = page_of((pfn + i) * PAGE_SIZE);
+        if (!page) continue;  /* Hole: no descriptor */
+
+        page->flags = 0;
+        page->owner = PAGE_OWNER_KERNEL;
+        page->refcount = 1;
+        page->private = 0;
+        page->next = NULL;
+        page->prev = NULL;
+    }
+}
+
+void page_mark_free(uint64_t pfn, size_t count) {
+    if (!page_map_ready) return;
+
+    for (size_t i = 0; i < count; i++) {
+        struct page *page = page_of((pfn + i) * PAGE_SIZE);
+        if (!page) continue;
+
+        page->flags = 0;
+        page->owner = PAGE_OWNER_FREE;
+        page->refcount = 0;
+        page->private = 0;
+    }
+}
+
+/*
+ * Per-owner frame counts
+ */
+void page_get_owner_stats(uint64_t *counts) {
+    memset(counts, 0, PAGE_OWNER_COUNT * sizeof(uint64_t));
+    if (!page_map_ready) return;
+
+    for (uint32_t i = 0; i < range_count; i++) {
+        for (uint64_t pfn = ranges[i].start; pfn < ranges[i].end; pfn++) {
+            uint16_t owner = pfn_to_page(pfn)->owner;
+            if (owner < PAGE_OWNER_COUNT) {
+                counts[owner]++;
+            }
+        }
+    }
+}
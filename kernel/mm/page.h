@@ -0,0 +1,144 @@
+/*
+ * AstraOS - Page Descriptor Header
+ * Per-frame metadata (struct page) with refcounts and owners
+ */
+
+#ifndef _ASTRA_MM_PAGE_H
+#define _ASTRA_MM_PAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "../limine.h"
+#include "../sync/spinlock.h"
+
+/*
+ * Virtual base of the descriptor array
+ * Descriptor N describes physical frame N. Only the parts of the array
+ * that cover RAM are backed by memory, so holes in the physical
+ * address space cost nothing.
+ */
+#define PAGE_MAP_VBASE      0xFFFFEA0000000000ULL
+
+/*
+ * Page flags
+ */
+#define PAGE_FLAG_MOVABLE   (1 << 0)    /* Only reached through the kernel mapping
+                                           at private, may be migrated */
+#define PAGE_FLAG_NOSWAP    (1 << 1)    /* Swap-out failed; retried once the page
+                                           is written again */
+#define PAGE_FLAG_ISOLATED  (1 << 2)    /* In a window being compacted; freed
+                                           frames go back to the compaction */
+
+/*
+ * Page owners (who allocated the frame)
+ */
+#define PAGE_OWNER_FREE         0   /* On the PMM free lists or caches */
+#define PAGE_OWNER_BOOT         1   /* Bootloader/ACPI memory not yet reclaimed */
+#define PAGE_OWNER_KERNEL       2   /* Untagged kernel allocation */
+#define PAGE_OWNER_PAGETABLE    3   /* Page table pages */
+#define PAGE_OWNER_HEAP         4   /* Kernel heap */
+#define PAGE_OWNER_STACK        5   /* Process kernel stacks */
+#define PAGE_OWNER_PAGEMAP      6   /* This descriptor array */
+#define PAGE_OWNER_PAGECACHE    7   /* File pages in the page cache */
+#define PAGE_OWNER_ZRAM         8   /* Compressed page store */
+#define PAGE_OWNER_SLAB         9   /* Object cache slabs */
+#define PAGE_OWNER_COUNT        10
+
+/*
+ * Page descriptor (32 bytes)
+ */
+struct page {
+    uint16_t flags;         /* PAGE_FLAG_* */
+    uint16_t owner;         /* PAGE_OWNER_* */
+    uint32_t refcount;      /* 0 = free */
+    uint64_t private;       /* Owner-specific data */
+    union {
+        struct {
+            struct page *next;  /* Owner-managed list linkage */
+            struct page *prev;
+        };
+        struct {
+            spinlock_t ptl;     /* PML4 frames: lock of the address space */
+            uint32_t cpus;      /* PML4 frames: CPUs with it loaded */
+            uint64_t *reap_next;    /* PML4 frames: next one queued for teardown */
+        };
+    };
+};
+
+/*
+ * Set once the descriptor array is mapped
+ */
+extern bool page_map_ready;
+
+/*
+ * Initialize the descriptor array
+ * Must run after vmm_init() and before the memory map is reclaimed.
+ */
+void page_init(struct limine_memmap_response *memmap);
+
+/*
+ * Frame number <-> descriptor
+ */
+static inline struct page *pfn_to_page(uint64_t pfn) {
+    return (struct page *)PAGE_MAP_VBASE + pfn;
+}
+
+static inline uint64_t page_to_pfn(struct page *page) {
+    return page - (struct page *)PAGE_MAP_VBASE;
+}
+
+/*
+ * Get descriptor of a physical address
+ * Returns NULL if the frame is not RAM managed by the PMM
+ */
+struct page *page_of(uint64_t phys);
+
+/*
+ * Get physical address of a descriptor
+ */
+static inline uint64_t page_to_phys(struct page *page) {
+    return page_to_pfn(page) << 12;
+}
+
+/*
+ * Take an extra reference to an allocated frame
+ */
+void page_get(struct page *page);
+
+/*
+ * Drop a reference, freeing the frame when the last one goes
+ */
+void page_put(struct page *page);
+
+/*
+ * Tag a run of allocated frames with an owner
+ */
+void page_set_owner(uint64_t phys, size_t count, uint16_t owner);
+
+/*
+ * Record that a frame is only accessed through one kernel virtual
+ * address, which lets compaction move it
+ */
+void page_set_movable(uint64_t phys, uint64_t virt);
+
+/*
+ * Clock hand over movable frames
+ * Looks at up to max frames after *pfn, wrapping around at the end of
+ * memory, and returns the first movable one with *pfn moved to it, or
+ * NULL if there was none
+ */
+struct page *page_next_movable(uint64_t *pfn, uint64_t max);
+
+/*
+ * PMM hooks: a run of frames was handed out / returned
+ */
+void page_mark_allocated(uint64_t pfn, size_t count);
+void page_mark_free(uint64_t pfn, size_t count);
+
+/*
+ * Count frames per owner (counts has PAGE_OWNER_COUNT entries)
+ */
+void page_get_owner_stats(uint64_t *counts);
+
+#endif /* _ASTRA_MM_PAGE_H */
@@ -1,23 +1,166 @@
 /*
  * AstraOS - Physical Memory Manager Implementation
- * Bitmap-based page frame allocator
+ * Buddy allocator on top of a bitmap frame map
+ *
+ * The bitmap is the authoritative record of which frames are in use
+ * and is always updated in whole 64-bit words where possible.
+ * Free frames are additionally kept in per-order free lists of
+ * naturally aligned power-of-two blocks. The list node for a free block
+ * lives inside the first page of the block itself (through the HHDM),
+ * so the buddy lists need no memory of their own.
+ *
+ * Free lists are kept per node and per zone (DMA below 16 MB, DMA32
+ * below 4 GB, Normal above). Blocks never straddle a node or zone
+ * boundary. Allocations start at the highest zone the caller allows and
+ * only fall back to lower zones once every node is exhausted there, so
+ * low memory stays available for devices. Within a zone, nodes are
+ * tried in order of distance from the requested node.
  */
 
 #include "pmm.h"
+#include "numa.h"
+#include "page.h"
+#include "vmm.h"
+#include "zram.h"
 #include "../lib/string.h"
 #include "../sync/spinlock.h"
+#include "../arch/x86_64/cpu.h"
+#include "../arch/x86_64/percpu.h"
 
 /*
  * Bitmap for tracking page allocation
- * Each bit represents one 4KB page
+ * Each bit represents one 4KB page, 64 pages per word
  * 1 = allocated, 0 = free
  */
-static uint8_t *bitmap = NULL;
+static uint64_t *bitmap = NULL;
 static uint64_t bitmap_size = 0;      /* Size in bytes */
 static uint64_t total_pages = 0;
-static uint64_t used_pages = 0;
+static uint64_t free_pages = 0;
 static uint64_t highest_page = 0;
 
+/*
+ * Free block header, stored in the first page of every free block
+ */
+#define BUDDY_FREE_MAGIC    0x46524545   /* "FREE" */
+
+struct buddy_block {
+    struct buddy_block *next;
+    struct buddy_block *prev;
+    uint32_t magic;
+    uint16_t order;
+    uint8_t node;
+    uint8_t zone;
+};
+
+/*
+ * Per-node, per-zone free lists
+ */
+struct buddy_area {
+    struct buddy_block *free_list[PMM_MAX_ORDER];
+    uint64_t nr_free[PMM_MAX_ORDER];    /* Blocks on each list */
+    uint64_t free_pages;                /* Pages on all lists */
+};
+
+static struct buddy_area areas[NUMA_MAX_NODES][PMM_ZONE_COUNT];
+
+/*
+ * Zone limits (first page past each zone) and usable pages per zone
+ */
+static const uint64_t zone_end_page[PMM_ZONE_COUNT] = {
+    [PMM_ZONE_DMA]    = (16ULL << 20) / PAGE_SIZE,
+    [PMM_ZONE_DMA32]  = (4ULL << 30) / PAGE_SIZE,
+    [PMM_ZONE_NORMAL] = UINT64_MAX,
+};
+
+static uint64_t zone_pages[PMM_ZONE_COUNT];
+
+/*
+ * Bootloader/ACPI reclaimable regions, in pages [start, end)
+ * Recorded at init because the memory map itself lives in
+ * bootloader-reclaimable memory.
+ */
+#define PMM_MAX_RECLAIM     32
+
+struct reclaim_region {
+    uint64_t start;
+    uint64_t end;
+};
+
+static struct reclaim_region reclaim_regions[PMM_MAX_RECLAIM];
+static uint32_t reclaim_count = 0;
+static uint64_t reclaimed_pages = 0;
+
+/*
+ * Per-CPU page cache
+ * Single pages are served from a small per-CPU stack of frames that is
+ * refilled from and drained to the buddy lists in batches, so the common
+ * case only disables interrupts and never touches pmm_lock. Cached frames
+ * stay marked allocated in the bitmap.
+ */
+#define PCP_BATCH       32      /* Frames moved per refill/drain */
+#define PCP_HIGH        64      /* Drain when the cache grows past this */
+
+struct pcp_cache {
+    uint64_t count;
+    uint64_t pages[PCP_HIGH + 1];
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t refills;
+    uint64_t drains;
+};
+
+static struct pcp_cache pcp[MAX_CPUS];
+
+/*
+ * Pre-zeroed page pool
+ * Filled from the idle loop by pmm_zero_idle(), so single-page PMM_ZERO
+ * requests usually skip the memset. Pooled frames stay marked
+ * allocated in the bitmap and count as free memory.
+ */
+#define ZERO_POOL_SIZE      256     /* 1 MB of zeroed frames */
+#define ZERO_POOL_BATCH     8       /* Frames zeroed per idle call */
+
+static uint64_t zero_pool[ZERO_POOL_SIZE];
+static uint64_t zero_count = 0;
+static uint64_t zero_hits = 0;
+static uint64_t zero_misses = 0;
+static spinlock_t zero_lock = SPINLOCK_INIT;
+
+/*
+ * Compaction statistics
+ */
+#define COMPACT_IDLE_ORDER      2       /* Keep kernel-stack sized blocks around */
+#define COMPACT_IDLE_BACKOFF    1024    /* Idle calls to skip after a failure */
+#define COMPACT_IDLE_WINDOWS    64      /* Windows looked at per idle call */
+
+static uint64_t compact_successes = 0;
+static uint64_t compact_failures = 0;
+static uint64_t compact_migrated = 0;
+static uint64_t compact_idle_backoff = 0;
+static uint64_t compact_idle_cursor = 0;
+static uint64_t compact_idle_scanned = 0;      /* Windows since the last candidate */
+
+/*
+ * Per-CPU allocator statistics
+ * Only ever updated by the owning CPU with interrupts disabled, so
+ * no atomics are needed. Cache-line aligned to keep CPUs from
+ * bouncing each other's counters.
+ */
+struct pmm_cpu_stats {
+    uint64_t allocs;
+    uint64_t alloc_failures;
+    uint64_t pages_allocated;
+    uint64_t frees;
+    uint64_t pages_freed;
+    uint64_t latency[PMM_LAT_BUCKETS];
+    uint64_t latency_max;
+    uint64_t lock_acquires;
+    uint64_t lock_contended;
+    uint64_t lock_wait_cycles;
+} __attribute__((aligned(64)));
+
+static struct pmm_cpu_stats cpu_stats[MAX_CPUS];
+
 /*
  * HHDM offset for converting physical to virtual
  */
@@ -29,18 +172,122 @@ static uint64_t hhdm = 0;
 static spinlock_t pmm_lock = SPINLOCK_INIT;
 
 /*
- * Bitmap operations
+ * Take pmm_lock with interrupts already disabled
+ * An uncontended acquisition costs one extra counter update; only
+ * a failed first attempt pays for reading the TSC.
  */
-static inline void bitmap_set(uint64_t page) {
-    bitmap[page / 8] |= (1 << (page % 8));
+static void pmm_lock_acquire(void) {
+    struct pmm_cpu_stats *st = &cpu_stats[cpu_current_id()];
+    st->lock_acquires++;
+
+    if (spinlock_try_acquire(&pmm_lock)) return;
+
+    uint64_t start = cpu_rdtsc();
+    spinlock_acquire(&pmm_lock);
+    st->lock_contended++;
+    st->lock_wait_cycles += cpu_rdtsc() - start;
 }
 
-static inline void bitmap_clear(uint64_t page) {
-    bitmap[page / 8] &= ~(1 << (page % 8));
+static void pmm_lock_irqsave(uint64_t *flags) {
+    *flags = cpu_save_flags();
+    cpu_cli();
+    pmm_lock_acquire();
+}
+
+/*
+ * Record the outcome of an allocation call that started at TSC start
+ */
+static void stats_alloc(uint64_t start, void *result, size_t count) {
+    uint64_t cycles = cpu_rdtsc() - start;
+    uint32_t bucket = cycles ? 63 - __builtin_clzll(cycles) : 0;
+    if (bucket >= PMM_LAT_BUCKETS) bucket = PMM_LAT_BUCKETS - 1;
+
+    uint64_t flags = cpu_save_flags();
+    cpu_cli();
+
+    struct pmm_cpu_stats *st = &cpu_stats[cpu_current_id()];
+    if (result) {
+        st->allocs++;
+        st->pages_allocated += count;
+    } else {
+        st->alloc_failures++;
+    }
+    st->latency[bucket]++;
+    if (cycles > st->latency_max) st->latency_max = cycles;
+
+    cpu_restore_flags(flags);
 }
 
+/*
+ * Record a free call
+ */
+static void stats_free(size_t count) {
+    uint64_t flags = cpu_save_flags();
+    cpu_cli();
+
+    struct pmm_cpu_stats *st = &cpu_stats[cpu_current_id()];
+    st->frees++;
+    st->pages_freed += count;
+
+    cpu_restore_flags(flags);
+}
+
+/*
+ * Bitmap operations
+ */
 static inline int bitmap_test(uint64_t page) {
-    return (bitmap[page / 8] >> (page % 8)) & 1;
+    return (bitmap[page / 64] >> (page % 64)) & 1;
+}
+
+/*
+ * Mask of n bits starting at bit (n > 0, bit + n <= 64)
+ */
+static inline uint64_t bitmap_word_mask(uint64_t bit, uint64_t n) {
+    return (n == 64) ? ~0ULL : ((1ULL << n) - 1) << bit;
+}
+
+/*
+ * Range operations, one read-modify-write per word touched
+ */
+static void bitmap_set_range(uint64_t start, uint64_t count) {
+    uint64_t end = start + count;
+    while (start < end) {
+        uint64_t bit = start % 64;
+        uint64_t n = 64 - bit;
+        if (n > end - start) n = end - start;
+        bitmap[start / 64] |= bitmap_word_mask(bit, n);
+        start += n;
+    }
+}
+
+static void bitmap_clear_range(uint64_t start, uint64_t count) {
+    uint64_t end = start + count;
+    while (start < end) {
+        uint64_t bit = start % 64;
+        uint64_t n = 64 - bit;
+        if (n > end - start) n = end - start;
+        bitmap[start / 64] &= ~bitmap_word_mask(bit, n);
+        start += n;
+    }
+}
+
+/*
+ * Find the first page in [start, end) whose bit equals value,
+ * skipping whole words at a time. Returns end if there is none.
+ */
+static uint64_t bitmap_find_next(uint64_t start, uint64_t end, int value) {
+    while (start < end) {
+        uint64_t word = bitmap[start / 64];
+        if (!value) word = ~word;
+        word &= ~0ULL << (start % 64);
+
+        if (word) {
+            uint64_t page = (start & ~63ULL) + __builtin_ctzll(word);
+            return page < end ? page : end;
+        }
+        start = (start & ~63ULL) + 64;
+    }
+    return end;
 }
 
 /*
@@ -57,6 +304,246 @@ static inline uint64_t virt_to_phys(void *virt) {
     return (uint64_t)virt - hhdm;
 }
 
+/*
+ * Node of the CPU we are running on
+ */
+static inline uint32_t local_node(void) {
+    return percpu_get()->numa_node;
+}
+
+/*
+ * Zone of a page; zone_end receives the first page past the zone
+ */
+static inline uint32_t zone_of_page(uint64_t page, uint64_t *zone_end) {
+    uint32_t zone = PMM_ZONE_DMA;
+    while (page >= zone_end_page[zone]) {
+        zone++;
+    }
+    *zone_end = zone_end_page[zone];
+    return zone;
+}
+
+/*
+ * Highest zone an allocation with the given flags may use
+ */
+static inline uint32_t zone_for_flags(uint32_t flags) {
+    if (flags & PMM_DMA) return PMM_ZONE_DMA;
+    if (flags & PMM_DMA32) return PMM_ZONE_DMA32;
+    return PMM_ZONE_NORMAL;
+}
+
+/*
+ * Get the header of the free block starting at a page
+ */
+static inline struct buddy_block *page_to_block(uint64_t page) {
+    return phys_to_virt(page * PAGE_SIZE);
+}
+
+static inline uint64_t block_to_page(struct buddy_block *block) {
+    return virt_to_phys(block) / PAGE_SIZE;
+}
+
+/*
+ * Smallest order whose block holds at least count pages
+ */
+static inline uint32_t order_for_count(size_t count) {
+    uint32_t order = 0;
+    while (((size_t)1 << order) < count) {
+        order++;
+    }
+    return order;
+}
+
+/*
+ * Free list operations
+ */
+static void buddy_list_add(uint64_t page, uint32_t order, uint32_t node, uint32_t zone) {
+    struct buddy_area *area = &areas[node][zone];
+    struct buddy_block *block = page_to_block(page);
+
+    block->magic = BUDDY_FREE_MAGIC;
+    block->order = order;
+    block->node = node;
+    block->zone = zone;
+    block->prev = NULL;
+    block->next = area->free_list[order];
+    if (block->next) {
+        block->next->prev = block;
+    }
+    area->free_list[order] = block;
+    area->nr_free[order]++;
+    area->free_pages += 1ULL << order;
+}
+
+static void buddy_list_remove(struct buddy_block *block) {
+    struct buddy_area *area = &areas[block->node][block->zone];
+    uint32_t order = block->order;
+
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        area->free_list[order] = block->next;
+    }
+    if (block->next) {
+        block->next->prev = block->prev;
+    }
+    block->magic = 0;
+    area->nr_free[order]--;
+    area->free_pages -= 1ULL << order;
+}
+
+/*
+ * Check whether a page heads a free block of exactly the given order
+ * in the given pool. Only pages the bitmap reports as free are ever
+ * dereferenced.
+ */
+static bool buddy_is_free_block(uint64_t page, uint32_t order, uint32_t node, uint32_t zone) {
+    if (page + (1ULL << order) > highest_page) return false;
+    if (bitmap_test(page)) return false;
+
+    struct buddy_block *block = page_to_block(page);
+    return block->magic == BUDDY_FREE_MAGIC && block->order == order &&
+           block->node == node && block->zone == zone;
+}
+
+/*
+ * Return an aligned block to the free lists, merging with its buddy
+ * for as long as the buddy is free and of the same order.
+ * The block's bitmap bits must already be clear.
+ */
+static void buddy_free_block(uint64_t page, uint32_t order, uint32_t node, uint32_t zone) {
+    while (order < PMM_MAX_ORDER - 1) {
+        uint64_t buddy_page = page ^ (1ULL << order);
+        if (!buddy_is_free_block(buddy_page, order, node, zone)) {
+            break;
+        }
+
+        buddy_list_remove(page_to_block(buddy_page));
+        if (buddy_page < page) {
+            page = buddy_page;
+        }
+        order++;
+    }
+
+    buddy_list_add(page, order, node, zone);
+}
+
+/*
+ * Take a block of the given order off the free lists,
+ * splitting a larger block if necessary.
+ * Returns the first page of the block, or 0 if none is available.
+ */
+static uint64_t buddy_alloc_block(uint32_t order, uint32_t node, uint32_t zone) {
+    struct buddy_area *area = &areas[node][zone];
+    uint32_t current = order;
+    while (current < PMM_MAX_ORDER && !area->free_list[current]) {
+        current++;
+    }
+    if (current >= PMM_MAX_ORDER) {
+        return 0;
+    }
+
+    struct buddy_block *block = area->free_list[current];
+    buddy_list_remove(block);
+    uint64_t page = block_to_page(block);
+
+    /* Split, returning the upper halves to the lower-order lists */
+    while (current > order) {
+        current--;
+        buddy_list_add(page + (1ULL << current), current, node, zone);
+    }
+
+    return page;
+}
+
+/*
+ * Take a block from the highest allowed zone, trying nodes in order
+ * of distance from the preferred node before dropping to a lower zone.
+ */
+static uint64_t buddy_alloc_block_near(uint32_t order, uint32_t node, uint32_t max_zone) {
+    const uint32_t *order_list = numa_fallback_order(node);
+    uint32_t nodes = numa_node_count();
+
+    for (int zone = (int)max_zone; zone >= 0; zone--) {
+        for (uint32_t i = 0; i < nodes; i++) {
+            uint64_t page = buddy_alloc_block(order, order_list[i], zone);
+            if (page) return page;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Free a range of pages that are currently marked allocated.
+ * The range is broken into the largest naturally aligned blocks
+ * that stay within one node and zone.
+ */
+static void free_range(uint64_t start, uint64_t count) {
+    uint64_t pool_end = 0;
+    uint32_t node = 0;
+    uint32_t zone = 0;
+
+    while (count > 0) {
+        if (start >= pool_end) {
+            uint64_t zone_end;
+            node = numa_node_of_page(start, &pool_end);
+            zone = zone_of_page(start, &zone_end);
+            if (zone_end < pool_end) pool_end = zone_end;
+        }
+
+        uint64_t limit = pool_end - start;
+        if (limit > count) limit = count;
+
+        uint32_t order = 0;
+        while (order < PMM_MAX_ORDER - 1 &&
+               (start & ((2ULL << order) - 1)) == 0 &&
+               (2ULL << order) <= limit) {
+            order++;
+        }
+
+        uint64_t pages = 1ULL << order;
+        bitmap_clear_range(start, pages);
+        free_pages += pages;
+        buddy_free_block(start, order, node, zone);
+
+        start += pages;
+        count -= pages;
+    }
+}
+
+/*
+ * Release a usable range during init, skipping the frames
+ * that must stay reserved (page 0 and the bitmap itself).
+ */
+static void init_free_region(uint64_t start, uint64_t end,
+                             uint64_t reserved_start, uint64_t reserved_end) {
+    if (start == 0) start = 1;  /* Null pointer protection */
+
+    if (reserved_start < end && reserved_end > start) {
+        if (start < reserved_start) {
+            free_range(start, reserved_start - start);
+        }
+        start = reserved_end;
+    }
+
+    if (start < end) {
+        free_range(start, end - start);
+    }
+}
+
+/*
+ * Add a range of usable pages to the per-zone totals
+ */
+static void count_zone_pages(uint64_t start, uint64_t end) {
+    while (start < end) {
+        uint64_t zone_end;
+        uint32_t zone = zone_of_page(start, &zone_end);
+        if (zone_end > end) zone_end = end;
+        zone_pages[zone] += zone_end - start;
+        start = zone_end;
+    }
+}
+
 /*
  * Initialize PMM
  */
@@ -75,25 +562,35 @@ void pmm_init(struct limine_memmap_response *memmap, uint64_t hhdm_offset) {
 
     /* Calculate bitmap size (need to track all address space for safety) */
     highest_page = highest_addr / PAGE_SIZE;
-    bitmap_size = (highest_page + 7) / 8;
+    bitmap_size = ((highest_page + 63) / 64) * sizeof(uint64_t);
 
-    /* Count only usable memory for total_pages */
+    /* Count only usable memory for total_pages and the zone sizes */
     total_pages = 0;
+    reclaim_count = 0;
+    memset(zone_pages, 0, sizeof(zone_pages));
     for (uint64_t i = 0; i < memmap->entry_count; i++) {
         struct limine_memmap_entry *entry = memmap->entries[i];
+        uint64_t start_page = PAGE_ALIGN_UP(entry->base) / PAGE_SIZE;
+        uint64_t end_page = PAGE_ALIGN_DOWN(entry->base + entry->length) / PAGE_SIZE;
+
         if (entry->type == LIMINE_MEMMAP_USABLE) {
-            uint64_t start_page = PAGE_ALIGN_UP(entry->base) / PAGE_SIZE;
-            uint64_t end_page = PAGE_ALIGN_DOWN(entry->base + entry->length) / PAGE_SIZE;
             total_pages += (end_page - start_page);
+            count_zone_pages(start_page, end_page);
+        } else if ((entry->type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE ||
+                    entry->type == LIMINE_MEMMAP_ACPI_RECLAIMABLE) &&
+                   start_page < end_page && reclaim_count < PMM_MAX_RECLAIM) {
+            reclaim_regions[reclaim_count].start = start_page;
+            reclaim_regions[reclaim_count].end = end_page;
+            reclaim_count++;
         }
     }
 
-    /* Find a usable region for the bitmap */
+    /* Find a usable region for the bitmap, keeping it out of ZONE_DMA if possible */
     for (uint64_t i = 0; i < memmap->entry_count; i++) {
         struct limine_memmap_entry *entry = memmap->entries[i];
         if (entry->type == LIMINE_MEMMAP_USABLE && entry->length >= bitmap_size) {
             bitmap = phys_to_virt(entry->base);
-            break;
+            if (entry->base >= zone_end_page[PMM_ZONE_DMA] * PAGE_SIZE) break;
         }
     }
 
@@ -103,141 +600,771 @@ void pmm_init(struct limine_memmap_response *memmap, uint64_t hhdm_offset) {
     }
 
     /* Mark all pages as used initially */
-    memset(bitmap, 0xFF, bitmap_size);
-    used_pages = 0;  /* Start at 0, will be counted properly */
+    bitmap_set_range(0, bitmap_size * 8);
+    memset(areas, 0, sizeof(areas));
+    free_pages = 0;
+
+    /* The bitmap itself stays reserved */
+    uint64_t bitmap_start = virt_to_phys(bitmap) / PAGE_SIZE;
+    uint64_t bitmap_end = bitmap_start + PAGE_ALIGN_UP(bitmap_size) / PAGE_SIZE;
 
-    /* Free usable memory regions */
+    /* Hand usable memory regions to the buddy allocator */
     for (uint64_t i = 0; i < memmap->entry_count; i++) {
         struct limine_memmap_entry *entry = memmap->entries[i];
         if (entry->type == LIMINE_MEMMAP_USABLE) {
             uint64_t start_page = PAGE_ALIGN_UP(entry->base) / PAGE_SIZE;
             uint64_t end_page = PAGE_ALIGN_DOWN(entry->base + entry->length) / PAGE_SIZE;
 
-            for (uint64_t page = start_page; page < end_page; page++) {
-                bitmap_clear(page);  /* Clear the bit to mark as free */
-            }
+            init_free_region(start_page, end_page, bitmap_start, bitmap_end);
         }
     }
+}
 
-    /* Reserve the bitmap itself */
-    uint64_t bitmap_phys = virt_to_phys(bitmap);
-    uint64_t bitmap_pages = PAGE_ALIGN_UP(bitmap_size) / PAGE_SIZE;
-    uint64_t bitmap_start = bitmap_phys / PAGE_SIZE;
+/*
+ * Release bootloader and ACPI reclaimable memory
+ * The caller guarantees that nothing references the Limine responses,
+ * the bootloader's page tables and stack, or the ACPI tables any more.
+ */
+uint64_t pmm_reclaim_boot_memory(void) {
+    uint64_t flags;
+    pmm_lock_irqsave(&flags);
 
-    for (uint64_t i = 0; i < bitmap_pages; i++) {
-        if (!bitmap_test(bitmap_start + i)) {
-            bitmap_set(bitmap_start + i);
-            used_pages++;
+    uint64_t pages = 0;
+    for (uint32_t i = 0; i < reclaim_count; i++) {
+        uint64_t start = reclaim_regions[i].start;
+        uint64_t end = reclaim_regions[i].end;
+        if (start == 0) start = 1;  /* Null pointer protection */
+        if (start >= end) continue;
+
+        free_range(start, end - start);
+        page_mark_free(start, end - start);
+        count_zone_pages(start, end);
+        pages += end - start;
+    }
+    reclaim_count = 0;
+
+    total_pages += pages;
+    reclaimed_pages += pages;
+
+    spinlock_release_irqrestore(&pmm_lock, flags);
+    return pages * PAGE_SIZE;
+}
+
+/*
+ * Move free blocks from node 0 onto the lists of the node that owns them
+ * Called once by numa_init() after the SRAT has been parsed. Blocks are
+ * marked allocated while they are off the lists, so that no half-moved
+ * block is ever mistaken for a mergeable buddy.
+ */
+void pmm_numa_rebuild(void) {
+    uint64_t flags;
+    pmm_lock_irqsave(&flags);
+
+    struct buddy_block *pulled = NULL;
+    for (uint32_t zone = 0; zone < PMM_ZONE_COUNT; zone++) {
+        for (uint32_t order = 0; order < PMM_MAX_ORDER; order++) {
+            struct buddy_block *block;
+            while ((block = areas[0][zone].free_list[order]) != NULL) {
+                buddy_list_remove(block);
+                bitmap_set_range(block_to_page(block), 1ULL << order);
+                free_pages -= 1ULL << order;
+
+                block->next = pulled;
+                pulled = block;
+            }
         }
     }
 
-    /* Reserve first page (null pointer protection) */
-    if (!bitmap_test(0)) {
-        bitmap_set(0);
-        used_pages++;
+    while (pulled) {
+        struct buddy_block *next = pulled->next;
+        free_range(block_to_page(pulled), 1ULL << pulled->order);
+        pulled = next;
     }
+
+    spinlock_release_irqrestore(&pmm_lock, flags);
 }
 
 /*
- * Allocate single page
+ * Move up to PCP_BATCH single pages from the buddy lists into a cache
  */
-void *pmm_alloc_page(void) {
+static void pcp_refill(struct pcp_cache *cache) {
+    uint32_t node = local_node();
     uint64_t flags;
-    spinlock_acquire_irqsave(&pmm_lock, &flags);
+    pmm_lock_irqsave(&flags);
 
-    /* Linear search for free page */
-    for (uint64_t i = 1; i < highest_page; i++) {
-        if (!bitmap_test(i)) {
-            bitmap_set(i);
-            used_pages++;
-            spinlock_release_irqrestore(&pmm_lock, flags);
-            return (void *)(i * PAGE_SIZE);
-        }
+    while (cache->count < PCP_BATCH) {
+        uint64_t page = buddy_alloc_block_near(0, node, PMM_ZONE_NORMAL);
+        if (!page) break;
+        bitmap_set_range(page, 1);
+        free_pages--;
+        cache->pages[cache->count++] = page;
     }
+    cache->refills++;
 
     spinlock_release_irqrestore(&pmm_lock, flags);
-    return NULL;  /* Out of memory */
 }
 
 /*
- * Allocate contiguous pages
+ * Return cached pages to the buddy lists until only keep remain
  */
-void *pmm_alloc_pages(size_t count) {
-    if (count == 0) return NULL;
-    if (count == 1) return pmm_alloc_page();
+static void pcp_drain(struct pcp_cache *cache, uint64_t keep) {
+    uint64_t flags;
+    pmm_lock_irqsave(&flags);
+
+    while (cache->count > keep) {
+        free_range(cache->pages[--cache->count], 1);
+    }
+    cache->drains++;
+
+    spinlock_release_irqrestore(&pmm_lock, flags);
+}
 
+/*
+ * Take a frame from the zeroed pool, or 0 if it is empty
+ */
+static uint64_t zero_pool_take(void) {
     uint64_t flags;
-    spinlock_acquire_irqsave(&pmm_lock, &flags);
+    spinlock_acquire_irqsave(&zero_lock, &flags);
+
+    uint64_t page = 0;
+    if (zero_count > 0) {
+        page = zero_pool[--zero_count];
+    }
 
-    /* Search for contiguous free pages */
-    uint64_t consecutive = 0;
-    uint64_t start_page = 0;
+    spinlock_release_irqrestore(&zero_lock, flags);
+    return page;
+}
 
-    for (uint64_t i = 1; i < highest_page; i++) {
-        if (!bitmap_test(i)) {
-            if (consecutive == 0) {
-                start_page = i;
-            }
-            consecutive++;
-
-            if (consecutive == count) {
-                /* Found enough pages, mark them as used */
-                for (uint64_t j = 0; j < count; j++) {
-                    bitmap_set(start_page + j);
-                }
-                used_pages += count;
-                spinlock_release_irqrestore(&pmm_lock, flags);
-                return (void *)(start_page * PAGE_SIZE);
+/*
+ * Allocate single page from this CPU's cache
+ */
+static void *pcp_alloc(void) {
+    uint64_t flags = cpu_save_flags();
+    cpu_cli();
+
+    struct pcp_cache *cache = &pcp[cpu_current_id()];
+    if (cache->count == 0) {
+        cache->misses++;
+        pcp_refill(cache);
+        if (cache->count == 0) {
+            /* Last resort: frames set aside for PMM_ZERO */
+            uint64_t page = zero_pool_take();
+            cpu_restore_flags(flags);
+            if (!page) return NULL;
+            page_mark_allocated(page, 1);
+            return (void *)(page * PAGE_SIZE);
+        }
+    } else {
+        cache->hits++;
+    }
+
+    uint64_t page = cache->pages[--cache->count];
+
+    cpu_restore_flags(flags);
+    page_mark_allocated(page, 1);
+    return (void *)(page * PAGE_SIZE);
+}
+
+/*
+ * Single-page allocation with direct reclaim
+ * Out of frames, cold pages are compressed into zram and the
+ * allocation is retried. Only callers with interrupts enabled reclaim:
+ * every lock is taken with interrupts off, so they hold none of the
+ * locks reclaim needs.
+ */
+#define PMM_RECLAIM_BATCH   8
+
+static void *pcp_alloc_reclaim(void) {
+    void *page = pcp_alloc();
+    if (!page && cpu_interrupts_enabled() && zram_reclaim(PMM_RECLAIM_BATCH) > 0) {
+        page = pcp_alloc();
+    }
+    return page;
+}
+
+void *pmm_alloc_page(void) {
+    uint64_t start = cpu_rdtsc();
+    void *page = pcp_alloc_reclaim();
+    stats_alloc(start, page, 1);
+    return page;
+}
+
+/*
+ * Check whether a frame set in the bitmap is really allocated
+ * Frames in a per-CPU cache, the zeroed pool or a compaction window
+ * stay set in the bitmap, but their descriptors are already free.
+ * Holes and MMIO are set in the bitmap too, and have no descriptor.
+ */
+static inline bool frame_allocated(uint64_t page_num) {
+    if (!bitmap_test(page_num)) return false;
+    struct page *page = page_of(page_num * PAGE_SIZE);
+    if (!page) return !page_map_ready;
+    return page->owner != PAGE_OWNER_FREE;
+}
+
+/*
+ * Check whether a frame lies in a window being compacted
+ */
+static inline bool frame_isolated(uint64_t page_num) {
+    struct page *page = page_of(page_num * PAGE_SIZE);
+    return page && (__atomic_load_n(&page->flags, __ATOMIC_RELAXED) & PAGE_FLAG_ISOLATED);
+}
+
+/*
+ * Return a single page to this CPU's cache
+ * Returns false if the frame was not allocated
+ */
+static bool free_single(uint64_t page_num) {
+    if (page_num >= highest_page || !frame_allocated(page_num)) return false;
+
+    uint64_t flags = cpu_save_flags();
+    cpu_cli();
+
+    /* Only movable frames can be in a window being compacted */
+    struct page *page = page_of(page_num * PAGE_SIZE);
+    if (page && (__atomic_load_n(&page->flags, __ATOMIC_RELAXED) & PAGE_FLAG_MOVABLE)) {
+        pmm_lock_acquire();
+        bool isolated = frame_isolated(page_num);
+        page_mark_free(page_num, 1);
+        spinlock_release(&pmm_lock);
+
+        if (isolated) {
+            /* Handed back: the compaction frees it */
+            cpu_restore_flags(flags);
+            return true;
+        }
+    } else {
+        page_mark_free(page_num, 1);
+    }
+
+    /*
+     * DMA frames and remote frames go straight back to the buddy lists
+     * instead of into the local cache
+     */
+    if (page_num < zone_end_page[PMM_ZONE_DMA] ||
+        (numa_node_count() > 1 && numa_node_of_page(page_num, NULL) != local_node())) {
+        pmm_lock_acquire();
+        free_range(page_num, 1);
+        spinlock_release(&pmm_lock);
+        cpu_restore_flags(flags);
+        return true;
+    }
+
+    struct pcp_cache *cache = &pcp[cpu_current_id()];
+    cache->pages[cache->count++] = page_num;
+    if (cache->count > PCP_HIGH) {
+        pcp_drain(cache, PCP_HIGH - PCP_BATCH);
+    }
+
+    cpu_restore_flags(flags);
+    return true;
+}
+
+/*
+ * Check for a free block of at least the given order (unlocked hint)
+ */
+static bool block_available(uint32_t order, uint32_t max_zone) {
+    for (uint32_t node = 0; node < numa_node_count(); node++) {
+        for (uint32_t zone = 0; zone <= max_zone; zone++) {
+            for (uint32_t o = order; o < PMM_MAX_ORDER; o++) {
+                if (areas[node][zone].free_list[o]) return true;
             }
+        }
+    }
+    return false;
+}
+
+/*
+ * Compaction
+ * Opens up a free block of a given order by moving the movable frames
+ * (see PAGE_FLAG_MOVABLE) out of the cheapest aligned window that holds
+ * no pinned frames. A frame is write-protected while it is copied (see
+ * vmm_migrate_page), so other CPUs may keep using it. The frames of the
+ * window are marked PAGE_FLAG_ISOLATED meanwhile: one its owner frees
+ * is handed back to the compaction instead of going to a cache.
+ */
+static bool compact_frame_movable(uint64_t pfn) {
+    struct page *page = page_of(pfn * PAGE_SIZE);
+    return page && (page->flags & PAGE_FLAG_MOVABLE) && page->refcount == 1;
+}
+
+/*
+ * Number of frames that must move to empty a window,
+ * or -1 if a pinned frame is in the way
+ */
+static int64_t compact_window_cost(uint64_t start, uint64_t pages) {
+    int64_t cost = 0;
+    uint64_t end = start + pages;
+
+    for (uint64_t pfn = bitmap_find_next(start, end, 1); pfn < end;
+         pfn = bitmap_find_next(pfn + 1, end, 1)) {
+        if (!compact_frame_movable(pfn)) return -1;
+        cost++;
+    }
+    return cost;
+}
+
+/*
+ * Mark or unmark the frames of a window as isolated (pmm_lock held)
+ * Movable frames are only freed under pmm_lock (see free_single), so a
+ * frame freed before the mark rules the window out, and one freed
+ * after it is handed back.
+ */
+static void compact_mark(uint64_t start, uint64_t pages, bool isolated) {
+    for (uint64_t pfn = start; pfn < start + pages; pfn++) {
+        struct page *page = page_of(pfn * PAGE_SIZE);
+        if (!page) continue;
+
+        if (isolated) {
+            __atomic_fetch_or(&page->flags, PAGE_FLAG_ISOLATED, __ATOMIC_RELAXED);
         } else {
-            consecutive = 0;
+            __atomic_fetch_and(&page->flags, ~PAGE_FLAG_ISOLATED, __ATOMIC_RELAXED);
         }
     }
+}
+
+/*
+ * Take the free blocks inside a window off the free lists
+ * Every free frame in the window heads a block that lies entirely
+ * inside it, because the window is aligned and not completely free.
+ */
+static void compact_isolate(uint64_t start, uint64_t pages) {
+    uint64_t end = start + pages;
+    uint64_t pfn = bitmap_find_next(start, end, 0);
+
+    while (pfn < end) {
+        struct buddy_block *block = page_to_block(pfn);
+        uint64_t block_pages = 1ULL << block->order;
+
+        buddy_list_remove(block);
+        bitmap_set_range(pfn, block_pages);
+        free_pages -= block_pages;
+
+        pfn = bitmap_find_next(pfn + block_pages, end, 0);
+    }
+}
+
+/*
+ * Move one frame to a new home outside the window
+ */
+static bool compact_migrate(uint64_t pfn) {
+    struct page *old_page = pfn_to_page(pfn);
+    void *new_frame = pcp_alloc();
+    if (!new_frame) return false;
 
+    page_set_owner((uint64_t)new_frame, 1, old_page->owner);
+    page_set_movable((uint64_t)new_frame, old_page->private);
+
+    /* An interrupt here writing the page would wait for us forever */
+    uint64_t flags = cpu_save_flags();
+    cpu_cli();
+    bool ok = vmm_migrate_page(NULL, old_page->private, (uint64_t)new_frame);
+    cpu_restore_flags(flags);
+
+    if (!ok) {
+        free_single((uint64_t)new_frame / PAGE_SIZE);
+        return false;
+    }
+
+    page_mark_free(pfn, 1);
+    return true;
+}
+
+/*
+ * Empty one window by moving its frames away
+ * The window is checked again under the lock, since it may have
+ * changed since it was picked.
+ */
+static bool compact_window(uint64_t start, uint64_t pages) {
+    uint64_t flags;
+    pmm_lock_irqsave(&flags);
+
+    if (compact_window_cost(start, pages) <= 0) {
+        compact_failures++;
+        spinlock_release_irqrestore(&pmm_lock, flags);
+        return false;
+    }
+
+    compact_mark(start, pages, true);
+    compact_isolate(start, pages);
     spinlock_release_irqrestore(&pmm_lock, flags);
-    return NULL;  /* Not enough contiguous memory */
+
+    /* Move everything that is still allocated */
+    bool moved_all = true;
+    for (uint64_t pfn = start; pfn < start + pages; pfn++) {
+        struct page *page = pfn_to_page(pfn);
+        if (page->owner == PAGE_OWNER_FREE) continue;  /* Isolated or handed back */
+
+        if (!compact_frame_movable(pfn) || !compact_migrate(pfn)) {
+            moved_all = false;
+            break;
+        }
+        compact_migrated++;
+    }
+
+    /*
+     * Release the frames of the window that are ours: the isolated free
+     * blocks, the migrated frames and the frames handed back. A frame
+     * whose last reference is dropped but not yet freed is left to that
+     * free, which no longer sees the mark.
+     */
+    pmm_lock_irqsave(&flags);
+    compact_mark(start, pages, false);
+
+    uint64_t pfn = start;
+    while (pfn < start + pages) {
+        if (pfn_to_page(pfn)->owner != PAGE_OWNER_FREE) {
+            moved_all = false;
+            pfn++;
+            continue;
+        }
+        uint64_t run = pfn;
+        while (pfn < start + pages && pfn_to_page(pfn)->owner == PAGE_OWNER_FREE) {
+            pfn++;
+        }
+        free_range(run, pfn - run);
+    }
+
+    if (moved_all) {
+        compact_successes++;
+    } else {
+        compact_failures++;
+    }
+
+    spinlock_release_irqrestore(&pmm_lock, flags);
+    return moved_all;
 }
 
 /*
- * Free single page
+ * Pick the window that needs the fewest moves (pmm_lock held)
+ * Looks at up to count aligned windows below limit, starting at
+ * *cursor and wrapping around, and leaves *cursor after the last one.
+ * Returns the first frame of the window, or 0 if none can be emptied.
  */
-void pmm_free_page(void *page) {
-    if (!page) return;
+static uint64_t compact_search(uint64_t pages, uint64_t limit, uint64_t *cursor,
+                               uint64_t count) {
+    uint64_t best = 0;
+    int64_t best_cost = -1;
+    uint64_t start = *cursor;
+
+    for (uint64_t n = 0; n < count; n++, start += pages) {
+        if (start < pages || start + pages > limit) start = pages;
+
+        uint64_t node_end;
+        numa_node_of_page(start, &node_end);
+        if (node_end < start + pages) continue;
+
+        int64_t cost = compact_window_cost(start, pages);
+        if (cost <= 0) continue;
+        if (best_cost < 0 || cost < best_cost) {
+            best = start;
+            best_cost = cost;
+            if (cost == 1) {
+                start += pages;
+                break;
+            }
+        }
+    }
+
+    *cursor = start;
+    return best;
+}
+
+static uint64_t compact_limit(uint32_t max_zone) {
+    uint64_t limit = highest_page;
+    if (zone_end_page[max_zone] < limit) limit = zone_end_page[max_zone];
+    return limit;
+}
+
+static bool pmm_compact(uint32_t order, uint32_t max_zone) {
+    if (!page_map_ready) return false;
+
+    uint64_t pages = 1ULL << order;
+    uint64_t limit = compact_limit(max_zone);
+    if (limit < 2 * pages) return false;
+
+    uint64_t flags;
+    pmm_lock_irqsave(&flags);
+    uint64_t cursor = pages;
+    uint64_t best = compact_search(pages, limit, &cursor, limit / pages - 1);
+    spinlock_release_irqrestore(&pmm_lock, flags);
+
+    if (!best) {
+        compact_failures++;
+        return false;
+    }
+    return compact_window(best, pages);
+}
+
+/*
+ * Background compaction (idle work)
+ * Keeps at least one block of COMPACT_IDLE_ORDER free when possible.
+ * Each call looks at COMPACT_IDLE_WINDOWS windows, resuming where the
+ * last one stopped, and backs off after a whole pass finds nothing.
+ */
+bool pmm_compact_idle(void) {
+    if (compact_idle_backoff > 0) {
+        compact_idle_backoff--;
+        return false;
+    }
+
+    if (!page_map_ready || block_available(COMPACT_IDLE_ORDER, PMM_ZONE_NORMAL)) {
+        return false;
+    }
+
+    uint64_t pages = 1ULL << COMPACT_IDLE_ORDER;
+    uint64_t limit = compact_limit(PMM_ZONE_NORMAL);
+    if (limit < 2 * pages) return false;
+
+    uint64_t flags;
+    pmm_lock_irqsave(&flags);
+    uint64_t best = compact_search(pages, limit, &compact_idle_cursor, COMPACT_IDLE_WINDOWS);
+    spinlock_release_irqrestore(&pmm_lock, flags);
+
+    if (!best) {
+        /* Give up for a while once a whole pass found nothing */
+        compact_idle_scanned += COMPACT_IDLE_WINDOWS;
+        if (compact_idle_scanned >= limit / pages) {
+            compact_idle_scanned = 0;
+            compact_failures++;
+            compact_idle_backoff = COMPACT_IDLE_BACKOFF;
+            return false;
+        }
+        return true;
+    }
+
+    compact_idle_scanned = 0;
+    if (!compact_window(best, pages)) {
+        compact_idle_backoff = COMPACT_IDLE_BACKOFF;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Try to open up a block after a failed contiguous allocation:
+ * frames parked in this CPU's cache may complete one, and failing
+ * that movable frames are moved out of the way (unless PMM_NOCOMPACT).
+ */
+static bool make_room(uint32_t order, uint32_t max_zone, uint32_t alloc_flags) {
+    struct pcp_cache *cache = &pcp[cpu_current_id()];
+    if (cache->count > 0) {
+        pcp_drain(cache, 0);
+        if (block_available(order, max_zone)) return true;
+    }
+    if (alloc_flags & PMM_NOCOMPACT) return false;
+    return pmm_compact(order, max_zone);
+}
+
+/*
+ * Allocate contiguous pages, preferring a node
+ * The request is rounded up to a buddy block and the unused tail
+ * is returned to the free lists straight away.
+ */
+static void *alloc_pages_node(size_t count, int node, uint32_t alloc_flags) {
+    if (count == 0) return NULL;
 
-    uint64_t page_num = (uint64_t)page / PAGE_SIZE;
-    if (page_num >= highest_page) return;
+    if (alloc_flags & PMM_ZERO) {
+        alloc_flags &= ~PMM_ZERO;
+        if (count == 1 && node == PMM_NODE_LOCAL && zone_for_flags(alloc_flags) == PMM_ZONE_NORMAL) {
+            uint64_t page = zero_pool_take();
+            if (page) {
+                zero_hits++;
+                page_mark_allocated(page, 1);
+                return (void *)(page * PAGE_SIZE);
+            }
+        }
+        zero_misses++;
+
+        void *mem = alloc_pages_node(count, node, alloc_flags);
+        if (mem) {
+            memset(phys_to_virt((uint64_t)mem), 0, count * PAGE_SIZE);
+        }
+        return mem;
+    }
+
+    uint32_t local = local_node();
+    if (node == PMM_NODE_LOCAL) node = local;
+    if (node < 0 || (uint32_t)node >= numa_node_count()) return NULL;
+
+    /* The per-CPU cache only serves unrestricted local requests */
+    uint32_t max_zone = zone_for_flags(alloc_flags);
+    if (count == 1 && (uint32_t)node == local && max_zone == PMM_ZONE_NORMAL) {
+        return pcp_alloc_reclaim();
+    }
+
+    uint32_t order = order_for_count(count);
+    if (order >= PMM_MAX_ORDER) return NULL;
 
     uint64_t flags;
-    spinlock_acquire_irqsave(&pmm_lock, &flags);
+    pmm_lock_irqsave(&flags);
+
+    uint64_t page = buddy_alloc_block_near(order, node, max_zone);
+    if (!page) {
+        spinlock_release_irqrestore(&pmm_lock, flags);
+
+        if (!make_room(order, max_zone, alloc_flags)) {
+            return NULL;  /* Not enough contiguous memory */
+        }
+
+        pmm_lock_irqsave(&flags);
+        page = buddy_alloc_block_near(order, node, max_zone);
+        if (!page) {
+            spinlock_release_irqrestore(&pmm_lock, flags);
+            return NULL;
+        }
+    }
+
+    uint64_t block_pages = 1ULL << order;
+    bitmap_set_range(page, block_pages);
+    free_pages -= block_pages;
 
-    if (bitmap_test(page_num)) {
-        bitmap_clear(page_num);
-        used_pages--;
+    if (block_pages > count) {
+        free_range(page + count, block_pages - count);
     }
 
     spinlock_release_irqrestore(&pmm_lock, flags);
+    page_mark_allocated(page, count);
+    return (void *)(page * PAGE_SIZE);
+}
+
+void *pmm_alloc_pages_node(size_t count, int node, uint32_t alloc_flags) {
+    uint64_t start = cpu_rdtsc();
+    void *mem = alloc_pages_node(count, node, alloc_flags);
+    stats_alloc(start, mem, count);
+    return mem;
+}
+
+/*
+ * Allocate contiguous pages near the current CPU
+ */
+void *pmm_alloc_pages(size_t count) {
+    return pmm_alloc_pages_node(count, PMM_NODE_LOCAL, 0);
+}
+
+void *pmm_alloc_pages_flags(size_t count, uint32_t flags) {
+    return pmm_alloc_pages_node(count, PMM_NODE_LOCAL, flags);
+}
+
+/*
+ * Free single page
+ */
+void pmm_free_page(void *page) {
+    if (!page) return;
+
+    if (free_single((uint64_t)page / PAGE_SIZE)) {
+        stats_free(1);
+    }
 }
 
 /*
  * Free multiple pages
+ * Pages that are already free are skipped, so the range is
+ * released as runs of allocated pages found a word at a time.
+ * Frames cached free (see frame_allocated) are skipped too.
  */
 void pmm_free_pages(void *page, size_t count) {
     if (!page || count == 0) return;
 
     uint64_t start = (uint64_t)page / PAGE_SIZE;
+    uint64_t end = start + count;
+    if (end > highest_page) end = highest_page;
 
     uint64_t flags;
-    spinlock_acquire_irqsave(&pmm_lock, &flags);
+    pmm_lock_irqsave(&flags);
+
+    uint64_t freed = 0;
+    while (start < end) {
+        uint64_t run_start = bitmap_find_next(start, end, 1);
+        if (run_start >= end) break;
 
-    for (size_t i = 0; i < count; i++) {
-        uint64_t page_num = start + i;
-        if (page_num < highest_page && bitmap_test(page_num)) {
-            bitmap_clear(page_num);
-            used_pages--;
+        uint64_t run_end = bitmap_find_next(run_start, end, 0);
+        start = run_end;
+
+        /* Leave out frames that are cached free */
+        while (run_start < run_end) {
+            if (!frame_allocated(run_start)) {
+                run_start++;
+                continue;
+            }
+            if (frame_isolated(run_start)) {
+                /* Handed back to the compaction emptying its window */
+                page_mark_free(run_start, 1);
+                freed++;
+                run_start++;
+                continue;
+            }
+            uint64_t stop = run_start + 1;
+            while (stop < run_end && frame_allocated(stop) && !frame_isolated(stop)) stop++;
+
+            page_mark_free(run_start, stop - run_start);
+            free_range(run_start, stop - run_start);
+            freed += stop - run_start;
+            run_start = stop;
         }
     }
 
     spinlock_release_irqrestore(&pmm_lock, flags);
+
+    if (freed > 0) {
+        stats_free(freed);
+    }
+}
+
+/*
+ * Refill the zeroed pool by one batch (idle work)
+ * Returns true if any frames were zeroed.
+ */
+bool pmm_zero_idle(void) {
+    /* Leave the last free memory to real allocations */
+    if (zero_count >= ZERO_POOL_SIZE || free_pages < ZERO_POOL_SIZE) {
+        return false;
+    }
+
+    uint64_t batch[ZERO_POOL_BATCH];
+    uint64_t n = 0;
+    while (n < ZERO_POOL_BATCH) {
+        void *page = pcp_alloc();
+        if (!page) break;
+        memset(phys_to_virt((uint64_t)page), 0, PAGE_SIZE);
+        batch[n++] = (uint64_t)page / PAGE_SIZE;
+    }
+
+    uint64_t flags;
+    spinlock_acquire_irqsave(&zero_lock, &flags);
+
+    uint64_t added = 0;
+    while (added < n && zero_count < ZERO_POOL_SIZE) {
+        page_mark_free(batch[added], 1);
+        zero_pool[zero_count++] = batch[added++];
+    }
+
+    spinlock_release_irqrestore(&zero_lock, flags);
+
+    /* Pool filled up concurrently */
+    while (added < n) {
+        free_single(batch[added++]);
+    }
+
+    return n > 0;
+}
+
+/*
+ * Frames currently parked in per-CPU caches and the zeroed pool
+ */
+static uint64_t pcp_cached_pages(void) {
+    uint64_t cached = zero_count;
+    for (int i = 0; i < MAX_CPUS; i++) {
+        cached += pcp[i].count;
+    }
+    return cached;
+}
+
+/*
+ * Check whether a frame is allocated (or parked in a cache)
+ */
+bool pmm_page_in_use(uint64_t page) {
+    return page < highest_page && bitmap_test(page);
 }
 
 /*
@@ -248,9 +1375,146 @@ uint64_t pmm_get_total_memory(void) {
 }
 
 uint64_t pmm_get_free_memory(void) {
-    return (total_pages - used_pages) * PAGE_SIZE;
+    return (free_pages + pcp_cached_pages()) * PAGE_SIZE;
 }
 
 uint64_t pmm_get_used_memory(void) {
-    return used_pages * PAGE_SIZE;
+    return (total_pages - free_pages - pcp_cached_pages()) * PAGE_SIZE;
+}
+
+uint64_t pmm_get_reclaimed_memory(void) {
+    return reclaimed_pages * PAGE_SIZE;
+}
+
+uint64_t pmm_get_node_free_memory(uint32_t node) {
+    if (node >= NUMA_MAX_NODES) return 0;
+
+    uint64_t pages = 0;
+    for (uint32_t zone = 0; zone < PMM_ZONE_COUNT; zone++) {
+        pages += areas[node][zone].free_pages;
+    }
+    return pages * PAGE_SIZE;
+}
+
+void pmm_get_zone_stats(uint32_t zone, uint64_t *total, uint64_t *free) {
+    *total = 0;
+    *free = 0;
+    if (zone >= PMM_ZONE_COUNT) return;
+
+    *total = zone_pages[zone] * PAGE_SIZE;
+    for (uint32_t node = 0; node < NUMA_MAX_NODES; node++) {
+        *free += areas[node][zone].free_pages * PAGE_SIZE;
+    }
+}
+
+/*
+ * Per-CPU page cache statistics (summed over all CPUs)
+ */
+void pmm_get_pcp_stats(struct pmm_pcp_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < MAX_CPUS; i++) {
+        stats->hits += pcp[i].hits;
+        stats->misses += pcp[i].misses;
+        stats->refills += pcp[i].refills;
+        stats->drains += pcp[i].drains;
+        stats->cached += pcp[i].count;
+    }
+}
+
+/*
+ * Zeroed page pool statistics
+ */
+void pmm_get_zero_stats(struct pmm_zero_stats *stats) {
+    stats->hits = zero_hits;
+    stats->misses = zero_misses;
+    stats->pooled = zero_count;
+}
+
+/*
+ * Compaction statistics
+ */
+void pmm_get_compact_stats(struct pmm_compact_stats *stats) {
+    stats->successes = compact_successes;
+    stats->failures = compact_failures;
+    stats->migrated = compact_migrated;
+}
+
+/*
+ * Upper bound (cycles) of the bucket holding the given percentile
+ */
+static uint64_t latency_percentile(const uint64_t *hist, uint64_t samples, uint32_t pct) {
+    if (samples == 0) return 0;
+
+    uint64_t seen = 0;
+    for (uint32_t b = 0; b < PMM_LAT_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen * 100 >= samples * pct) return 2ULL << b;
+    }
+    return 2ULL << (PMM_LAT_BUCKETS - 1);
+}
+
+/*
+ * Allocator statistics
+ * Counters are summed over CPUs without stopping them, so totals may
+ * be slightly out of step with each other. The free extent scan holds
+ * pmm_lock for one pass over the bitmap.
+ */
+void pmm_get_stats(struct pmm_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    for (int i = 0; i < MAX_CPUS; i++) {
+        struct pmm_cpu_stats *st = &cpu_stats[i];
+        stats->allocs += st->allocs;
+        stats->alloc_failures += st->alloc_failures;
+        stats->pages_allocated += st->pages_allocated;
+        stats->frees += st->frees;
+        stats->pages_freed += st->pages_freed;
+        for (int b = 0; b < PMM_LAT_BUCKETS; b++) {
+            stats->latency[b] += st->latency[b];
+        }
+        if (st->latency_max > stats->latency_max) stats->latency_max = st->latency_max;
+        stats->lock_acquires += st->lock_acquires;
+        stats->lock_contended += st->lock_contended;
+        stats->lock_wait_cycles += st->lock_wait_cycles;
+    }
+
+    uint64_t samples = 0;
+    for (int b = 0; b < PMM_LAT_BUCKETS; b++) {
+        samples += stats->latency[b];
+    }
+    stats->latency_p50 = latency_percentile(stats->latency, samples, 50);
+    stats->latency_p90 = latency_percentile(stats->latency, samples, 90);
+    stats->latency_p99 = latency_percentile(stats->latency, samples, 99);
+
+    uint64_t flags;
+    pmm_lock_irqsave(&flags);
+
+    for (uint32_t node = 0; node < NUMA_MAX_NODES; node++) {
+        for (uint32_t zone = 0; zone < PMM_ZONE_COUNT; zone++) {
+            for (uint32_t o = 0; o < PMM_MAX_ORDER; o++) {
+                stats->free_blocks[o] += areas[node][zone].nr_free[o];
+            }
+        }
+    }
+
+    /* Frames parked in caches are marked allocated and split extents */
+    uint64_t page = 0;
+    while (page < highest_page) {
+        uint64_t run_start = bitmap_find_next(page, highest_page, 0);
+        if (run_start >= highest_page) break;
+
+        uint64_t run_end = bitmap_find_next(run_start, highest_page, 1);
+        uint64_t run = run_end - run_start;
+        uint32_t bucket = 63 - __builtin_clzll(run);
+        if (bucket >= PMM_EXTENT_BUCKETS) bucket = PMM_EXTENT_BUCKETS - 1;
+        stats->extents[bucket]++;
+        if (run > stats->largest_extent) stats->largest_extent = run;
+        page = run_end;
+    }
+
+    spinlock_release_irqrestore(&pmm_lock, flags);
+}
+
+void pmm_reset_stats(void) {
+    memset(cpu_stats, 0, sizeof(cpu_stats));
 }
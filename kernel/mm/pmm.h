@@ -1,6 +1,6 @@
 /*
  * AstraOS - Physical Memory Manager Header
- * Bitmap-based page frame allocator
+ * Buddy page frame allocator
  */
 
 #ifndef _ASTRA_MM_PMM_H
@@ -8,6 +8,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 #include "../limine.h"
 
 /*
@@ -26,6 +27,30 @@
  */
 #define PAGE_ALIGN_DOWN(addr) ((addr) & ~(PAGE_SIZE - 1))
 
+/*
+ * Number of buddy orders (largest block is 2^(PMM_MAX_ORDER-1) pages, 4 MB)
+ */
+#define PMM_MAX_ORDER   11
+
+/*
+ * Physical memory zones
+ */
+#define PMM_ZONE_DMA    0       /* Below 16 MB (ISA DMA) */
+#define PMM_ZONE_DMA32  1       /* Below 4 GB (32-bit bus masters) */
+#define PMM_ZONE_NORMAL 2       /* Everything above */
+#define PMM_ZONE_COUNT  3
+
+/*
+ * Allocation flags
+ * Without a zone flag, allocations prefer high memory and only
+ * fall back to lower zones when it is exhausted.
+ */
+#define PMM_DMA         (1 << 0)    /* Must lie below 16 MB */
+#define PMM_DMA32       (1 << 1)    /* Must lie below 4 GB */
+#define PMM_ZERO        (1 << 2)    /* Return zero-filled frames */
+#define PMM_NOCOMPACT   (1 << 3)    /* Fail rather than compact (opportunistic
+                                       requests with a fallback) */
+
 /*
  * Initialize PMM with memory map from bootloader
  */
@@ -43,6 +68,20 @@ void *pmm_alloc_page(void);
  */
 void *pmm_alloc_pages(size_t count);
 
+/*
+ * Allocate multiple contiguous physical pages with allocation flags
+ */
+void *pmm_alloc_pages_flags(size_t count, uint32_t flags);
+
+/*
+ * Allocate contiguous pages, preferring a NUMA node
+ * Falls back to other nodes by distance. PMM_NODE_LOCAL selects
+ * the node of the calling CPU.
+ */
+#define PMM_NODE_LOCAL  (-1)
+
+void *pmm_alloc_pages_node(size_t count, int node, uint32_t alloc_flags);
+
 /*
  * Free a single physical page
  */
@@ -53,6 +92,11 @@ void pmm_free_page(void *page);
  */
 void pmm_free_pages(void *page, size_t count);
 
+/*
+ * Check whether a frame (page number) is marked in use
+ */
+bool pmm_page_in_use(uint64_t page);
+
 /*
  * Get total physical memory (bytes)
  */
@@ -68,4 +112,117 @@ uint64_t pmm_get_free_memory(void);
  */
 uint64_t pmm_get_used_memory(void);
 
+/*
+ * Release bootloader and ACPI reclaimable memory to the allocator
+ * Call once nothing references Limine responses or ACPI tables.
+ * Returns number of bytes reclaimed
+ */
+uint64_t pmm_reclaim_boot_memory(void);
+
+/*
+ * Get memory reclaimed from the bootloader and ACPI (bytes)
+ */
+uint64_t pmm_get_reclaimed_memory(void);
+
+/*
+ * Get free memory on the buddy lists of one node (bytes)
+ */
+uint64_t pmm_get_node_free_memory(uint32_t node);
+
+/*
+ * Get size and free memory of a zone across all nodes (bytes)
+ */
+void pmm_get_zone_stats(uint32_t zone, uint64_t *total, uint64_t *free);
+
+/*
+ * Redistribute free memory into per-node pools (called by numa_init)
+ */
+void pmm_numa_rebuild(void);
+
+/*
+ * Per-CPU page cache statistics
+ */
+struct pmm_pcp_stats {
+    uint64_t hits;          /* Single-page allocations served from a cache */
+    uint64_t misses;        /* Allocations that had to refill first */
+    uint64_t refills;       /* Batch refills from the buddy lists */
+    uint64_t drains;        /* Batch drains to the buddy lists */
+    uint64_t cached;        /* Frames currently held in caches */
+};
+
+void pmm_get_pcp_stats(struct pmm_pcp_stats *stats);
+
+/*
+ * Refill the pre-zeroed page pool by one batch
+ * Registered as idle work; returns true if any frames were zeroed
+ */
+bool pmm_zero_idle(void);
+
+/*
+ * Pre-zeroed page pool statistics
+ */
+struct pmm_zero_stats {
+    uint64_t hits;          /* PMM_ZERO requests served from the pool */
+    uint64_t misses;        /* PMM_ZERO requests zeroed synchronously */
+    uint64_t pooled;        /* Zeroed frames currently in the pool */
+};
+
+void pmm_get_zero_stats(struct pmm_zero_stats *stats);
+
+/*
+ * Run one background compaction pass if no kernel-stack sized block
+ * is free. Registered as idle work; returns true on success
+ */
+bool pmm_compact_idle(void);
+
+/*
+ * Compaction statistics
+ */
+struct pmm_compact_stats {
+    uint64_t successes;     /* Passes that emptied their window */
+    uint64_t failures;      /* Passes that found or emptied no window */
+    uint64_t migrated;      /* Frames moved */
+};
+
+void pmm_get_compact_stats(struct pmm_compact_stats *stats);
+
+/*
+ * Allocator statistics
+ * Counters are kept per CPU and summed on demand. Latencies are
+ * bucketed by power of two: bucket N counts allocations that took
+ * [2^N, 2^(N+1)) TSC cycles. Free extents are maximal runs of free
+ * frames in the bitmap, bucketed by power of two pages the same way.
+ */
+#define PMM_LAT_BUCKETS     32
+#define PMM_EXTENT_BUCKETS  24
+
+struct pmm_stats {
+    uint64_t allocs;            /* Successful allocation calls */
+    uint64_t alloc_failures;    /* Allocation calls that returned NULL */
+    uint64_t pages_allocated;
+    uint64_t frees;             /* Free calls */
+    uint64_t pages_freed;
+
+    uint64_t latency[PMM_LAT_BUCKETS];
+    uint64_t latency_p50;       /* Upper bound of the bucket, in cycles */
+    uint64_t latency_p90;
+    uint64_t latency_p99;
+    uint64_t latency_max;
+
+    uint64_t lock_acquires;     /* pmm_lock acquisitions */
+    uint64_t lock_contended;    /* ... that found the lock held */
+    uint64_t lock_wait_cycles;  /* Cycles spent waiting for it */
+
+    uint64_t extents[PMM_EXTENT_BUCKETS];
+    uint64_t largest_extent;    /* Pages */
+    uint64_t free_blocks[PMM_MAX_ORDER];    /* Buddy blocks per order */
+};
+
+void pmm_get_stats(struct pmm_stats *stats);
+
+/*
+ * Clear the allocation, latency and lock counters
+ */
+void pmm_reset_stats(void);
+
 #endif /* _ASTRA_MM_PMM_H */
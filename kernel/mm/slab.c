@@ -0,0 +1,510 @@
+/*
+ * AstraOS - Object Cache Implementation
+ * Slab allocator for fixed-size kernel objects
+ *
+ * A cache hands out objects of one size from slabs: runs of whole
+ * frames taken from the PMM and reached through the direct map. Each
+ * slab starts with a small header, followed by its objects; free
+ * objects are chained through a pointer stored in the object (after
+ * it, if a constructor must find its state intact), so allocation and
+ * free are a pointer pop and push under the cache lock.
+ *
+ * Slabs are kept on three lists (partial, full, empty) and allocation
+ * prefers partial ones, which keeps the number of half-used slabs low.
+ * One empty slab per cache is kept for the next allocation; further
+ * ones go back to the PMM right away.
+ *
+ * The slab size is the smallest that wastes at most 1/8 of it. What is
+ * left over shifts the first object of successive slabs by a cache
+ * line (colouring), so objects at the same index of different slabs
+ * do not all compete for the same cache sets.
+ *
+ * Frame descriptors of a slab point at its header (private), which is
+ * how kmem_cache_free() finds the slab of an object.
+ *
+ * In front of the slabs, each CPU keeps a small array of free objects
+ * per cache, so most allocations and frees only disable interrupts.
+ * An empty array takes a batch from the partial slabs and a full one
+ * returns its oldest batch, each under one acquisition of the cache
+ * lock. Objects in CPU arrays count as allocated to the slabs.
+ */
+
+#include "slab.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "page.h"
+#include "../lib/string.h"
+#include "../sync/spinlock.h"
+#include "../arch/x86_64/cpu.h"
+#include "../arch/x86_64/percpu.h"
+
+#define KMEM_CACHE_LINE     64
+#define KMEM_MIN_ALIGN      8
+#define KMEM_WASTE_DIV      8           /* Accept 1/8 of a slab unused */
+#define KMEM_EMPTY_KEEP     1           /* Empty slabs kept per cache */
+#define KMEM_CPU_SIZE       8           /* Objects per CPU array */
+#define KMEM_CPU_BATCH      4           /* Objects moved per refill/flush */
+
+/*
+ * Slab header (start of the slab's first frame)
+ */
+struct slab {
+    struct kmem_cache *cache;
+    struct slab *next;
+    struct slab *prev;
+    void *free;                 /* Free objects */
+    uint32_t inuse;
+    uint32_t pad;
+};
+
+/*
+ * Per-CPU object array
+ */
+struct kmem_cpu {
+    uint32_t count;
+    void *objs[KMEM_CPU_SIZE];
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t hits;              /* Allocations served by the array */
+} __attribute__((aligned(64)));
+
+/*
+ * Cache
+ */
+struct kmem_cache {
+    char name[KMEM_NAME_LEN];
+    uint32_t size;              /* Requested object size */
+    uint32_t stride;            /* Object size with link and alignment */
+    uint32_t link;              /* Offset of the free link in an object */
+    uint32_t order;             /* Slab size: PAGE_SIZE << order */
+    uint32_t per_slab;
+    uint32_t offset;            /* First object, without colour */
+    uint32_t colours;           /* Distinct first-object offsets */
+    uint32_t colour_off;        /* Step between them */
+    uint32_t colour_next;
+    kmem_ctor_t ctor;
+
+    struct slab *partial;
+    struct slab *full;
+    struct slab *empty;
+
+    uint64_t slabs;
+    uint64_t empty_slabs;
+    uint64_t active;            /* Objects out of slabs, CPU arrays included */
+    uint64_t grows;
+
+    spinlock_t lock;
+    bool used;
+
+    struct kmem_cpu cpus[MAX_CPUS];
+};
+
+static struct kmem_cache caches[KMEM_MAX_CACHES];
+static spinlock_t caches_lock = SPINLOCK_INIT;
+
+static inline uint32_t align_up(uint32_t value, uint32_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+static inline void **free_link(struct kmem_cache *cache, void *obj) {
+    return (void **)((uint8_t *)obj + cache->link);
+}
+
+/*
+ * Slab list linkage (cache lock held)
+ */
+static void slab_push(struct slab **list, struct slab *slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (slab->next) slab->next->prev = slab;
+    *list = slab;
+}
+
+static void slab_remove(struct slab **list, struct slab *slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next) slab->next->prev = slab->prev;
+}
+
+/*
+ * Slab of an object, or NULL if obj is not in a slab
+ */
+static struct slab *slab_of(void *obj) {
+    struct page *page = page_of(vmm_direct_to_phys(obj));
+    if (!page || page->owner != PAGE_OWNER_SLAB) return NULL;
+    return (struct slab *)page->private;
+}
+
+/*
+ * Allocate and lay out a new slab (cache lock not held)
+ */
+static struct slab *slab_create(struct kmem_cache *cache, uint32_t colour) {
+    size_t pages = 1ULL << cache->order;
+    void *phys = pmm_alloc_pages(pages);
+    if (!phys) return NULL;
+
+    page_set_owner((uint64_t)phys, pages, PAGE_OWNER_SLAB);
+
+    struct slab *slab = vmm_phys_to_virt((uint64_t)phys);
+    for (size_t i = 0; i < pages; i++) {
+        page_of((uint64_t)phys + i * PAGE_SIZE)->private = (uint64_t)slab;
+    }
+
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->free = NULL;
+
+    /* Chain the objects in address order, constructing each */
+    uint8_t *first = (uint8_t *)slab + cache->offset + colour * cache->colour_off;
+    for (uint32_t i = cache->per_slab; i-- > 0;) {
+        void *obj = first + i * cache->stride;
+        if (cache->ctor) cache->ctor(obj);
+        *free_link(cache, obj) = slab->free;
+        slab->free = obj;
+    }
+    return slab;
+}
+
+static void slab_destroy(struct kmem_cache *cache, struct slab *slab) {
+    pmm_free_pages((void *)vmm_direct_to_phys(slab), 1ULL << cache->order);
+}
+
+static void slab_destroy_list(struct kmem_cache *cache, struct slab *list) {
+    while (list) {
+        struct slab *next = list->next;
+        slab_destroy(cache, list);
+        list = next;
+    }
+}
+
+/*
+ * Take an object from the first partial slab (cache lock held)
+ */
+static void *slab_get(struct kmem_cache *cache) {
+    struct slab *slab = cache->partial;
+    void *obj = slab->free;
+    slab->free = *free_link(cache, obj);
+    if (++slab->inuse == cache->per_slab) {
+        slab_remove(&cache->partial, slab);
+        slab_push(&cache->full, slab);
+    }
+    cache->active++;
+    return obj;
+}
+
+/*
+ * Put an object back into its slab (cache lock held)
+ * A slab left empty beyond KMEM_EMPTY_KEEP goes onto *release, to be
+ * destroyed once the lock is dropped.
+ */
+static void slab_put(struct kmem_cache *cache, void *obj, struct slab **release) {
+    struct slab *slab = slab_of(obj);
+    *free_link(cache, obj) = slab->free;
+    slab->free = obj;
+
+    if (slab->inuse-- == cache->per_slab) {
+        slab_remove(&cache->full, slab);
+        slab_push(&cache->partial, slab);
+    }
+    if (slab->inuse == 0) {
+        slab_remove(&cache->partial, slab);
+        if (cache->empty_slabs < KMEM_EMPTY_KEEP) {
+            slab_push(&cache->empty, slab);
+            cache->empty_slabs++;
+        } else {
+            cache->slabs--;
+            slab_push(release, slab);
+        }
+    }
+    cache->active--;
+}
+
+/*
+ * Return the count oldest objects of a CPU array (cache lock held)
+ */
+static void cpu_flush(struct kmem_cache *cache, struct kmem_cpu *cpu, uint32_t count,
+                      struct slab **release) {
+    for (uint32_t i = 0; i < count; i++) {
+        slab_put(cache, cpu->objs[i], release);
+    }
+    for (uint32_t i = count; i < cpu->count; i++) {
+        cpu->objs[i - count] = cpu->objs[i];
+    }
+    cpu->count -= count;
+}
+
+/*
+ * Create
+ */
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align,
+                                     uint32_t flags, kmem_ctor_t ctor) {
+    if (size == 0 || size > (PAGE_SIZE << KMEM_MAX_ORDER)) return NULL;
+    if (align == 0) align = KMEM_MIN_ALIGN;
+    if (align & (align - 1)) return NULL;
+    if (align < KMEM_MIN_ALIGN) align = KMEM_MIN_ALIGN;
+    if ((flags & KMEM_HWALIGN) && align < KMEM_CACHE_LINE) align = KMEM_CACHE_LINE;
+
+    /* Without a constructor the link may overwrite the object itself */
+    uint32_t link = ctor ? align_up(size, sizeof(void *)) : 0;
+    uint32_t raw = ctor ? link + sizeof(void *) : size;
+    if (raw < sizeof(void *)) raw = sizeof(void *);
+    uint32_t stride = align_up(raw, align);
+    uint32_t offset = align_up(sizeof(struct slab), align);
+
+    /* Smallest slab that wastes little, else the smallest that fits */
+    int order = -1;
+    for (uint32_t o = 0; o <= KMEM_MAX_ORDER; o++) {
+        uint32_t bytes = PAGE_SIZE << o;
+        if (bytes < offset + stride) continue;
+        uint32_t waste = (bytes - offset) % stride;
+        if (order < 0) order = o;
+        if (waste <= bytes / KMEM_WASTE_DIV) {
+            order = o;
+            break;
+        }
+    }
+    if (order < 0) return NULL;
+
+    uint64_t irqflags;
+    spinlock_acquire_irqsave(&caches_lock, &irqflags);
+
+    struct kmem_cache *cache = NULL;
+    for (int i = 0; i < KMEM_MAX_CACHES; i++) {
+        if (!caches[i].used) {
+            cache = &caches[i];
+            break;
+        }
+    }
+    if (!cache) {
+        spinlock_release_irqrestore(&caches_lock, irqflags);
+        return NULL;
+    }
+
+    memset(cache, 0, sizeof(*cache));
+    strncpy(cache->name, name, KMEM_NAME_LEN - 1);
+    cache->size = size;
+    cache->stride = stride;
+    cache->link = link;
+    cache->order = order;
+    cache->offset = offset;
+
+    uint32_t usable = (PAGE_SIZE << order) - offset;
+    cache->per_slab = usable / stride;
+    cache->colour_off = align > KMEM_CACHE_LINE ? align : KMEM_CACHE_LINE;
+    cache->colours = (usable % stride) / cache->colour_off + 1;
+    cache->ctor = ctor;
+    spinlock_init(&cache->lock);
+    cache->used = true;
+
+    spinlock_release_irqrestore(&caches_lock, irqflags);
+    return cache;
+}
+
+/*
+ * Destroy
+ */
+bool kmem_cache_destroy(struct kmem_cache *cache) {
+    if (!cache) return false;
+
+    uint64_t irqflags;
+    spinlock_acquire_irqsave(&caches_lock, &irqflags);
+    spinlock_acquire(&cache->lock);
+
+    /* The cache is idle by now, so the CPU arrays can be emptied here */
+    struct slab *release = NULL;
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        cpu_flush(cache, &cache->cpus[i], cache->cpus[i].count, &release);
+    }
+
+    if (cache->active) {
+        spinlock_release(&cache->lock);
+        spinlock_release_irqrestore(&caches_lock, irqflags);
+        return false;
+    }
+
+    /* Nothing allocated, so every slab is empty */
+    while (cache->empty) {
+        struct slab *slab = cache->empty;
+        slab_remove(&cache->empty, slab);
+        slab_push(&release, slab);
+    }
+    cache->used = false;
+
+    spinlock_release(&cache->lock);
+    spinlock_release_irqrestore(&caches_lock, irqflags);
+
+    slab_destroy_list(cache, release);
+    return true;
+}
+
+/*
+ * Allocate
+ */
+void *kmem_cache_alloc(struct kmem_cache *cache) {
+    if (!cache) return NULL;
+
+    uint64_t irqflags = cpu_save_flags();
+    cpu_cli();
+
+    struct kmem_cpu *cpu = &cache->cpus[cpu_current_id()];
+    if (cpu->count) {
+        void *obj = cpu->objs[--cpu->count];
+        cpu->hits++;
+        cpu->allocs++;
+        cpu_restore_flags(irqflags);
+        return obj;
+    }
+
+    spinlock_acquire(&cache->lock);
+
+    while (!cache->partial) {
+        struct slab *slab = cache->empty;
+        if (slab) {
+            slab_remove(&cache->empty, slab);
+            cache->empty_slabs--;
+            slab_push(&cache->partial, slab);
+            break;
+        }
+
+        /* Grow without the lock: the PMM may reclaim, ctors may be slow */
+        uint32_t colour = cache->colour_next;
+        cache->colour_next = (colour + 1) % cache->colours;
+        spinlock_release(&cache->lock);
+        cpu_restore_flags(irqflags);
+
+        slab = slab_create(cache, colour);
+
+        irqflags = cpu_save_flags();
+        cpu_cli();
+        cpu = &cache->cpus[cpu_current_id()];
+        spinlock_acquire(&cache->lock);
+        if (!slab) {
+            spinlock_release(&cache->lock);
+            cpu_restore_flags(irqflags);
+            return NULL;
+        }
+        slab_push(&cache->partial, slab);
+        cache->slabs++;
+        cache->grows++;
+    }
+
+    /* Take one, and refill the array from what partial slabs have left */
+    void *obj = slab_get(cache);
+    while (cpu->count < KMEM_CPU_BATCH && cache->partial) {
+        cpu->objs[cpu->count++] = slab_get(cache);
+    }
+    cpu->allocs++;
+
+    spinlock_release(&cache->lock);
+    cpu_restore_flags(irqflags);
+    return obj;
+}
+
+/*
+ * Free
+ */
+void kmem_cache_free(struct kmem_cache *cache, void *obj) {
+    if (!cache || !obj) return;
+
+    struct slab *slab = slab_of(obj);
+    if (!slab || slab->cache != cache) {
+        return;  /* Invalid pointer */
+    }
+
+    uint64_t irqflags = cpu_save_flags();
+    cpu_cli();
+
+    struct kmem_cpu *cpu = &cache->cpus[cpu_current_id()];
+    struct slab *release = NULL;
+    if (cpu->count == KMEM_CPU_SIZE) {
+        spinlock_acquire(&cache->lock);
+        cpu_flush(cache, cpu, KMEM_CPU_BATCH, &release);
+        spinlock_release(&cache->lock);
+    }
+    cpu->objs[cpu->count++] = obj;
+    cpu->frees++;
+
+    cpu_restore_flags(irqflags);
+
+    slab_destroy_list(cache, release);
+}
+
+/*
+ * Shrink
+ */
+uint64_t kmem_cache_shrink(struct kmem_cache *cache) {
+    if (!cache) return 0;
+
+    uint64_t irqflags = cpu_save_flags();
+    cpu_cli();
+    spinlock_acquire(&cache->lock);
+
+    /* This CPU's array may be all that keeps some slabs in use */
+    struct slab *list = NULL;
+    struct kmem_cpu *cpu = &cache->cpus[cpu_current_id()];
+    cpu_flush(cache, cpu, cpu->count, &list);
+
+    uint64_t count = cache->empty_slabs;
+    while (cache->empty) {
+        struct slab *slab = cache->empty;
+        slab_remove(&cache->empty, slab);
+        slab_push(&list, slab);
+    }
+    cache->empty_slabs = 0;
+    cache->slabs -= count;
+
+    spinlock_release(&cache->lock);
+    cpu_restore_flags(irqflags);
+
+    /* Slabs released by the flush were already taken off the count */
+    uint64_t pages = 0;
+    for (struct slab *slab = list; slab; slab = slab->next) {
+        pages += 1ULL << cache->order;
+    }
+    slab_destroy_list(cache, list);
+    return pages;
+}
+
+/*
+ * Statistics
+ */
+int kmem_cache_get_stats(struct kmem_cache_stats *stats, int max) {
+    int count = 0;
+
+    uint64_t irqflags;
+    spinlock_acquire_irqsave(&caches_lock, &irqflags);
+
+    for (int i = 0; i < KMEM_MAX_CACHES && count < max; i++) {
+        struct kmem_cache *cache = &caches[i];
+        if (!cache->used) continue;
+
+        struct kmem_cache_stats *st = &stats[count++];
+        spinlock_acquire(&cache->lock);
+        memcpy(st->name, cache->name, KMEM_NAME_LEN);
+        st->object_size = cache->size;
+        st->stride = cache->stride;
+        st->per_slab = cache->per_slab;
+        st->slab_pages = 1u << cache->order;
+        st->cached = 0;
+        st->allocs = 0;
+        st->frees = 0;
+        st->hits = 0;
+        for (uint32_t c = 0; c < MAX_CPUS; c++) {
+            st->cached += cache->cpus[c].count;
+            st->allocs += cache->cpus[c].allocs;
+            st->frees += cache->cpus[c].frees;
+            st->hits += cache->cpus[c].hits;
+        }
+        st->active = cache->active - st->cached;
+        st->total = cache->slabs * cache->per_slab;
+        st->slabs = cache->slabs;
+        st->grows = cache->grows;
+        spinlock_release(&cache->lock);
+    }
+
+    spinlock_release_irqrestore(&caches_lock, irqflags);
+    return count;
+}
@@ -0,0 +1,93 @@
+/*
+ * AstraOS - Object Cache Header
+ * Slab allocator for fixed-size kernel objects
+ */
+
+#ifndef _ASTRA_MM_SLAB_H
+#define _ASTRA_MM_SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Limits
+ */
+#define KMEM_MAX_CACHES     32
+#define KMEM_NAME_LEN       16
+#define KMEM_MAX_ORDER      5           /* Largest slab: 128 KB */
+
+/*
+ * Cache flags
+ */
+#define KMEM_HWALIGN        (1 << 0)    /* Start objects on a cache line */
+
+/*
+ * Object constructor
+ * Runs once per object when its slab is created. Objects must be
+ * freed back in their constructed state, so allocation skips it.
+ */
+typedef void (*kmem_ctor_t)(void *obj);
+
+struct kmem_cache;
+
+/*
+ * Create a cache of size-byte objects
+ * align (0 for the default of 8) must be a power of two; KMEM_HWALIGN
+ * raises it to a cache line. ctor may be NULL.
+ * Returns NULL if no cache is free or the object cannot fit a slab
+ */
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align,
+                                     uint32_t flags, kmem_ctor_t ctor);
+
+/*
+ * Destroy a cache
+ * No CPU may be using the cache any more.
+ * Returns false (and keeps the cache) while objects are allocated
+ */
+bool kmem_cache_destroy(struct kmem_cache *cache);
+
+/*
+ * Allocate an object
+ * Returns NULL when out of memory
+ */
+void *kmem_cache_alloc(struct kmem_cache *cache);
+
+/*
+ * Free an object back to its cache
+ */
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+
+/*
+ * Give the frames of all empty slabs back to the PMM
+ * Objects cached by the calling CPU are returned to their slabs first.
+ * Returns the number of pages freed
+ */
+uint64_t kmem_cache_shrink(struct kmem_cache *cache);
+
+/*
+ * Cache statistics
+ */
+struct kmem_cache_stats {
+    char name[KMEM_NAME_LEN];
+    uint32_t object_size;   /* Requested size */
+    uint32_t stride;        /* Bytes per object in a slab */
+    uint32_t per_slab;      /* Objects per slab */
+    uint32_t slab_pages;    /* Pages per slab */
+    uint64_t active;        /* Objects allocated */
+    uint64_t cached;        /* Free objects in per-CPU arrays */
+    uint64_t total;         /* Objects in all slabs */
+    uint64_t slabs;         /* Slabs held */
+    uint64_t allocs;        /* kmem_cache_alloc() calls that succeeded */
+    uint64_t hits;          /* ... served by a per-CPU array */
+    uint64_t frees;
+    uint64_t grows;         /* Slabs created */
+};
+
+/*
+ * Fill stats for up to max live caches
+ * Returns the number of entries filled
+ */
+int kmem_cache_get_stats(struct kmem_cache_stats *stats, int max);
+
+#endif /* _ASTRA_MM_SLAB_H */
@@ -0,0 +1,575 @@
+/*
+ * AstraOS - Virtual Memory Regions Implementation
+ * Reserved address ranges backed on demand by the page fault handler
+ *
+ * Each address space has a list of reserved regions sorted by start
+ * address. Reserving only records the range; the first access to a
+ * page faults, and the handler allocates a zero-filled frame (usually
+ * straight from the pre-zeroed pool) and maps it. Write faults on
+ * present pages go to the VMM's copy-on-write path. Regions in the
+ * kernel half always belong to the kernel address space, whose upper
+ * half every other address space shares.
+ *
+ * File regions map pages of the page cache instead, read-only or
+ * copy-on-write, so every mapper of a file page shares one frame. The
+ * page is looked up with vma_lock dropped: reading it goes through the
+ * filesystem, which allocates from the heap and may fault itself.
+ *
+ * Committed pages of anonymous kernel regions may be swapped out to
+ * zram. Their page table entries then hold a swap entry naming the
+ * compressed copy, and a fault decompresses it into a fresh frame.
+ * While a page is on its way out its entry is marked PTE_SWAP_BUSY,
+ * and faults on it back off until the swap-out is done.
+ *
+ * Regions are unmapped with vma_lock dropped, since the TLB flush may
+ * wait for other CPUs. A region being released is marked dying first:
+ * it keeps its range, but faults and swap no longer see it.
+ *
+ * Regions come from a static pool, so the heap can reserve its range
+ * before kmalloc works.
+ */
+
+#include "vma.h"
+#include "pmm.h"
+#include "page.h"
+#include "filemap.h"
+#include "zram.h"
+#include "../arch/x86_64/cpu.h"
+#include "../sync/spinlock.h"
+
+/*
+ * Page fault error code bits
+ */
+#define PF_PRESENT          (1 << 0)    /* Protection violation on a present page */
+#define PF_WRITE            (1 << 1)
+#define PF_USER             (1 << 2)
+#define PF_RESERVED         (1 << 3)    /* Reserved bit set in a paging entry */
+#define PF_FETCH            (1 << 4)    /* Instruction fetch */
+
+/*
+ * Reserved region
+ */
+struct vma {
+    uint64_t start;             /* Page aligned, end exclusive */
+    uint64_t end;
+    uint64_t pte_flags;
+    uint64_t committed;         /* Pages faulted in */
+    uint64_t swapped;           /* Pages swapped out to zram */
+    uint32_t flags;             /* VMA_* */
+    uint16_t owner;             /* PAGE_OWNER_* of faulted pages */
+    bool used;
+    bool dying;                 /* Being released */
+    uint64_t id;                /* Tells reuses of a pool slot apart */
+    struct filemap *file;       /* File regions: page cache */
+    uint64_t offset;            /* File page mapped at start */
+    struct vma *next;
+};
+
+/*
+ * Regions of one address space
+ */
+struct vma_space {
+    pagetable_t pml4;           /* NULL = free slot */
+    struct vma *regions;
+};
+
+static struct vma vma_pool[VMA_MAX_REGIONS];
+static struct vma_space spaces[VMA_MAX_SPACES];
+static spinlock_t vma_lock = SPINLOCK_INIT;
+
+static uint64_t fault_count = 0;
+static uint64_t cow_count = 0;
+static uint64_t committed_pages = 0;
+static uint64_t reserved_pages = 0;
+static uint64_t swapped_pages = 0;
+static uint64_t next_id = 0;
+
+/*
+ * Swap entries hold the zram handle in the address bits
+ */
+static inline uint64_t swap_entry(uint64_t handle) {
+    return (handle << PAGE_SHIFT) | PTE_SWAP;
+}
+
+static inline uint64_t swap_handle(uint64_t entry) {
+    return (entry & PTE_ADDR_MASK) >> PAGE_SHIFT;
+}
+
+/*
+ * Find the region list of an address space, optionally creating it
+ */
+static struct vma_space *space_get(pagetable_t pml4, bool create) {
+    struct vma_space *free_slot = NULL;
+    for (int i = 0; i < VMA_MAX_SPACES; i++) {
+        if (spaces[i].pml4 == pml4) return &spaces[i];
+        if (!spaces[i].pml4 && !free_slot) free_slot = &spaces[i];
+    }
+
+    if (!create || !free_slot) return NULL;
+    free_slot->pml4 = pml4;
+    free_slot->regions = NULL;
+    return free_slot;
+}
+
+/*
+ * Address space that owns an address
+ */
+static pagetable_t owner_pml4(pagetable_t pml4, uint64_t addr) {
+    if (addr >= KERNEL_HALF_BASE || !pml4) return vmm_get_kernel_pml4();
+    return pml4;
+}
+
+/*
+ * Find the live region containing addr
+ */
+static struct vma *vma_find(struct vma_space *space, uint64_t addr) {
+    for (struct vma *vma = space->regions; vma && vma->start <= addr; vma = vma->next) {
+        if (addr < vma->end) return vma->dying ? NULL : vma;
+    }
+    return NULL;
+}
+
+/*
+ * File page mapped at addr
+ */
+static inline uint64_t vma_file_index(struct vma *vma, uint64_t addr) {
+    return vma->offset + (addr - vma->start) / PAGE_SIZE;
+}
+
+/*
+ * Drop what a region still holds once it is unmapped (vma_lock held)
+ * Committed pages are mapped PTE_OWNED, so the unmap already dropped
+ * their references and freed frames no other address space or the
+ * page cache shares. Swapped-out pages are dropped from zram here.
+ */
+static void vma_free_pages(pagetable_t pml4, struct vma *vma) {
+    for (uint64_t addr = vma->start; vma->swapped > 0 && addr < vma->end; addr += PAGE_SIZE) {
+        /* Busy entries are cleared by their swap-out */
+        uint64_t entry = vmm_get_swap_entry(pml4, addr);
+        if (entry && !(entry & PTE_SWAP_BUSY)) {
+            zram_free(swap_handle(entry));
+            vmm_set_swap_entry(pml4, addr, 0);
+            vma->swapped--;
+            swapped_pages--;
+        }
+    }
+
+    filemap_close(vma->file);
+
+    committed_pages -= vma->committed;
+    reserved_pages -= (vma->end - vma->start) / PAGE_SIZE;
+}
+
+/*
+ * Add a region to an address space
+ */
+static bool vma_insert(pagetable_t pml4, uint64_t start, size_t size, uint64_t pte_flags,
+                       uint16_t owner, uint32_t flags, struct filemap *file, uint64_t offset) {
+    uint64_t end = PAGE_ALIGN_UP(start + size);
+    start = PAGE_ALIGN_DOWN(start);
+    if (size == 0 || end <= start) return false;
+
+    pml4 = owner_pml4(pml4, start);
+
+    uint64_t irqflags;
+    spinlock_acquire_irqsave(&vma_lock, &irqflags);
+
+    struct vma_space *space = space_get(pml4, true);
+    struct vma *vma = NULL;
+    for (int i = 0; i < VMA_MAX_REGIONS && space; i++) {
+        if (!vma_pool[i].used) {
+            vma = &vma_pool[i];
+            break;
+        }
+    }
+    if (!vma) {
+        spinlock_release_irqrestore(&vma_lock, irqflags);
+        return false;
+    }
+
+    /* Find the sorted position and refuse overlaps */
+    struct vma **link = &space->regions;
+    while (*link && (*link)->end <= start) {
+        link = &(*link)->next;
+    }
+    if (*link && (*link)->start < end) {
+        spinlock_release_irqrestore(&vma_lock, irqflags);
+        return false;
+    }
+
+    vma->start = start;
+    vma->end = end;
+    vma->pte_flags = pte_flags;
+    vma->committed = 0;
+    vma->swapped = 0;
+    vma->flags = flags;
+    vma->owner = owner;
+    vma->used = true;
+    vma->dying = false;
+    vma->id = ++next_id;
+    vma->file = file;
+    vma->offset = offset;
+    vma->next = *link;
+    *link = vma;
+    reserved_pages += (end - start) / PAGE_SIZE;
+
+    spinlock_release_irqrestore(&vma_lock, irqflags);
+    return true;
+}
+
+/*
+ * Reserve a range
+ */
+bool vma_reserve(pagetable_t pml4, uint64_t start, size_t size,
+                 uint64_t pte_flags, uint16_t owner, uint32_t flags) {
+    return vma_insert(pml4, start, size, pte_flags, owner, flags, NULL, 0);
+}
+
+/*
+ * Map a file
+ */
+bool vma_map_file(pagetable_t pml4, uint64_t start, size_t size, uint64_t pte_flags,
+                  struct vfs_node *node, uint64_t offset) {
+    if (offset % PAGE_SIZE != 0) return false;
+
+    struct filemap *file = filemap_open(node);
+    if (!file) return false;
+
+    uint64_t file_pages = (filemap_size(file) + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t pages = (PAGE_ALIGN_UP(start + size) - PAGE_ALIGN_DOWN(start)) / PAGE_SIZE;
+    if (offset / PAGE_SIZE + pages > file_pages ||
+        !vma_insert(pml4, start, size, pte_flags, PAGE_OWNER_PAGECACHE, 0,
+                    file, offset / PAGE_SIZE)) {
+        filemap_close(file);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Drop a reservation
+ */
+bool vma_release(pagetable_t pml4, uint64_t start) {
+    pml4 = owner_pml4(pml4, start);
+
+    uint64_t irqflags;
+    spinlock_acquire_irqsave(&vma_lock, &irqflags);
+
+    struct vma_space *space = space_get(pml4, false);
+    struct vma *vma = space ? space->regions : NULL;
+    while (vma && vma->start != start) {
+        vma = vma->next;
+    }
+    if (!vma || vma->dying) {
+        spinlock_release_irqrestore(&vma_lock, irqflags);
+        return true;
+    }
+    vma->dying = true;
+    spinlock_release_irqrestore(&vma_lock, irqflags);
+
+    bool ok = vmm_unmap_range(pml4, vma->start, vma->end - vma->start);
+
+    spinlock_acquire_irqsave(&vma_lock, &irqflags);
+    if (ok) {
+        vma_free_pages(pml4, vma);
+
+        /* Other regions may have come and gone meanwhile */
+        struct vma **link = &space->regions;
+        while (*link != vma) {
+            link = &(*link)->next;
+        }
+        *link = vma->next;
+        vma->used = false;
+    } else {
+        vma->dying = false;
+    }
+    spinlock_release_irqrestore(&vma_lock, irqflags);
+    return ok;
+}
+
+/*
+ * Copy the lower-half reservations of an address space
+ */
+bool vma_clone_space(pagetable_t src, pagetable_t dst) {
+    uint64_t irqflags;
+    spinlock_acquire_irqsave(&vma_lock, &irqflags);
+
+    struct vma_space *from = space_get(src, false);
+    struct vma_space *to = from ? space_get(dst, true) : NULL;
+    bool ok = from == NULL || to != NULL;
+
+    struct vma **link = to ? &to->regions : NULL;
+    for (struct vma *vma = from ? from->regions : NULL; vma && ok; vma = vma->next) {
+        if (vma->start >= KERNEL_HALF_BASE) break;
+        if (vma->dying) continue;
+
+        struct vma *copy = NULL;
+        for (int i = 0; i < VMA_MAX_REGIONS; i++) {
+            if (!vma_pool[i].used) {
+                copy = &vma_pool[i];
+                break;
+            }
+        }
+        if (!copy) {
+            ok = false;
+            break;
+        }
+
+        *copy = *vma;
+        copy->next = NULL;
+        if (copy->file) filemap_dup(copy->file);
+        *link = copy;
+        link = &copy->next;
+        committed_pages += copy->committed;
+        reserved_pages += (copy->end - copy->start) / PAGE_SIZE;
+    }
+
+    spinlock_release_irqrestore(&vma_lock, irqflags);
+    return ok;
+}
+
+/*
+ * Drop every reservation of an address space
+ */
+void vma_destroy_space(pagetable_t pml4) {
+    if (!pml4 || pml4 == vmm_get_kernel_pml4()) return;
+
+    uint64_t irqflags;
+    spinlock_acquire_irqsave(&vma_lock, &irqflags);
+
+    /* Detach the regions, then unmap them unlocked */
+    struct vma_space *space = space_get(pml4, false);
+    struct vma *regions = NULL;
+    if (space) {
+        regions = space->regions;
+        space->pml4 = NULL;
+    }
+    spinlock_release_irqrestore(&vma_lock, irqflags);
+
+    for (struct vma *vma = regions; vma; vma = vma->next) {
+        /* Failing that, the tables go with the address space anyway */
+        vmm_unmap_range(pml4, vma->start, vma->end - vma->start);
+    }
+
+    spinlock_acquire_irqsave(&vma_lock, &irqflags);
+    while (regions) {
+        struct vma *vma = regions;
+        regions = vma->next;
+        vma_free_pages(pml4, vma);
+        vma->used = false;
+    }
+    spinlock_release_irqrestore(&vma_lock, irqflags);
+}
+
+/*
+ * Resolve a fault on a reserved page
+ * Runs with interrupts disabled from the #PF handler.
+ */
+bool vma_handle_fault(uint64_t addr, uint64_t error_code) {
+    if (error_code & PF_RESERVED) return false;
+
+    if (error_code & PF_PRESENT) {
+        if (!(error_code & PF_WRITE)) return false;
+        if (!vmm_resolve_cow(vmm_get_current_pml4(), addr, error_code & PF_USER)) return false;
+        __atomic_add_fetch(&cow_count, 1, __ATOMIC_RELAXED);
+        return true;
+    }
+
+    pagetable_t pml4 = owner_pml4(vmm_get_current_pml4(), addr);
+
+    uint64_t irqflags;
+    spinlock_acquire_irqsave(&vma_lock, &irqflags);
+
+    struct vma_space *space = space_get(pml4, false);
+    struct vma *vma = space ? vma_find(space, addr) : NULL;
+
+    bool ok = vma != NULL;
+    if (ok && (error_code & PF_USER) && !(vma->pte_flags & PTE_USER)) ok = false;
+    if (ok && (error_code & PF_WRITE) && !(vma->pte_flags & PTE_WRITABLE)) ok = false;
+    if (ok && (error_code & PF_FETCH) && (vma->pte_flags & PTE_NX)) ok = false;
+
+    /* Another CPU may have mapped it in the meantime */
+    uint64_t page = PAGE_ALIGN_DOWN(addr);
+    if (ok && vma->file && vmm_virt_to_phys(pml4, page) == 0) {
+        struct filemap *file = vma->file;
+        uint64_t index = vma_file_index(vma, page);
+        filemap_dup(file);
+        spinlock_release_irqrestore(&vma_lock, irqflags);
+
+        uint64_t frame = filemap_get_page(file, index);
+
+        /* The region may have changed while the lock was dropped */
+        spinlock_acquire_irqsave(&vma_lock, &irqflags);
+        space = space_get(pml4, false);
+        vma = space ? vma_find(space, addr) : NULL;
+        ok = frame && vma && vma->file == file && vma_file_index(vma, page) == index;
+
+        if (ok && vmm_virt_to_phys(pml4, page) == 0) {
+            /* Writable file mappings are private */
+            uint64_t pte_flags = vma->pte_flags | PTE_OWNED;
+            if (pte_flags & PTE_WRITABLE) pte_flags = (pte_flags & ~PTE_WRITABLE) | PTE_COW;
+
+            if (vmm_map_page(pml4, page, frame, pte_flags)) {
+                vma->committed++;
+                committed_pages++;
+                frame = 0;
+            } else {
+                ok = false;
+            }
+        }
+
+        /* Not mapped: give back the reference taken for us */
+        if (frame) page_put(page_of(frame));
+        filemap_close(file);
+    } else if (ok && vmm_virt_to_phys(pml4, page) == 0) {
+        /* A swapped-out page comes back from zram, anything else zeroed */
+        uint64_t swap = vmm_get_swap_entry(pml4, page);
+        if (swap & PTE_SWAP_BUSY) {
+            /* On its way out: let that finish (it may be waiting for our TLB) */
+            spinlock_release_irqrestore(&vma_lock, irqflags);
+            vmm_shootdown_ipi();
+            cpu_pause();
+            return true;
+        }
+
+        void *frame = pmm_alloc_pages_flags(1, swap ? 0 : PMM_ZERO);
+        if (!frame && swap) frame = zram_reserve_take();   /* No reclaim here */
+        if (frame && swap && !zram_load(swap_handle(swap), vmm_phys_to_virt((uint64_t)frame))) {
+            pmm_free_page(frame);
+            frame = NULL;
+        }
+
+        if (frame) {
+            page_set_owner((uint64_t)frame, 1, vma->owner);
+            if (vmm_map_page(pml4, page, (uint64_t)frame, vma->pte_flags | PTE_OWNED)) {
+                if (vma->flags & VMA_MOVABLE) {
+                    page_set_movable((uint64_t)frame, page);
+                }
+                if (swap) {
+                    zram_free(swap_handle(swap));
+                    vma->swapped--;
+                    swapped_pages--;
+                }
+                vma->committed++;
+                committed_pages++;
+            } else {
+                pmm_free_page(frame);
+                ok = false;
+            }
+        } else {
+            ok = false;
+        }
+    }
+
+    if (ok) fault_count++;
+
+    spinlock_release_irqrestore(&vma_lock, irqflags);
+    return ok;
+}
+
+/*
+ * Swap out a page
+ * Only kernel regions are scanned: lower-half entries are copied when
+ * an address space is cloned, and a swap entry must have one owner.
+ * The TLB flushes and the compression run with vma_lock dropped, since
+ * a flush may wait for CPUs that are spinning on it. Meanwhile an extra
+ * reference pins the frame, and once unmapped its entry is a busy swap
+ * entry that faults back off from.
+ */
+bool vma_swap_out(uint64_t addr) {
+    pagetable_t pml4 = vmm_get_kernel_pml4();
+    uint64_t page = PAGE_ALIGN_DOWN(addr);
+    if (page < KERNEL_HALF_BASE) return false;
+
+    /* Reclaim may run from inside an allocation: never wait for the lock */
+    uint64_t irqflags = cpu_save_flags();
+    cpu_cli();
+    if (!spinlock_try_acquire(&vma_lock)) {
+        cpu_restore_flags(irqflags);
+        return false;
+    }
+
+    struct vma_space *space = space_get(pml4, false);
+    struct vma *vma = space ? vma_find(space, page) : NULL;
+    uint64_t phys = vma && !vma->file ? vmm_virt_to_phys(pml4, page) : 0;
+    struct page *frame = phys ? page_of(phys) : NULL;
+    uint64_t id = vma ? vma->id : 0;
+
+    /* Shared frames stay; the pin keeps compaction and other swap-outs off */
+    bool ok = frame && frame->refcount == 1;
+    if (ok) page_get(frame);
+    spinlock_release(&vma_lock);
+
+    if (!ok) {
+        cpu_restore_flags(irqflags);
+        return false;
+    }
+
+    /* Recently used pages get a second chance */
+    ok = !vmm_test_and_clear_accessed(pml4, page);
+
+    /* A page that failed before is only worth trying once written again */
+    if (ok && (__atomic_load_n(&frame->flags, __ATOMIC_RELAXED) & PAGE_FLAG_NOSWAP)) {
+        ok = vmm_test_and_clear_dirty(pml4, page);
+        if (ok) __atomic_fetch_and(&frame->flags, ~PAGE_FLAG_NOSWAP, __ATOMIC_RELAXED);
+    }
+
+    uint64_t old = ok ? vmm_swap_out_page(pml4, page, PTE_SWAP | PTE_SWAP_BUSY) : 0;
+    bool mine = old && (old & PTE_ADDR_MASK) == phys;
+    uint64_t handle = 0;
+    bool stored = mine && zram_store(vmm_phys_to_virt(phys), &handle);
+
+    spinlock_acquire(&vma_lock);
+
+    /*
+     * The region may have been released (and its slot reused) meanwhile.
+     * One still being released frees a stored page's swap entry itself.
+     */
+    vma = space->regions;
+    while (vma && !(vma->start <= page && page < vma->end)) {
+        vma = vma->next;
+    }
+    bool live = vma && vma->id == id;
+    if (live && vma->dying && !stored) live = false;
+
+    ok = false;
+    if (old && live && stored) {
+        vmm_set_swap_entry(pml4, page, swap_entry(handle));
+        page_put(frame);
+        vma->committed--;
+        committed_pages--;
+        vma->swapped++;
+        swapped_pages++;
+        ok = true;
+    } else if (old && live) {
+        /* Put it back; the tables are still there, so this cannot fail */
+        uint64_t flags = old & ~PTE_ADDR_MASK;
+        if (mine) {
+            /* Clean, so a later write shows it changed */
+            __atomic_fetch_or(&frame->flags, PAGE_FLAG_NOSWAP, __ATOMIC_RELAXED);
+            flags &= ~PTE_DIRTY;
+        }
+        vmm_map_page(pml4, page, old & PTE_ADDR_MASK, flags);
+    } else if (old) {
+        /* Released or going: the busy entry and its reference are ours to drop */
+        if (stored) zram_free(handle);
+        vmm_set_swap_entry(pml4, page, 0);
+        if (old & PTE_OWNED) page_put(page_of(old & PTE_ADDR_MASK));
+    }
+
+    spinlock_release(&vma_lock);
+    page_put(frame);
+    cpu_restore_flags(irqflags);
+    return ok;
+}
+
+/*
+ * Demand paging statistics
+ */
+void vma_get_stats(struct vma_stats *stats) {
+    stats->faults = fault_count;
+    stats->cow_faults = cow_count;
+    stats->committed = committed_pages;
+    stats->reserved = reserved_pages;
+    stats->swapped = swapped_pages;
+}
@@ -0,0 +1,93 @@
+/*
+ * AstraOS - Virtual Memory Regions Header
+ * Reserved address ranges backed on demand by the page fault handler
+ */
+
+#ifndef _ASTRA_MM_VMA_H
+#define _ASTRA_MM_VMA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "vmm.h"
+#include "../fs/vfs.h"
+
+/*
+ * Region limits
+ */
+#define VMA_MAX_REGIONS     128
+#define VMA_MAX_SPACES      64
+
+/*
+ * Region flags
+ */
+#define VMA_MOVABLE         (1 << 0)    /* Faulted pages may be migrated */
+
+/*
+ * Reserve a virtual range in an address space (NULL = kernel)
+ * Nothing is mapped; each page is allocated zero-filled and mapped
+ * with pte_flags on first touch and tagged with owner. Ranges in the
+ * kernel half are shared by all address spaces.
+ * Returns true on success
+ */
+bool vma_reserve(pagetable_t pml4, uint64_t start, size_t size,
+                 uint64_t pte_flags, uint16_t owner, uint32_t flags);
+
+/*
+ * Map pages of a file from offset (page aligned) on
+ * Pages come from the page cache on first touch and are shared with
+ * every other mapping of the file. With PTE_WRITABLE the mapping is
+ * private: a write copies the page. The range must lie within the
+ * file. Returns true on success
+ */
+bool vma_map_file(pagetable_t pml4, uint64_t start, size_t size, uint64_t pte_flags,
+                  struct vfs_node *node, uint64_t offset);
+
+/*
+ * Drop a reservation or file mapping, unmapping and freeing every page
+ * it committed
+ * Returns false, keeping the region, if it could not be unmapped (out
+ * of memory for the page tables that splitting a huge page needs)
+ */
+bool vma_release(pagetable_t pml4, uint64_t start);
+
+/*
+ * Copy the lower-half reservations of src to dst
+ * Used by vmm_clone_address_space(). Returns false if the region pool
+ * ran out
+ */
+bool vma_clone_space(pagetable_t src, pagetable_t dst);
+
+/*
+ * Drop every reservation of an address space
+ */
+void vma_destroy_space(pagetable_t pml4);
+
+/*
+ * Page fault hook
+ * Returns true if the fault was resolved by committing a page or
+ * copying a copy-on-write page
+ */
+bool vma_handle_fault(uint64_t addr, uint64_t error_code);
+
+/*
+ * Swap a committed page of an anonymous kernel region out to zram
+ * Returns false if addr is not such a page, its accessed bit was set
+ * (it is cleared for the next look) or the page could not be stored
+ */
+bool vma_swap_out(uint64_t addr);
+
+/*
+ * Demand paging statistics
+ */
+struct vma_stats {
+    uint64_t faults;        /* Faults resolved by committing a page */
+    uint64_t cow_faults;    /* Faults resolved by copy-on-write */
+    uint64_t committed;     /* Pages currently committed */
+    uint64_t reserved;      /* Pages currently reserved */
+    uint64_t swapped;       /* Pages currently swapped out */
+};
+
+void vma_get_stats(struct vma_stats *stats);
+
+#endif /* _ASTRA_MM_VMA_H */
@@ -0,0 +1,281 @@
+/*
+ * AstraOS - Kernel Virtual Allocator Implementation
+ * Virtually contiguous allocations backed by scattered frames
+ *
+ * Allocations are carved first-fit out of the vmalloc area. Each one
+ * takes its pages plus a leading guard page that is never mapped; the
+ * guard of the next allocation sits right after it, so an overflow in
+ * either direction faults instead of reaching a neighbour. Frames are
+ * allocated one at a time and mapped a batch per vmm_map_pages() call.
+ *
+ * File mappings take an area the same way but leave the pages to a
+ * file region of the VMA layer, which faults them in from the page
+ * cache.
+ */
+
+#include "vmalloc.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "page.h"
+#include "vma.h"
+#include "../lib/string.h"
+#include "../sync/spinlock.h"
+
+/*
+ * Pages mapped or freed per VMM call
+ */
+#define VMALLOC_BATCH       64
+
+/*
+ * Allocated area, guard page included
+ */
+struct vmalloc_area {
+    uint64_t start;         /* Guard page */
+    uint64_t pages;         /* Mapped pages after the guard */
+    bool file;              /* File mapping owned by a VMA region */
+    bool dying;             /* Being freed; the range stays taken */
+};
+
+/*
+ * Areas sorted by address
+ */
+static struct vmalloc_area areas[VMALLOC_MAX_AREAS];
+static uint32_t area_count = 0;
+static uint64_t mapped_pages = 0;
+static spinlock_t vmalloc_lock = SPINLOCK_INIT;
+
+static inline uint64_t area_end(struct vmalloc_area *area) {
+    return area->start + (area->pages + 1) * PAGE_SIZE;
+}
+
+/*
+ * Find the index of the area whose mapped pages start at addr
+ */
+static int area_find(uint64_t addr) {
+    for (uint32_t i = 0; i < area_count; i++) {
+        if (areas[i].start + PAGE_SIZE == addr) return i;
+    }
+    return -1;
+}
+
+/*
+ * Drop an area from the table (vmalloc_lock held)
+ */
+static void area_remove(int index) {
+    area_count--;
+    memmove(&areas[index], &areas[index + 1], (area_count - index) * sizeof(areas[0]));
+}
+
+/*
+ * Claim address space for pages plus a guard page
+ * Returns the guard page address, or 0 if the area is full
+ */
+static uint64_t area_alloc(uint64_t pages) {
+    uint64_t size = (pages + 1) * PAGE_SIZE;
+
+    uint64_t flags;
+    spinlock_acquire_irqsave(&vmalloc_lock, &flags);
+
+    if (area_count == VMALLOC_MAX_AREAS) {
+        spinlock_release_irqrestore(&vmalloc_lock, flags);
+        return 0;
+    }
+
+    /* First fit: the gap before each area, then the tail */
+    uint64_t start = VMALLOC_VBASE;
+    uint32_t i = 0;
+    while (i < area_count && areas[i].start - start < size) {
+        start = area_end(&areas[i]);
+        i++;
+    }
+
+    if (i == area_count && VMALLOC_VBASE + VMALLOC_VSIZE - start < size) {
+        spinlock_release_irqrestore(&vmalloc_lock, flags);
+        return 0;
+    }
+
+    memmove(&areas[i + 1], &areas[i], (area_count - i) * sizeof(areas[0]));
+    areas[i].start = start;
+    areas[i].pages = pages;
+    areas[i].file = false;
+    areas[i].dying = false;
+    area_count++;
+
+    spinlock_release_irqrestore(&vmalloc_lock, flags);
+    return start;
+}
+
+/*
+ * Unmap and free the pages of [virt, virt + pages)
+ * Frames are gathered a batch at a time and freed after the unmap has
+ * flushed their translations. The flush may wait for other CPUs, so
+ * this runs without vmalloc_lock. Returns false if some pages are
+ * still mapped; their frames are leaked rather than freed.
+ */
+static bool unmap_free(uint64_t virt, uint64_t pages) {
+    uint64_t frames[VMALLOC_BATCH];
+    bool ok = true;
+
+    for (uint64_t done = 0; done < pages; done += VMALLOC_BATCH) {
+        uint64_t n = pages - done;
+        if (n > VMALLOC_BATCH) n = VMALLOC_BATCH;
+
+        uint64_t base = virt + done * PAGE_SIZE;
+        uint32_t found = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            uint64_t phys = vmm_virt_to_phys(NULL, base + i * PAGE_SIZE);
+            if (phys) frames[found++] = phys;
+        }
+
+        if (!vmm_unmap_range(NULL, base, n * PAGE_SIZE)) {
+            ok = false;
+            continue;
+        }
+        for (uint32_t i = 0; i < found; i++) {
+            pmm_free_page((void *)frames[i]);
+        }
+    }
+    return ok;
+}
+
+/*
+ * Allocate
+ */
+void *vmalloc(size_t size, uint16_t owner) {
+    if (size == 0) return NULL;
+
+    uint64_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t guard = area_alloc(pages);
+    if (!guard) return NULL;
+
+    uint64_t virt = guard + PAGE_SIZE;
+    uint64_t frames[VMALLOC_BATCH];
+    uint64_t mapped = 0;
+
+    while (mapped < pages) {
+        uint64_t n = 0;
+        while (n < VMALLOC_BATCH && mapped + n < pages) {
+            void *frame = pmm_alloc_page();
+            if (!frame) break;
+            page_set_owner((uint64_t)frame, 1, owner);
+            frames[n++] = (uint64_t)frame;
+        }
+
+        if (n == 0 || !vmm_map_pages(NULL, virt + mapped * PAGE_SIZE, frames, n,
+                                     PTE_WRITABLE | PTE_NX)) {
+            while (n > 0) {
+                pmm_free_page((void *)frames[--n]);
+            }
+            break;
+        }
+        mapped += n;
+    }
+
+    uint64_t flags;
+    if (mapped < pages) {
+        /* Nobody else knows the area yet, so it is unmapped unlocked */
+        bool unmapped = unmap_free(virt, mapped);
+
+        spinlock_acquire_irqsave(&vmalloc_lock, &flags);
+        int index = area_find(virt);
+        if (unmapped) {
+            area_remove(index);
+        } else {
+            areas[index].dying = true;
+        }
+        spinlock_release_irqrestore(&vmalloc_lock, flags);
+        return NULL;
+    }
+
+    spinlock_acquire_irqsave(&vmalloc_lock, &flags);
+    mapped_pages += pages;
+    spinlock_release_irqrestore(&vmalloc_lock, flags);
+    return (void *)virt;
+}
+
+/*
+ * Map a file
+ */
+void *vmap_file(struct vfs_node *node, uint64_t offset, size_t size) {
+    if (!node || offset % PAGE_SIZE != 0 || offset >= node->size || size == 0) return NULL;
+    if (size > node->size - offset) size = node->size - offset;
+
+    uint64_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t guard = area_alloc(pages);
+    if (!guard) return NULL;
+
+    uint64_t virt = guard + PAGE_SIZE;
+    bool ok = vma_map_file(NULL, virt, pages * PAGE_SIZE, PTE_NX, node, offset);
+
+    uint64_t flags;
+    spinlock_acquire_irqsave(&vmalloc_lock, &flags);
+    int index = area_find(virt);
+    if (ok) {
+        areas[index].file = true;
+    } else {
+        area_remove(index);
+    }
+    spinlock_release_irqrestore(&vmalloc_lock, flags);
+
+    return ok ? (void *)virt : NULL;
+}
+
+/*
+ * Free
+ * The area is marked dying under the lock and unmapped without it,
+ * since the TLB flush may wait for other CPUs. It keeps its range
+ * until then, so the range cannot be handed out while still mapped;
+ * if the unmap fails it is never handed out again.
+ */
+void vfree(void *ptr) {
+    if (!ptr) return;
+
+    uint64_t flags;
+    spinlock_acquire_irqsave(&vmalloc_lock, &flags);
+
+    int index = area_find((uint64_t)ptr);
+    if (index < 0 || areas[index].dying) {
+        spinlock_release_irqrestore(&vmalloc_lock, flags);
+        return;
+    }
+
+    bool file = areas[index].file;
+    uint64_t pages = areas[index].pages;
+    areas[index].dying = true;
+    if (!file) mapped_pages -= pages;
+    spinlock_release_irqrestore(&vmalloc_lock, flags);
+
+    bool ok = file ? vma_release(NULL, (uint64_t)ptr) : unmap_free((uint64_t)ptr, pages);
+    if (!ok) return;
+
+    /* Other areas may have come and gone meanwhile */
+    spinlock_acquire_irqsave(&vmalloc_lock, &flags);
+    area_remove(area_find((uint64_t)ptr));
+    spinlock_release_irqrestore(&vmalloc_lock, flags);
+}
+
+/*
+ * Guard page check
+ */
+bool vmalloc_is_guard(uint64_t addr) {
+    if (addr < VMALLOC_VBASE || addr >= VMALLOC_VBASE + VMALLOC_VSIZE) return false;
+
+    /* No lock: the fault path may have interrupted its holder */
+    uint64_t page = PAGE_ALIGN_DOWN(addr);
+    for (uint32_t i = 0; i < area_count; i++) {
+        if (areas[i].start == page) return true;
+        if (areas[i].start > page) return false;
+    }
+    return false;
+}
+
+/*
+ * Statistics
+ */
+void vmalloc_get_stats(struct vmalloc_stats *stats) {
+    uint64_t flags;
+    spinlock_acquire_irqsave(&vmalloc_lock, &flags);
+    stats->areas = area_count;
+    stats->pages = mapped_pages;
+    spinlock_release_irqrestore(&vmalloc_lock, flags);
+}
@@ -0,0 +1,57 @@
+/*
+ * AstraOS - Kernel Virtual Allocator Header
+ * Virtually contiguous allocations backed by scattered frames
+ */
+
+#ifndef _ASTRA_MM_VMALLOC_H
+#define _ASTRA_MM_VMALLOC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "../fs/vfs.h"
+
+/*
+ * Area limit
+ */
+#define VMALLOC_MAX_AREAS   256
+
+/*
+ * Allocate size bytes (rounded up to pages) in the vmalloc area
+ * Frames need not be contiguous and are tagged with owner. Every
+ * allocation is preceded by an unmapped guard page, so running off
+ * either end faults.
+ * Returns NULL on failure
+ */
+void *vmalloc(size_t size, uint16_t owner);
+
+/*
+ * Map size bytes of a file from offset (page aligned) on, read-only
+ * Pages come from the page cache on first touch, so nothing is copied
+ * and every mapping of the file shares them. size is clipped to the
+ * end of the file. Free with vfree().
+ * Returns NULL on failure
+ */
+void *vmap_file(struct vfs_node *node, uint64_t offset, size_t size);
+
+/*
+ * Free a vmalloc allocation or file mapping
+ */
+void vfree(void *ptr);
+
+/*
+ * Check whether an address lies in a guard page
+ */
+bool vmalloc_is_guard(uint64_t addr);
+
+/*
+ * vmalloc statistics
+ */
+struct vmalloc_stats {
+    uint64_t areas;         /* Live allocations */
+    uint64_t pages;         /* Pages mapped, file mappings aside */
+};
+
+void vmalloc_get_stats(struct vmalloc_stats *stats);
+
+#endif /* _ASTRA_MM_VMALLOC_H */
@@ -5,9 +5,14 @@
 
 #include "vmm.h"
 #include "pmm.h"
+#include "page.h"
+#include "vma.h"
 #include "../lib/string.h"
 #include "../arch/x86_64/cpu.h"
+#include "../arch/x86_64/percpu.h"
+#include "../arch/x86_64/apic.h"
 #include "../sync/spinlock.h"
+#include "../panic.h"
 
 /*
  * HHDM offset for physical to virtual conversion
@@ -15,14 +20,24 @@
 static uint64_t hhdm_offset = 0;
 
 /*
- * Kernel PML4 (set by bootloader, we use it directly)
+ * Kernel PML4 (a private copy of the bootloader's tables)
  */
 static pagetable_t kernel_pml4 = NULL;
 
 /*
- * VMM lock
+ * Locks
+ * The lower half of each address space is guarded by a lock kept in
+ * the struct page of its PML4 frame, so different address spaces never
+ * contend. The kernel half is shared by all of them; its PML4 entries
+ * are populated at boot and never change, so it is split into 1 GB
+ * stripes that lock independently. Lookups take no lock: an entry is
+ * only published (release store) once what it points to is filled in.
  */
-static spinlock_t vmm_lock = SPINLOCK_INIT;
+#define KERNEL_LOCK_STRIPES 64
+
+static spinlock_t kernel_locks[KERNEL_LOCK_STRIPES];
+static spinlock_t kernel_lower_lock = SPINLOCK_INIT;    /* Lower half of kernel_pml4 */
+static spinlock_t pcid_lock = SPINLOCK_INIT;
 
 /*
  * Page table index extraction macros
@@ -32,6 +47,71 @@ static spinlock_t vmm_lock = SPINLOCK_INIT;
 #define PD_INDEX(addr)      (((addr) >> 21) & 0x1FF)
 #define PT_INDEX(addr)      (((addr) >> 12) & 0x1FF)
 
+/*
+ * Table levels: 4 = PML4, 3 = PDPT, 2 = PD, 1 = page table
+ * A leaf at level N maps level_size(N) bytes.
+ */
+static inline size_t level_index(uint64_t virt, int level) {
+    return (virt >> (12 + 9 * (level - 1))) & 0x1FF;
+}
+
+static inline uint64_t level_size(int level) {
+    return 1ULL << (12 + 9 * (level - 1));
+}
+
+/*
+ * Control register bits
+ */
+#define CR0_WP              (1ULL << 16)    /* Read-only pages apply to ring 0 */
+#define CR4_PGE             (1ULL << 7)     /* Global pages */
+#define CR4_PCIDE           (1ULL << 17)    /* Process-context identifiers */
+#define CR3_NOFLUSH         (1ULL << 63)    /* Keep the PCID's TLB entries */
+
+/*
+ * Page attribute table
+ * Entries 0-3 keep their power-on types, so PCD/PWT alone mean what
+ * they always did; entries 4 and 5 add write-protect and
+ * write-combining (the same layout Limine uses). See PTE_CACHE_*.
+ */
+#define MSR_PAT             0x277
+#define PAT_LAYOUT          0x0007010500070406ULL   /* UC UC- WC WP | UC UC- WT WB */
+
+/*
+ * CPU features
+ */
+static bool gbpages = false;            /* 1 GB pages */
+static bool pcid_enabled = false;       /* CR4.PCIDE set */
+static bool invpcid_supported = false;
+
+/*
+ * Process-context identifiers
+ * Every address space gets its own PCID, so loading CR3 keeps the TLB
+ * entries of the others. The kernel PML4 runs with PCID 0, and the PCID
+ * of any other address space is kept in the struct page of its PML4
+ * frame. A freed PCID may still tag entries of its previous owner, so
+ * it is marked stale and flushed when it is next loaded (INVPCID drops
+ * them straight away instead). When all are taken, address spaces
+ * share PCID_SHARED, which is flushed on every load. Staleness is kept
+ * per CPU, since each CPU has its own TLB.
+ */
+#define PCID_COUNT          4096
+#define PCID_SHARED         (PCID_COUNT - 1)
+
+#define INVPCID_ADDRESS     0
+#define INVPCID_CONTEXT     1
+#define INVPCID_ALL         2
+
+static uint64_t pcid_used[PCID_COUNT / 64] = { 1 };    /* PCID 0 is the kernel's */
+static uint64_t pcid_stale[MAX_CPUS][PCID_COUNT / 64];
+
+/*
+ * CPUs running the kernel PML4; other address spaces keep theirs in
+ * the struct page of their PML4 frame
+ */
+static uint32_t kernel_cpus = 0;
+
+_Static_assert(MAX_CPUS <= 32, "CPU masks are 32 bits wide");
+
 /*
  * Physical to virtual address conversion
  */
@@ -46,45 +126,435 @@ static inline uint64_t virt_to_phys(void *virt) {
     return (uint64_t)virt - hhdm_offset;
 }
 
+/*
+ * Flush the whole TLB, global entries and all PCIDs included
+ */
+static void flush_tlb_all(void) {
+    if (invpcid_supported) {
+        cpu_invpcid(INVPCID_ALL, 0, 0);
+        return;
+    }
+
+    uint64_t cr4 = cpu_read_cr4();
+    if (cr4 & CR4_PGE) {
+        cpu_write_cr4(cr4 & ~CR4_PGE);
+        cpu_write_cr4(cr4);
+    } else {
+        cpu_write_cr3(cpu_read_cr3());
+    }
+}
+
+/*
+ * Get PCID of an address space
+ */
+static uint16_t pcid_of(pagetable_t pml4) {
+    if (!pcid_enabled || pml4 == kernel_pml4) return 0;
+
+    struct page *page = page_of(virt_to_phys(pml4));
+    return page ? (uint16_t)page->private : PCID_SHARED;
+}
+
+/*
+ * Mask of CPUs that have an address space loaded
+ */
+static uint32_t *space_cpus(pagetable_t pml4) {
+    struct page *page = pml4 != kernel_pml4 ? page_of(virt_to_phys(pml4)) : NULL;
+    return page ? &page->cpus : &kernel_cpus;
+}
+
+/*
+ * Make a CPU flush a PCID when it next loads it
+ */
+static inline void pcid_mark_stale(uint32_t cpu, uint16_t pcid) {
+    __atomic_fetch_or(&pcid_stale[cpu][pcid / 64], 1ULL << (pcid % 64), __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Check whether an address space is loaded on this CPU
+ */
+static inline bool is_current(pagetable_t pml4) {
+    return (cpu_read_cr3() & PTE_ADDR_MASK) == virt_to_phys(pml4);
+}
+
+/*
+ * Check whether an address space is loaded on any CPU
+ */
+static bool space_loaded(pagetable_t pml4) {
+    struct page *page = pml4 != kernel_pml4 ? page_of(virt_to_phys(pml4)) : NULL;
+    if (!page) return is_current(pml4);
+    return __atomic_load_n(&page->cpus, __ATOMIC_SEQ_CST) != 0;
+}
+
+/*
+ * Read and publish page table entries
+ */
+static inline uint64_t pte_read(uint64_t *entry) {
+    return __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+}
+
+static inline void pte_write(uint64_t *entry, uint64_t value) {
+    __atomic_store_n(entry, value, __ATOMIC_RELEASE);
+}
+
+/*
+ * Lock guarding the tables that translate virt
+ */
+static spinlock_t *space_lock(pagetable_t pml4, uint64_t virt) {
+    if (virt >= KERNEL_HALF_BASE) {
+        return &kernel_locks[(virt >> 30) % KERNEL_LOCK_STRIPES];
+    }
+
+    struct page *page = pml4 != kernel_pml4 ? page_of(virt_to_phys(pml4)) : NULL;
+    return page ? &page->ptl : &kernel_lower_lock;
+}
+
+/*
+ * Holds the lock for the part of a range being worked on
+ * Range operations call guard_enter() for every step; crossing into
+ * another kernel stripe drops the old lock before taking the new one.
+ */
+struct vmm_guard {
+    spinlock_t *lock;
+    uint64_t irqflags;
+};
+
+static void guard_exit(struct vmm_guard *guard) {
+    if (guard->lock) {
+        spinlock_release_irqrestore(guard->lock, guard->irqflags);
+        guard->lock = NULL;
+    }
+}
+
+static void guard_enter(struct vmm_guard *guard, pagetable_t pml4, uint64_t virt) {
+    spinlock_t *lock = space_lock(pml4, virt);
+    if (lock == guard->lock) return;
+
+    guard_exit(guard);
+    spinlock_acquire_irqsave(lock, &guard->irqflags);
+    guard->lock = lock;
+}
+
+/*
+ * Allocate a PCID (pcid_lock held)
+ */
+static uint16_t pcid_alloc(void) {
+    for (uint32_t w = 0; w < PCID_COUNT / 64; w++) {
+        uint64_t free_bits = ~pcid_used[w];
+        if (w == PCID_SHARED / 64) free_bits &= ~(1ULL << (PCID_SHARED % 64));
+        if (free_bits) {
+            uint32_t bit = __builtin_ctzll(free_bits);
+            pcid_used[w] |= 1ULL << bit;
+            return w * 64 + bit;
+        }
+    }
+    return PCID_SHARED;
+}
+
+/*
+ * Release a PCID whose entries may still be cached (pcid_lock held)
+ */
+static void pcid_free(uint16_t pcid) {
+    if (pcid == 0 || pcid == PCID_SHARED) return;
+
+    /* INVPCID only reaches this CPU's TLB */
+    uint32_t self = cpu_current_id();
+    for (uint32_t cpu = 0; cpu < percpu_cpu_count(); cpu++) {
+        if (cpu != self || !invpcid_supported) pcid_mark_stale(cpu, pcid);
+    }
+    if (invpcid_supported) {
+        cpu_invpcid(INVPCID_CONTEXT, pcid, 0);
+    }
+    pcid_used[pcid / 64] &= ~(1ULL << (pcid % 64));
+}
+
+/*
+ * Page-table page cache
+ * Freed tables are kept on a list (linked through their first entry)
+ * up to PT_CACHE_MAX and handed out again before going to the PMM, so
+ * building and tearing down address spaces mostly skips the buddy
+ * allocator. Cached frames keep their PAGE_OWNER_PAGETABLE tag.
+ */
+#define PT_CACHE_MAX        256
+
+static uint64_t *pt_cache = NULL;
+static uint32_t pt_cache_count = 0;
+static spinlock_t pt_cache_lock = SPINLOCK_INIT;
+
+/*
+ * Tables waiting to be released, linked like the cache
+ */
+struct pt_list {
+    uint64_t *head;
+    uint32_t count;
+};
+
+/*
+ * Teardown statistics
+ */
+static uint64_t pt_reused = 0;
+static uint64_t teardowns = 0;
+static uint64_t teardown_cycles = 0;
+static uint64_t teardown_max = 0;
+
+/*
+ * Allocate a page-table page (physical address), zeroed if asked
+ */
+static void *pt_alloc(bool zero) {
+    uint64_t irqflags;
+    spinlock_acquire_irqsave(&pt_cache_lock, &irqflags);
+    uint64_t *table = pt_cache;
+    if (table) {
+        pt_cache = (uint64_t *)table[0];
+        pt_cache_count--;
+        pt_reused++;
+    }
+    spinlock_release_irqrestore(&pt_cache_lock, irqflags);
+
+    if (!table) {
+        void *phys = pmm_alloc_pages_flags(1, zero ? PMM_ZERO : 0);
+        if (phys) page_set_owner((uint64_t)phys, 1, PAGE_OWNER_PAGETABLE);
+        return phys;
+    }
+
+    if (zero) {
+        memset(table, 0, PAGE_SIZE);
+    } else {
+        table[0] = 0;
+    }
+    return (void *)virt_to_phys(table);
+}
+
+/*
+ * Release a list of tables: refill the cache in one go, the rest go
+ * back to the PMM
+ */
+static void pt_list_free(struct pt_list *list) {
+    uint64_t irqflags;
+    spinlock_acquire_irqsave(&pt_cache_lock, &irqflags);
+    while (list->head && pt_cache_count < PT_CACHE_MAX) {
+        uint64_t *table = list->head;
+        list->head = (uint64_t *)table[0];
+        table[0] = (uint64_t)pt_cache;
+        pt_cache = table;
+        pt_cache_count++;
+    }
+    spinlock_release_irqrestore(&pt_cache_lock, irqflags);
+
+    while (list->head) {
+        uint64_t *table = list->head;
+        list->head = (uint64_t *)table[0];
+        pmm_free_page((void *)virt_to_phys(table));
+    }
+    list->count = 0;
+}
+
+/*
+ * Convert 4 KB entry flags to huge entry flags (the PAT bit moves)
+ */
+static inline uint64_t huge_flags(uint64_t flags) {
+    if (!(flags & PTE_PAT)) return flags;
+    return (flags & ~PTE_PAT) | PTE_HUGE_PAT;
+}
+
+/*
+ * Tables set aside before an unmap for the huge pages it must split,
+ * so that it cannot run out of memory halfway
+ */
+#define SPLIT_RESERVE_MAX   4   /* A 1 GB and a 2 MB page at each end */
+
+struct split_reserve {
+    void *tables[SPLIT_RESERVE_MAX];
+    uint32_t count;
+};
+
+/*
+ * Replace a huge leaf at the given level with a table of the next
+ * smaller pages covering the same memory with the same attributes
+ * The table comes from reserve if it has one (reserve may be NULL).
+ */
+static bool split_huge(uint64_t *entry, int level, struct split_reserve *reserve) {
+    void *phys = (reserve && reserve->count) ? reserve->tables[--reserve->count] : pt_alloc(false);
+    if (!phys) return false;
+
+    uint64_t old = pte_read(entry);
+    uint64_t base = old & PTE_ADDR_MASK & ~(level_size(level) - 1);
+    uint64_t child_flags = old & ~PTE_ADDR_MASK;
+    if (level == 2) {
+        /* 4 KB entries keep the PAT bit where PTE_HUGE was */
+        child_flags &= ~PTE_HUGE;
+        if (old & PTE_HUGE_PAT) child_flags |= PTE_PAT;
+    } else {
+        child_flags |= old & PTE_HUGE_PAT;
+    }
+
+    uint64_t *table = phys_to_virt((uint64_t)phys);
+    uint64_t child_size = level_size(level - 1);
+    for (int i = 0; i < PT_ENTRIES; i++) {
+        table[i] = (base + i * child_size) | child_flags;
+    }
+
+    pte_write(entry, (uint64_t)phys | PTE_PRESENT | PTE_WRITABLE | PTE_USER);
+    return true;
+}
+
 /*
  * Get or create next level page table
+ * A huge page in the way is split into the next smaller size.
  */
-static uint64_t *get_or_create_table(uint64_t *table, size_t index, uint64_t flags) {
+static uint64_t *get_or_create_table(uint64_t *table, size_t index, int level, uint64_t flags) {
     if (!(table[index] & PTE_PRESENT)) {
-        /* Allocate new page table */
-        void *new_table = pmm_alloc_page();
+        /* Allocate new (zeroed) page table */
+        void *new_table = pt_alloc(true);
         if (!new_table) return NULL;
 
-        /* Clear the new table */
-        memset(phys_to_virt((uint64_t)new_table), 0, PAGE_SIZE);
-
-        /* Set entry with requested flags */
-        table[index] = (uint64_t)new_table | flags | PTE_PRESENT;
+        /* Publish the table only once it is zeroed */
+        pte_write(&table[index], (uint64_t)new_table | flags | PTE_PRESENT);
+    } else if (table[index] & PTE_HUGE) {
+        if (!split_huge(&table[index], level, NULL)) return NULL;
     }
 
     /* Return virtual address of next table */
-    return phys_to_virt(table[index] & ~0xFFFULL);
+    return phys_to_virt(table[index] & PTE_ADDR_MASK);
 }
 
 /*
- * Get next level table (read-only, returns NULL if not present)
+ * Walk down to the entry for virt at the given level, creating
+ * tables and splitting huge pages on the way
  */
-static uint64_t *get_table(uint64_t *table, size_t index) {
-    if (!(table[index] & PTE_PRESENT)) {
-        return NULL;
+static uint64_t *walk_create(pagetable_t pml4, uint64_t virt, int level) {
+    uint64_t *table = pml4;
+    for (int l = 4; l > level; l--) {
+        table = get_or_create_table(table, level_index(virt, l), l, PTE_WRITABLE | PTE_USER);
+        if (!table) return NULL;
+    }
+    return &table[level_index(virt, level)];
+}
+
+/*
+ * Find the entry that translates virt
+ * Returns either a present leaf or the first non-present entry on the
+ * way down; *level receives the level it was found at. Safe without
+ * the lock.
+ */
+static uint64_t *lookup(pagetable_t pml4, uint64_t virt, int *level) {
+    uint64_t *table = pml4;
+    for (int l = 4; ; l--) {
+        uint64_t *entry = &table[level_index(virt, l)];
+        uint64_t value = pte_read(entry);
+        if (l == 1 || !(value & PTE_PRESENT) || (value & PTE_HUGE)) {
+            *level = l;
+            return entry;
+        }
+        table = phys_to_virt(value & PTE_ADDR_MASK);
     }
-    return phys_to_virt(table[index] & ~0xFFFULL);
+}
+
+/*
+ * Collect a page table and every table below it on a release list
+ * Mapped frames are left alone unless the mapping holds a reference.
+ */
+static void free_tables(uint64_t *table, int level, struct pt_list *list) {
+    for (int i = 0; i < PT_ENTRIES; i++) {
+        if (!(table[i] & PTE_PRESENT)) continue;
+
+        if (level > 1 && !(table[i] & PTE_HUGE)) {
+            free_tables(phys_to_virt(table[i] & PTE_ADDR_MASK), level - 1, list);
+        } else if (level == 1 && (table[i] & PTE_OWNED)) {
+            page_put(page_of(table[i] & PTE_ADDR_MASK));
+        }
+    }
+
+    table[0] = (uint64_t)list->head;
+    list->head = table;
+    list->count++;
+}
+
+/*
+ * Copy a page table and every table below it
+ * Leaf entries (4 KB pages and huge pages) are copied as-is, except
+ * that leaves in the kernel half (kernel image, HHDM) become global.
+ * Level 4 is a PML4, level 1 a page table.
+ */
+static uint64_t *clone_table(uint64_t *src, int level, bool global) {
+    void *phys = pt_alloc(false);
+    if (!phys) return NULL;
+
+    uint64_t *dst = phys_to_virt((uint64_t)phys);
+    for (int i = 0; i < PT_ENTRIES; i++) {
+        uint64_t entry = src[i];
+        bool kernel = global || (level == 4 && i >= PT_ENTRIES / 2);
+        if (level > 1 && (entry & PTE_PRESENT) && !(entry & PTE_HUGE)) {
+            uint64_t *child = clone_table(phys_to_virt(entry & PTE_ADDR_MASK), level - 1, kernel);
+            if (!child) return NULL;
+            entry = virt_to_phys(child) | (entry & ~PTE_ADDR_MASK);
+        } else if (kernel && (entry & PTE_PRESENT)) {
+            entry |= PTE_GLOBAL;
+        }
+        dst[i] = entry;
+    }
+
+    return dst;
 }
 
 /*
  * Initialize VMM
+ * The bootloader's page tables live in bootloader-reclaimable memory,
+ * so the kernel switches to its own copy before that memory is freed.
  */
 void vmm_init(uint64_t hhdm) {
     hhdm_offset = hhdm;
 
-    /* Get current PML4 from CR3 */
+    uint32_t eax, ebx, ecx, edx;
+    cpu_cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000001) {
+        cpu_cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
+        gbpages = (edx >> 26) & 1;
+    }
+
+    cpu_cpuid(1, &eax, &ebx, &ecx, &edx);
+    bool pcid_supported = (ecx >> 17) & 1;
+    cpu_cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 7) {
+        cpu_cpuid(7, &eax, &ebx, &ecx, &edx);
+        invpcid_supported = pcid_supported && ((ebx >> 10) & 1);
+    }
+
     uint64_t cr3 = cpu_read_cr3();
-    kernel_pml4 = phys_to_virt(cr3 & ~0xFFFULL);
+    pagetable_t boot_pml4 = phys_to_virt(cr3 & ~0xFFFULL);
+
+    kernel_pml4 = clone_table(boot_pml4, 4, false);
+    if (!kernel_pml4) {
+        panic("VMM: Out of memory copying boot page tables");
+    }
+
+    /*
+     * Give every kernel-half PML4 entry a table now, so address spaces
+     * created later see all kernel mappings and the entries never change
+     */
+    for (int i = PT_ENTRIES / 2; i < PT_ENTRIES; i++) {
+        if (!get_or_create_table(kernel_pml4, i, 4, PTE_WRITABLE | PTE_USER)) {
+            panic("VMM: Out of memory for kernel page tables");
+        }
+    }
+    cpu_write_cr3(virt_to_phys(kernel_pml4));
+    kernel_cpus = 1u << cpu_current_id();
+
+    /*
+     * Program the PAT (every x86_64 CPU has one). Lines and translations
+     * cached under the bootloader's layout must not outlive it.
+     */
+    cpu_wrmsr(MSR_PAT, PAT_LAYOUT);
+    cpu_wbinvd();
+    flush_tlb_all();
+
+    /* Kernel writes to copy-on-write pages must fault too */
+    cpu_write_cr0(cpu_read_cr0() | CR0_WP);
+
+    /* Global pages, then PCIDs (CR3 must carry PCID 0 at this point) */
+    uint64_t cr4 = cpu_read_cr4() | CR4_PGE;
+    if (pcid_supported) cr4 |= CR4_PCIDE;
+    cpu_write_cr4(cr4);
+    pcid_enabled = pcid_supported;
 }
 
 /*
@@ -94,24 +564,44 @@ pagetable_t vmm_get_kernel_pml4(void) {
     return kernel_pml4;
 }
 
+/*
+ * Get the address space loaded on this CPU
+ */
+pagetable_t vmm_get_current_pml4(void) {
+    return phys_to_virt(cpu_read_cr3() & PTE_ADDR_MASK);
+}
+
 /*
  * Create new address space
  */
 pagetable_t vmm_create_address_space(void) {
-    /* Allocate new PML4 */
-    void *pml4_phys = pmm_alloc_page();
+    /* Allocate new (zeroed) PML4 */
+    void *pml4_phys = pt_alloc(true);
     if (!pml4_phys) return NULL;
 
     pagetable_t pml4 = phys_to_virt((uint64_t)pml4_phys);
 
-    /* Clear it */
-    memset(pml4, 0, PAGE_SIZE);
-
-    /* Copy kernel mappings (upper half) */
+    /* Copy kernel mappings (upper half, fixed since vmm_init) */
     for (int i = 256; i < 512; i++) {
         pml4[i] = kernel_pml4[i];
     }
 
+    /* A recycled table may not have come through the PMM */
+    struct page *page = page_of((uint64_t)pml4_phys);
+    if (page) {
+        spinlock_init(&page->ptl);
+        page->cpus = 0;
+    }
+
+    if (pcid_enabled) {
+        if (page) {
+            uint64_t irqflags;
+            spinlock_acquire_irqsave(&pcid_lock, &irqflags);
+            page->private = pcid_alloc();
+            spinlock_release_irqrestore(&pcid_lock, irqflags);
+        }
+    }
+
     return pml4;
 }
 
@@ -121,137 +611,1080 @@ pagetable_t vmm_create_address_space(void) {
 void vmm_destroy_address_space(pagetable_t pml4) {
     if (!pml4 || pml4 == kernel_pml4) return;
 
-    /* Only free user-space page tables (lower half) */
+    /* Never free tables a CPU may still walk: the reaper retries */
+    if (space_loaded(pml4)) {
+        vmm_destroy_address_space_deferred(pml4);
+        return;
+    }
+
+    uint64_t start = cpu_rdtsc();
+
+    /* Demand-paged regions own their frames */
+    vma_destroy_space(pml4);
+
+    uint64_t irqflags;
+    spinlock_acquire_irqsave(&pcid_lock, &irqflags);
+    pcid_free(pcid_of(pml4));
+    spinlock_release_irqrestore(&pcid_lock, irqflags);
+
+    /* Only free user-space page tables (lower half), then the PML4 */
+    struct pt_list list = { .head = NULL };
     for (int i = 0; i < 256; i++) {
         if (pml4[i] & PTE_PRESENT) {
-            uint64_t *pdpt = get_table(pml4, i);
-            if (pdpt) {
-                for (int j = 0; j < 512; j++) {
-                    if (pdpt[j] & PTE_PRESENT) {
-                        uint64_t *pd = get_table(pdpt, j);
-                        if (pd) {
-                            for (int k = 0; k < 512; k++) {
-                                if (pd[k] & PTE_PRESENT && !(pd[k] & PTE_HUGE)) {
-                                    uint64_t *pt = get_table(pd, k);
-                                    if (pt) {
-                                        pmm_free_page((void *)(virt_to_phys(pt)));
-                                    }
-                                }
-                            }
-                            pmm_free_page((void *)(virt_to_phys(pd)));
-                        }
-                    }
-                }
-                pmm_free_page((void *)(virt_to_phys(pdpt)));
-            }
+            free_tables(phys_to_virt(pml4[i] & PTE_ADDR_MASK), 3, &list);
         }
     }
+    pml4[0] = (uint64_t)list.head;
+    list.head = pml4;
+    list.count++;
+    pt_list_free(&list);
 
-    /* Free PML4 itself */
-    pmm_free_page((void *)(virt_to_phys(pml4)));
+    uint64_t cycles = cpu_rdtsc() - start;
+    __atomic_add_fetch(&teardowns, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&teardown_cycles, cycles, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&teardown_max, __ATOMIC_RELAXED);
+    while (cycles > max &&
+           !__atomic_compare_exchange_n(&teardown_max, &max, cycles, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
 }
 
 /*
- * Map virtual to physical
+ * Background teardown
+ * Queued address spaces are destroyed one per idle pass, so the task
+ * that gives one up does not pay for walking its tables. The queue is
+ * linked through the struct page of each PML4 frame, so it never
+ * fills up; one still loaded on another CPU goes back to the tail.
  */
-bool vmm_map_page(pagetable_t pml4, uint64_t virt, uint64_t phys, uint64_t flags) {
+static pagetable_t reap_head = NULL;
+static pagetable_t reap_tail = NULL;
+static uint32_t reap_count = 0;
+static spinlock_t reap_lock = SPINLOCK_INIT;
+
+static void reap_push(pagetable_t pml4, struct page *page) {
     uint64_t irqflags;
-    spinlock_acquire_irqsave(&vmm_lock, &irqflags);
+    spinlock_acquire_irqsave(&reap_lock, &irqflags);
+    page->reap_next = NULL;
+    if (reap_tail) {
+        page_of(virt_to_phys(reap_tail))->reap_next = pml4;
+    } else {
+        reap_head = pml4;
+    }
+    reap_tail = pml4;
+    reap_count++;
+    spinlock_release_irqrestore(&reap_lock, irqflags);
+}
 
-    /* Use kernel PML4 if none specified */
-    if (!pml4) pml4 = kernel_pml4;
+void vmm_destroy_address_space_deferred(pagetable_t pml4) {
+    if (!pml4 || pml4 == kernel_pml4) return;
 
-    /* Walk page tables, creating as needed */
-    uint64_t *pdpt = get_or_create_table(pml4, PML4_INDEX(virt), PTE_WRITABLE | PTE_USER);
-    if (!pdpt) {
-        spinlock_release_irqrestore(&vmm_lock, irqflags);
-        return false;
+    struct page *page = page_of(virt_to_phys(pml4));
+    if (page) {
+        reap_push(pml4, page);
+        return;
     }
 
-    uint64_t *pd = get_or_create_table(pdpt, PDPT_INDEX(virt), PTE_WRITABLE | PTE_USER);
-    if (!pd) {
-        spinlock_release_irqrestore(&vmm_lock, irqflags);
-        return false;
-    }
+    /* Nothing to queue it by (before page_init): tear it down off this CPU */
+    if (is_current(pml4)) vmm_switch_address_space(kernel_pml4);
+    vmm_destroy_address_space(pml4);
+}
 
-    uint64_t *pt = get_or_create_table(pd, PD_INDEX(virt), PTE_WRITABLE | PTE_USER);
-    if (!pt) {
-        spinlock_release_irqrestore(&vmm_lock, irqflags);
-        return false;
+bool vmm_reap_idle(void) {
+    uint64_t irqflags;
+    spinlock_acquire_irqsave(&reap_lock, &irqflags);
+    pagetable_t pml4 = reap_head;
+    if (pml4) {
+        reap_head = page_of(virt_to_phys(pml4))->reap_next;
+        if (!reap_head) reap_tail = NULL;
+        reap_count--;
     }
+    spinlock_release_irqrestore(&reap_lock, irqflags);
 
-    /* Set the page table entry */
-    pt[PT_INDEX(virt)] = (phys & ~0xFFFULL) | flags | PTE_PRESENT;
+    if (!pml4) return false;
 
-    /* Invalidate TLB */
-    cpu_invlpg(virt);
+    /* The exiting task may have left it loaded on this CPU */
+    if (is_current(pml4)) vmm_switch_address_space(kernel_pml4);
+
+    /* Another CPU has yet to switch away: try again later */
+    if (space_loaded(pml4)) {
+        reap_push(pml4, page_of(virt_to_phys(pml4)));
+        return false;
+    }
 
-    spinlock_release_irqrestore(&vmm_lock, irqflags);
+    vmm_destroy_address_space(pml4);
     return true;
 }
 
 /*
- * Unmap virtual address
+ * Page table and teardown statistics
  */
-void vmm_unmap_page(pagetable_t pml4, uint64_t virt) {
+void vmm_get_stats(struct vmm_stats *stats) {
     uint64_t irqflags;
-    spinlock_acquire_irqsave(&vmm_lock, &irqflags);
+    spinlock_acquire_irqsave(&pt_cache_lock, &irqflags);
+    stats->pt_cached = pt_cache_count;
+    stats->pt_reused = pt_reused;
+    spinlock_release_irqrestore(&pt_cache_lock, irqflags);
 
-    if (!pml4) pml4 = kernel_pml4;
+    spinlock_acquire_irqsave(&reap_lock, &irqflags);
+    stats->reap_pending = reap_count;
+    spinlock_release_irqrestore(&reap_lock, irqflags);
 
-    uint64_t *pdpt = get_table(pml4, PML4_INDEX(virt));
-    if (!pdpt) {
-        spinlock_release_irqrestore(&vmm_lock, irqflags);
-        return;
+    stats->teardowns = __atomic_load_n(&teardowns, __ATOMIC_RELAXED);
+    stats->teardown_cycles = __atomic_load_n(&teardown_cycles, __ATOMIC_RELAXED);
+    stats->teardown_max = __atomic_load_n(&teardown_max, __ATOMIC_RELAXED);
+}
+
+/*
+ * Deferred TLB invalidation
+ * Mapping changes collect the addresses whose old translation may be
+ * cached and flush them once at the end: one invlpg each for a short
+ * list, a full flush past TLB_BATCH_MAX. Entries that were not present
+ * are never cached, so filling holes needs no flush at all. Frame
+ * references dropped with a mapping, and table subtrees a huge page
+ * replaced, are released after the flush, so no stale translation or
+ * cached walk can reach memory that was reused. The flush may wait
+ * for other CPUs, so it never runs under a page table lock: callers
+ * flush after dropping theirs, and a batch that fills up mid-walk
+ * drops it first (tlb_batch_drain()).
+ */
+#define TLB_BATCH_MAX       32
+#define TLB_BATCH_TABLES    8
+
+struct tlb_batch {
+    uint64_t addrs[TLB_BATCH_MAX];
+    uint32_t count;
+    bool flush_all;
+    bool kernel;            /* Some address is in the kernel half */
+    struct page *release[TLB_BATCH_MAX];
+    uint32_t release_count;
+    uint64_t *tables[TLB_BATCH_TABLES];     /* Detached subtrees */
+    uint8_t table_levels[TLB_BATCH_TABLES];
+    uint32_t table_count;
+};
+
+static void tlb_batch_add(struct tlb_batch *batch, uint64_t virt) {
+    if (virt >= KERNEL_HALF_BASE) batch->kernel = true;
+    if (batch->count < TLB_BATCH_MAX) {
+        batch->addrs[batch->count++] = virt;
+    } else {
+        batch->flush_all = true;
     }
+}
 
-    uint64_t *pd = get_table(pdpt, PDPT_INDEX(virt));
-    if (!pd) {
-        spinlock_release_irqrestore(&vmm_lock, irqflags);
+/*
+ * Flush a batch from this CPU's TLB
+ * Kernel-half entries are global, so invlpg drops them under every
+ * PCID. User entries of an address space that is not loaded can only
+ * be cached under its own PCID.
+ */
+static void flush_local(pagetable_t pml4, const uint64_t *addrs, uint32_t count, bool flush_all) {
+    if (flush_all) {
+        flush_tlb_all();
         return;
     }
 
-    uint64_t *pt = get_table(pd, PD_INDEX(virt));
-    if (!pt) {
-        spinlock_release_irqrestore(&vmm_lock, irqflags);
-        return;
+    bool current = is_current(pml4);
+    uint16_t pcid = pcid_of(pml4);
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t virt = addrs[i];
+        if (current || virt >= KERNEL_HALF_BASE) {
+            cpu_invlpg(virt);
+        } else if (!pcid_enabled || pcid == PCID_SHARED) {
+            continue;   /* Flushed when it is next loaded */
+        } else if (invpcid_supported) {
+            cpu_invpcid(INVPCID_ADDRESS, pcid, virt);
+        } else {
+            pcid_mark_stale(cpu_current_id(), pcid);
+        }
     }
+}
 
-    /* Clear the entry */
-    pt[PT_INDEX(virt)] = 0;
+/*
+ * TLB shootdown
+ * Other CPUs may cache the old translations too. Kernel-half entries
+ * are global, so every other online CPU gets the batch; for user
+ * entries only CPUs with the address space loaded do. The rest are
+ * skipped: without PCIDs their next CR3 load flushes anyway, with
+ * PCIDs the address space's PCID is marked stale for them. A CPU that
+ * loads the address space meanwhile sets its mask bit before checking
+ * for staleness, and the mask is read again after marking, so it is
+ * either marked or sent the batch.
+ *
+ * One request is in flight at a time and carries a whole batch per
+ * IPI. The sender spins until every target has served it; while it
+ * waits for the request slot it serves requests aimed at itself, so
+ * two CPUs shooting at each other cannot deadlock.
+ */
+static struct {
+    pagetable_t pml4;
+    uint64_t addrs[TLB_BATCH_MAX];
+    uint32_t count;
+    bool flush_all;
+    uint32_t pending;       /* CPUs yet to serve it */
+} shootdown;
 
-    /* Invalidate TLB */
-    cpu_invlpg(virt);
+static spinlock_t shootdown_lock = SPINLOCK_INIT;
 
-    spinlock_release_irqrestore(&vmm_lock, irqflags);
-}
+static uint64_t flush_count = 0;
+static uint64_t shootdown_count = 0;
+static uint64_t shootdown_ipis = 0;
+static uint64_t shootdown_skipped = 0;
 
 /*
- * Virtual to physical translation
+ * Serve the request in flight if it targets this CPU (interrupts off)
  */
-uint64_t vmm_virt_to_phys(pagetable_t pml4, uint64_t virt) {
-    if (!pml4) pml4 = kernel_pml4;
+static void shootdown_serve(void) {
+    uint32_t bit = 1u << cpu_current_id();
+    if (!(__atomic_load_n(&shootdown.pending, __ATOMIC_ACQUIRE) & bit)) return;
+
+    flush_local(shootdown.pml4, shootdown.addrs, shootdown.count, shootdown.flush_all);
+    __atomic_fetch_and(&shootdown.pending, ~bit, __ATOMIC_RELEASE);
+}
+
+static void shootdown_send(struct tlb_batch *batch, pagetable_t pml4) {
+    uint64_t irqflags = cpu_save_flags();
+    cpu_cli();
+
+    uint32_t self = cpu_current_id();
+    uint32_t others = (uint32_t)((1ULL << percpu_cpu_count()) - 1) & ~(1u << self);
+    if (!others || !apic_available()) {
+        cpu_restore_flags(irqflags);
+        return;
+    }
+
+    uint32_t targets = others;
+    if (!batch->kernel) {
+        uint32_t *mask = space_cpus(pml4);
+        uint32_t loaded = __atomic_load_n(mask, __ATOMIC_SEQ_CST);
+        uint32_t skipped = others & ~loaded;
 
-    uint64_t *pdpt = get_table(pml4, PML4_INDEX(virt));
-    if (!pdpt) return 0;
+        uint16_t pcid = pcid_of(pml4);
+        if (pcid_enabled && pcid != PCID_SHARED) {
+            for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+                if (skipped & (1u << cpu)) pcid_mark_stale(cpu, pcid);
+            }
+        }
+
+        targets = (loaded | __atomic_load_n(mask, __ATOMIC_SEQ_CST)) & others;
+        for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+            if ((others & ~targets) & (1u << cpu)) {
+                __atomic_add_fetch(&shootdown_skipped, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    if (targets) {
+        while (!spinlock_try_acquire(&shootdown_lock)) {
+            shootdown_serve();
+            cpu_pause();
+        }
 
-    uint64_t *pd = get_table(pdpt, PDPT_INDEX(virt));
-    if (!pd) return 0;
+        shootdown.pml4 = pml4;
+        shootdown.count = batch->count;
+        shootdown.flush_all = batch->flush_all;
+        memcpy(shootdown.addrs, batch->addrs, batch->count * sizeof(uint64_t));
+        __atomic_store_n(&shootdown.pending, targets, __ATOMIC_SEQ_CST);
 
-    uint64_t *pt = get_table(pd, PD_INDEX(virt));
-    if (!pt) return 0;
+        for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+            if (!(targets & (1u << cpu))) continue;
+            apic_send_ipi(percpu_apic_id(cpu), IPI_VECTOR_TLB);
+            __atomic_add_fetch(&shootdown_ipis, 1, __ATOMIC_RELAXED);
+        }
+        while (__atomic_load_n(&shootdown.pending, __ATOMIC_ACQUIRE)) {
+            cpu_pause();
+        }
 
-    if (!(pt[PT_INDEX(virt)] & PTE_PRESENT)) return 0;
+        spinlock_release(&shootdown_lock);
+        __atomic_add_fetch(&shootdown_count, 1, __ATOMIC_RELAXED);
+    }
 
-    return (pt[PT_INDEX(virt)] & ~0xFFFULL) | (virt & 0xFFF);
+    cpu_restore_flags(irqflags);
 }
 
 /*
- * Switch address space
+ * IPI handler
  */
-void vmm_switch_address_space(pagetable_t pml4) {
-    uint64_t phys = virt_to_phys(pml4);
-    cpu_write_cr3(phys);
+void vmm_shootdown_ipi(void) {
+    shootdown_serve();
+}
+
+/*
+ * Shootdown statistics
+ */
+void vmm_get_tlb_stats(struct vmm_tlb_stats *stats) {
+    stats->flushes = __atomic_load_n(&flush_count, __ATOMIC_RELAXED);
+    stats->shootdowns = __atomic_load_n(&shootdown_count, __ATOMIC_RELAXED);
+    stats->ipis = __atomic_load_n(&shootdown_ipis, __ATOMIC_RELAXED);
+    stats->skipped = __atomic_load_n(&shootdown_skipped, __ATOMIC_RELAXED);
+}
+
+/*
+ * Flush a batch here and on the other CPUs that may cache it
+ */
+static void tlb_batch_flush(struct tlb_batch *batch, pagetable_t pml4) {
+    if (batch->flush_all || batch->count > 0) {
+        flush_local(pml4, batch->addrs, batch->count, batch->flush_all);
+        shootdown_send(batch, pml4);
+        __atomic_add_fetch(&flush_count, 1, __ATOMIC_RELAXED);
+    }
+    batch->count = 0;
+    batch->flush_all = false;
+    batch->kernel = false;
+
+    for (uint32_t i = 0; i < batch->release_count; i++) {
+        page_put(batch->release[i]);
+    }
+    batch->release_count = 0;
+
+    if (batch->table_count > 0) {
+        struct pt_list list = { .head = NULL };
+        for (uint32_t i = 0; i < batch->table_count; i++) {
+            free_tables(batch->tables[i], batch->table_levels[i], &list);
+        }
+        pt_list_free(&list);
+        batch->table_count = 0;
+    }
+}
+
+/*
+ * Page table cursor
+ * Remembers the last page table used, so runs of 4 KB pages in the
+ * same 2 MB region skip the walk from the PML4.
+ */
+struct pt_cursor {
+    uint64_t base;          /* Virtual address covered by pt[0] */
+    uint64_t *pt;
+};
+
+/*
+ * Flush a full batch in the middle of a walk
+ * The flush may wait for other CPUs, so the page table lock is dropped
+ * first; the walk takes it again at its next step, and walks from the
+ * PML4 again since the tables may change meanwhile.
+ */
+static void tlb_batch_drain(struct tlb_batch *batch, pagetable_t pml4,
+                            struct vmm_guard *guard, struct pt_cursor *cur) {
+    guard_exit(guard);
+    if (cur) cur->pt = NULL;
+    tlb_batch_flush(batch, pml4);
+}
+
+/*
+ * Drop the frame reference of a PTE_OWNED entry after the next flush
+ * Called with the entry cleared or replaced; may drop the guard.
+ */
+static void tlb_batch_release(struct tlb_batch *batch, pagetable_t pml4, uint64_t entry,
+                              struct vmm_guard *guard, struct pt_cursor *cur) {
+    if (!(entry & PTE_OWNED)) return;
+    if (batch->release_count == TLB_BATCH_MAX) {
+        tlb_batch_drain(batch, pml4, guard, cur);
+    }
+    batch->release[batch->release_count++] = page_of(entry & PTE_ADDR_MASK);
+}
+
+/*
+ * Free a detached table subtree (and the frames it owns) after the
+ * next flush; the whole TLB must go, since any walk may be cached
+ * May drop the guard, like tlb_batch_release().
+ */
+static void tlb_batch_release_tables(struct tlb_batch *batch, pagetable_t pml4,
+                                     uint64_t *table, int level,
+                                     struct vmm_guard *guard, struct pt_cursor *cur) {
+    batch->flush_all = true;
+    if (batch->table_count == TLB_BATCH_TABLES) {
+        tlb_batch_drain(batch, pml4, guard, cur);
+        batch->flush_all = true;
+    }
+    batch->tables[batch->table_count] = table;
+    batch->table_levels[batch->table_count++] = (uint8_t)level;
+}
+
+static uint64_t *cursor_pte(pagetable_t pml4, struct pt_cursor *cur, uint64_t virt) {
+    uint64_t base = virt & ~(PAGE_SIZE_2M - 1);
+    if (cur->pt && cur->base == base) {
+        return &cur->pt[PT_INDEX(virt)];
+    }
+
+    uint64_t *pte = walk_create(pml4, virt, 1);
+    if (!pte) return NULL;
+
+    cur->pt = pte - PT_INDEX(virt);
+    cur->base = base;
+    return pte;
+}
+
+/*
+ * Install a single leaf of level_size(level) bytes
+ * Smaller mappings it replaces are dropped along with their tables.
+ * May return with the guard dropped (see tlb_batch_drain()).
+ */
+static bool map_leaf(pagetable_t pml4, uint64_t virt, uint64_t phys, int level, uint64_t flags,
+                     struct tlb_batch *tlb, struct pt_cursor *cur, struct vmm_guard *guard) {
+    if (virt >= KERNEL_HALF_BASE) flags |= PTE_GLOBAL;
+
+    if (level == 1) {
+        uint64_t *pte = cursor_pte(pml4, cur, virt);
+        if (!pte) return false;
+
+        uint64_t old = pte_read(pte);
+        pte_write(pte, (phys & PTE_ADDR_MASK) | flags | PTE_PRESENT);
+        if (old & PTE_PRESENT) {
+            tlb_batch_add(tlb, virt);
+            tlb_batch_release(tlb, pml4, old, guard, cur);
+        }
+        return true;
+    }
+
+    uint64_t *entry = walk_create(pml4, virt, level);
+    if (!entry) return false;
+
+    uint64_t old = pte_read(entry);
+    pte_write(entry, (phys & PTE_ADDR_MASK) | huge_flags(flags) | PTE_HUGE | PTE_PRESENT);
+
+    if ((old & PTE_PRESENT) && !(old & PTE_HUGE)) {
+        cur->pt = NULL;
+        tlb_batch_release_tables(tlb, pml4, phys_to_virt(old & PTE_ADDR_MASK), level - 1,
+                                 guard, cur);
+    } else if (old & PTE_PRESENT) {
+        tlb_batch_add(tlb, virt);
+    }
+    return true;
+}
+
+/*
+ * Give back the tables a reserve did not use
+ */
+static void split_reserve_drop(struct split_reserve *reserve) {
+    if (reserve->count == 0) return;
+
+    struct pt_list list = { .head = NULL };
+    while (reserve->count) {
+        uint64_t *table = phys_to_virt((uint64_t)reserve->tables[--reserve->count]);
+        table[0] = (uint64_t)list.head;
+        list.head = table;
+    }
+    pt_list_free(&list);
+}
+
+/*
+ * Fill a reserve with the tables needed to split the huge pages that
+ * [virt, end) only partly covers: at each end, the leaf there and the
+ * 2 MB page inside a 1 GB leaf. Returns false if out of memory.
+ */
+static bool split_reserve_fill(struct split_reserve *reserve, pagetable_t pml4,
+                               uint64_t virt, uint64_t end) {
+    uint64_t edges[2] = { virt, end };
+    uint64_t *first = NULL;
+    uint32_t needed = 0;
+
+    for (int i = 0; i < 2; i++) {
+        uint64_t edge = edges[i];
+        int level;
+        uint64_t *entry = lookup(pml4, edge, &level);
+        if (level == 1 || !(pte_read(entry) & PTE_PRESENT)) continue;
+        if (!(edge & (level_size(level) - 1))) continue;
+
+        /* Both ends in one leaf (or one 2 MB part of it): split once */
+        bool shared = entry == first;
+        if (!shared) needed++;
+        if (level == 3 && (edge & (PAGE_SIZE_2M - 1)) &&
+            !(shared && (virt & (PAGE_SIZE_2M - 1)) &&
+              (virt & ~(PAGE_SIZE_2M - 1)) == (end & ~(PAGE_SIZE_2M - 1)))) {
+            needed++;
+        }
+        first = entry;
+    }
+
+    reserve->count = 0;
+    while (reserve->count < needed) {
+        void *phys = pt_alloc(false);
+        if (!phys) {
+            split_reserve_drop(reserve);
+            return false;
+        }
+        reserve->tables[reserve->count++] = phys;
+    }
+    return true;
+}
+
+/*
+ * Clear every mapping in a range
+ * Returns false if a partly covered huge page could not be split; it
+ * stays mapped. With a filled reserve this cannot happen.
+ */
+static bool unmap_range(pagetable_t pml4, uint64_t virt, uint64_t end, struct tlb_batch *tlb,
+                        struct pt_cursor *cur, struct vmm_guard *guard,
+                        struct split_reserve *reserve) {
+    bool ok = true;
+    while (virt < end) {
+        guard_enter(guard, pml4, virt);
+
+        int level = 1;
+        uint64_t *entry;
+        if (cur->pt && cur->base == (virt & ~(PAGE_SIZE_2M - 1))) {
+            entry = &cur->pt[PT_INDEX(virt)];
+        } else {
+            entry = lookup(pml4, virt, &level);
+            if (level == 1) {
+                cur->pt = entry - PT_INDEX(virt);
+                cur->base = virt & ~(PAGE_SIZE_2M - 1);
+            }
+        }
+
+        uint64_t size = level_size(level);
+        uint64_t base = virt & ~(size - 1);
+
+        if (pte_read(entry) & PTE_PRESENT) {
+            /* Partly covered huge page: split and look again */
+            if (level > 1 && (virt != base || end - virt < size) &&
+                split_huge(entry, level, reserve)) {
+                continue;
+            }
+
+            if (level == 1 || (virt == base && end - virt >= size)) {
+                uint64_t old = pte_read(entry);
+                pte_write(entry, 0);
+                tlb_batch_add(tlb, virt);
+                if (level == 1) tlb_batch_release(tlb, pml4, old, guard, cur);
+            } else {
+                ok = false;  /* Could not split: stays mapped */
+            }
+        }
+
+        /* Stop at the top of the address space */
+        if (base + size < virt) break;
+        virt = base + size;
+    }
+    return ok;
+}
+
+/*
+ * Map virtual to physical
+ */
+bool vmm_map_page(pagetable_t pml4, uint64_t virt, uint64_t phys, uint64_t flags) {
+    /* Use kernel PML4 if none specified */
+    if (!pml4) pml4 = kernel_pml4;
+
+    struct vmm_guard guard = { .lock = NULL };
+    guard_enter(&guard, pml4, virt);
+
+    struct tlb_batch tlb = { .count = 0 };
+    struct pt_cursor cur = { .pt = NULL };
+    bool ok = map_leaf(pml4, virt, phys, 1, flags, &tlb, &cur, &guard);
+    guard_exit(&guard);
+    tlb_batch_flush(&tlb, pml4);
+    return ok;
+}
+
+/*
+ * Map a contiguous range with the largest pages that fit
+ */
+bool vmm_map_range(pagetable_t pml4, uint64_t virt, uint64_t phys, size_t size, uint64_t flags) {
+    if (!pml4) pml4 = kernel_pml4;
+
+    struct vmm_guard guard = { .lock = NULL };
+    struct tlb_batch tlb = { .count = 0 };
+    struct pt_cursor cur = { .pt = NULL };
+    bool ok = true;
+
+    uint64_t offset = 0;
+    while (offset < size) {
+        uint64_t va = virt + offset;
+        uint64_t pa = phys + offset;
+        uint64_t remaining = size - offset;
+
+        int level = 1;
+        if (gbpages && remaining >= PAGE_SIZE_1G && ((va | pa) & (PAGE_SIZE_1G - 1)) == 0) {
+            level = 3;
+        } else if (remaining >= PAGE_SIZE_2M && ((va | pa) & (PAGE_SIZE_2M - 1)) == 0) {
+            level = 2;
+        }
+
+        guard_enter(&guard, pml4, va);
+        if (!map_leaf(pml4, va, pa, level, flags, &tlb, &cur, &guard)) {
+            unmap_range(pml4, virt, va, &tlb, &cur, &guard, NULL);
+            ok = false;
+            break;
+        }
+        offset += level_size(level);
+    }
+
+    guard_exit(&guard);
+    tlb_batch_flush(&tlb, pml4);
+    return ok;
+}
+
+/*
+ * Map a run of pages to arbitrary frames
+ */
+bool vmm_map_pages(pagetable_t pml4, uint64_t virt, const uint64_t *phys, size_t count, uint64_t flags) {
+    if (!pml4) pml4 = kernel_pml4;
+
+    struct vmm_guard guard = { .lock = NULL };
+    struct tlb_batch tlb = { .count = 0 };
+    struct pt_cursor cur = { .pt = NULL };
+    bool ok = true;
+
+    for (size_t i = 0; i < count; i++) {
+        guard_enter(&guard, pml4, virt + i * PAGE_SIZE);
+        if (!map_leaf(pml4, virt + i * PAGE_SIZE, phys[i], 1, flags, &tlb, &cur, &guard)) {
+            unmap_range(pml4, virt, virt + i * PAGE_SIZE, &tlb, &cur, &guard, NULL);
+            ok = false;
+            break;
+        }
+    }
+
+    guard_exit(&guard);
+    tlb_batch_flush(&tlb, pml4);
+    return ok;
+}
+
+/*
+ * Unmap a range
+ */
+bool vmm_unmap_range(pagetable_t pml4, uint64_t virt, size_t size) {
+    if (!pml4) pml4 = kernel_pml4;
+
+    uint64_t start = PAGE_ALIGN_DOWN(virt);
+    uint64_t end = PAGE_ALIGN_UP(virt + size);
+    struct split_reserve reserve;
+    if (!split_reserve_fill(&reserve, pml4, start, end)) return false;
+
+    struct vmm_guard guard = { .lock = NULL };
+    struct tlb_batch tlb = { .count = 0 };
+    struct pt_cursor cur = { .pt = NULL };
+    bool ok = unmap_range(pml4, start, end, &tlb, &cur, &guard, &reserve);
+    guard_exit(&guard);
+    tlb_batch_flush(&tlb, pml4);
+
+    split_reserve_drop(&reserve);
+    return ok;
+}
+
+/*
+ * Move a page to a different frame
+ * The page is write-protected while it is copied, so no CPU can write
+ * the old frame behind the copy; writers fault and retry meanwhile.
+ */
+bool vmm_migrate_page(pagetable_t pml4, uint64_t virt, uint64_t phys) {
+    if (!pml4) pml4 = kernel_pml4;
+
+    struct vmm_guard guard = { .lock = NULL };
+    guard_enter(&guard, pml4, virt);
+
+    int level;
+    uint64_t *pte = lookup(pml4, virt, &level);
+    uint64_t old = pte_read(pte);
+    if (level != 1 || !(old & PTE_PRESENT)) {
+        guard_exit(&guard);
+        return false;
+    }
+
+    old = __atomic_fetch_and(pte, ~PTE_WRITABLE, __ATOMIC_ACQ_REL);
+
+    struct tlb_batch tlb = { .count = 0 };
+    tlb_batch_add(&tlb, virt);
+    guard_exit(&guard);
+    tlb_batch_flush(&tlb, pml4);
+
+    memcpy(phys_to_virt(phys), phys_to_virt(old & PTE_ADDR_MASK), PAGE_SIZE);
+
+    /* Whoever unmapped it meanwhile owns the old frame */
+    guard_enter(&guard, pml4, virt);
+    pte = lookup(pml4, virt, &level);
+    uint64_t cur = pte_read(pte);
+    bool ok = false;
+    while (level == 1 && (cur & PTE_PRESENT) &&
+           (cur & PTE_ADDR_MASK) == (old & PTE_ADDR_MASK)) {
+        /* The CPU may still set the accessed bit */
+        uint64_t entry = (phys & PTE_ADDR_MASK) | (cur & ~PTE_ADDR_MASK) | (old & PTE_WRITABLE);
+        if (__atomic_compare_exchange_n(pte, &cur, entry, false, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE)) {
+            ok = true;
+            break;
+        }
+    }
+
+    if (ok) tlb_batch_add(&tlb, virt);
+    guard_exit(&guard);
+    tlb_batch_flush(&tlb, pml4);
+    return ok;
+}
+
+/*
+ * Change the cache type of a range
+ */
+bool vmm_set_cache(pagetable_t pml4, uint64_t virt, size_t size, uint64_t cache) {
+    if (!pml4) pml4 = kernel_pml4;
+
+    uint64_t end = PAGE_ALIGN_UP(virt + size);
+    virt = PAGE_ALIGN_DOWN(virt);
+
+    struct split_reserve reserve;
+    if (!split_reserve_fill(&reserve, pml4, virt, end)) return false;
+
+    struct vmm_guard guard = { .lock = NULL };
+    struct tlb_batch tlb = { .count = 0 };
+    bool ok = true;
+
+    while (virt < end) {
+        guard_enter(&guard, pml4, virt);
+
+        int level;
+        uint64_t *entry = lookup(pml4, virt, &level);
+        uint64_t step = level_size(level);
+        uint64_t base = virt & ~(step - 1);
+        uint64_t old = pte_read(entry);
+
+        if (old & PTE_PRESENT) {
+            /* Partly covered huge page: split and look again */
+            if (level > 1 && (virt != base || end - virt < step)) {
+                if (split_huge(entry, level, &reserve)) continue;
+                ok = false;
+                break;
+            }
+
+            uint64_t mask = PTE_CACHE_MASK;
+            uint64_t bits = cache & PTE_CACHE_MASK;
+            if (level > 1) {
+                mask = huge_flags(mask);
+                bits = huge_flags(bits);
+            }
+            if ((old & mask) != bits) {
+                pte_write(entry, (old & ~mask) | bits);
+                tlb_batch_add(&tlb, virt);
+            }
+        }
+
+        /* Stop at the top of the address space */
+        if (base + step < virt) break;
+        virt = base + step;
+    }
+
+    guard_exit(&guard);
+    bool changed = tlb.count > 0 || tlb.flush_all;
+    tlb_batch_flush(&tlb, pml4);
+
+    split_reserve_drop(&reserve);
+
+    /* Lines cached under the old type must not be written back later */
+    if (changed) cpu_wbinvd();
+    return ok;
+}
+
+/*
+ * Test and clear a hardware-set bit (accessed or dirty) of a 4 KB page
+ */
+static bool test_and_clear(pagetable_t pml4, uint64_t virt, uint64_t bit) {
+    if (!pml4) pml4 = kernel_pml4;
+
+    struct vmm_guard guard = { .lock = NULL };
+    guard_enter(&guard, pml4, virt);
+
+    int level;
+    uint64_t *pte = lookup(pml4, virt, &level);
+    uint64_t old = pte_read(pte);
+    if (level != 1 || (old & (PTE_PRESENT | bit)) != (PTE_PRESENT | bit)) {
+        guard_exit(&guard);
+        return false;
+    }
+
+    /* Atomic: the CPU may set the other bit meanwhile */
+    __atomic_fetch_and(pte, ~bit, __ATOMIC_ACQ_REL);
+
+    struct tlb_batch tlb = { .count = 0 };
+    tlb_batch_add(&tlb, virt);
+    guard_exit(&guard);
+    tlb_batch_flush(&tlb, pml4);
+    return true;
+}
+
+bool vmm_test_and_clear_accessed(pagetable_t pml4, uint64_t virt) {
+    return test_and_clear(pml4, virt, PTE_ACCESSED);
+}
+
+bool vmm_test_and_clear_dirty(pagetable_t pml4, uint64_t virt) {
+    return test_and_clear(pml4, virt, PTE_DIRTY);
+}
+
+/*
+ * Swap out a page
+ */
+uint64_t vmm_swap_out_page(pagetable_t pml4, uint64_t virt, uint64_t entry) {
+    if (!pml4) pml4 = kernel_pml4;
+
+    struct vmm_guard guard = { .lock = NULL };
+    guard_enter(&guard, pml4, virt);
+
+    int level;
+    uint64_t *pte = lookup(pml4, virt, &level);
+    if (level != 1 || !(pte_read(pte) & PTE_PRESENT)) {
+        guard_exit(&guard);
+        return 0;
+    }
+
+    uint64_t old = __atomic_exchange_n(pte, (entry | PTE_SWAP) & ~PTE_PRESENT, __ATOMIC_ACQ_REL);
+
+    struct tlb_batch tlb = { .count = 0 };
+    tlb_batch_add(&tlb, virt);
+    guard_exit(&guard);
+    tlb_batch_flush(&tlb, pml4);
+    return old;
+}
+
+/*
+ * Get a swap entry
+ */
+uint64_t vmm_get_swap_entry(pagetable_t pml4, uint64_t virt) {
+    if (!pml4) pml4 = kernel_pml4;
+
+    int level;
+    uint64_t entry = pte_read(lookup(pml4, virt, &level));
+    if (level != 1 || (entry & (PTE_PRESENT | PTE_SWAP)) != PTE_SWAP) return 0;
+    return entry;
+}
+
+/*
+ * Replace a swap entry
+ */
+bool vmm_set_swap_entry(pagetable_t pml4, uint64_t virt, uint64_t entry) {
+    if (!pml4) pml4 = kernel_pml4;
+
+    struct vmm_guard guard = { .lock = NULL };
+    guard_enter(&guard, pml4, virt);
+
+    /* Never present, so there is nothing to flush */
+    bool ok = vmm_get_swap_entry(pml4, virt) != 0;
+    if (ok) {
+        int level;
+        pte_write(lookup(pml4, virt, &level), entry ? (entry | PTE_SWAP) & ~PTE_PRESENT : 0);
+    }
+
+    guard_exit(&guard);
+    return ok;
+}
+
+/*
+ * Unmap virtual address
+ */
+bool vmm_unmap_page(pagetable_t pml4, uint64_t virt) {
+    return vmm_unmap_range(pml4, PAGE_ALIGN_DOWN(virt), PAGE_SIZE);
+}
+
+/*
+ * Copy the tables below a lower-half entry for a copy-on-write clone
+ * Pages the source mapping holds a reference on (PTE_OWNED) gain one
+ * for the new mapping, which maps them read-only and PTE_COW if they
+ * were writable; cow_protect() does the same to the source once the
+ * copy is complete. Anything else (device memory, frames owned
+ * elsewhere, huge pages) is shared as-is. The source is not changed.
+ */
+static uint64_t *clone_cow(uint64_t *src, int level) {
+    void *phys = pt_alloc(true);
+    if (!phys) return NULL;
+
+    uint64_t *dst = phys_to_virt((uint64_t)phys);
+    for (int i = 0; i < PT_ENTRIES; i++) {
+        uint64_t entry = pte_read(&src[i]);
+        if (!(entry & PTE_PRESENT)) continue;
+
+        if (level > 1 && !(entry & PTE_HUGE)) {
+            uint64_t *child = clone_cow(phys_to_virt(entry & PTE_ADDR_MASK), level - 1);
+            if (!child) {
+                /* Drops the references taken so far */
+                struct pt_list list = { .head = NULL };
+                free_tables(dst, level, &list);
+                pt_list_free(&list);
+                return NULL;
+            }
+            dst[i] = virt_to_phys(child) | (entry & ~PTE_ADDR_MASK);
+            continue;
+        }
+
+        if (level == 1 && (entry & PTE_OWNED)) {
+            page_get(page_of(entry & PTE_ADDR_MASK));
+            if (entry & PTE_WRITABLE) entry = (entry & ~PTE_WRITABLE) | PTE_COW;
+        }
+        dst[i] = entry;
+    }
+
+    return dst;
+}
+
+/*
+ * Turn the writable PTE_OWNED pages below a source entry of a clone
+ * read-only and PTE_COW
+ */
+static void cow_protect(uint64_t *table, int level, uint64_t virt, struct tlb_batch *tlb) {
+    for (int i = 0; i < PT_ENTRIES; i++) {
+        uint64_t va = virt + i * level_size(level);
+        uint64_t entry = pte_read(&table[i]);
+        if (!(entry & PTE_PRESENT)) continue;
+
+        if (level > 1) {
+            if (!(entry & PTE_HUGE)) {
+                cow_protect(phys_to_virt(entry & PTE_ADDR_MASK), level - 1, va, tlb);
+            }
+        } else if ((entry & (PTE_OWNED | PTE_WRITABLE)) == (PTE_OWNED | PTE_WRITABLE)) {
+            pte_write(&table[i], (entry & ~PTE_WRITABLE) | PTE_COW);
+            tlb_batch_add(tlb, va);
+        }
+    }
+}
+
+/*
+ * Clone an address space copy-on-write
+ */
+pagetable_t vmm_clone_address_space(pagetable_t src) {
+    if (!src) src = kernel_pml4;
+
+    pagetable_t dst = vmm_create_address_space();
+    if (!dst) return NULL;
+
+    /* Regions first, so pages the source commits meanwhile are cloned too */
+    if (!vma_clone_space(src, dst)) {
+        vmm_destroy_address_space(dst);
+        return NULL;
+    }
+
+    /* The whole lower half is under the source's lock */
+    struct vmm_guard guard = { .lock = NULL };
+    guard_enter(&guard, src, 0);
+
+    struct tlb_batch tlb = { .count = 0 };
+    bool ok = true;
+    for (int i = 0; i < PT_ENTRIES / 2 && ok; i++) {
+        if (!(src[i] & PTE_PRESENT)) continue;
+
+        uint64_t *child = clone_cow(phys_to_virt(src[i] & PTE_ADDR_MASK), 3);
+        if (child) {
+            dst[i] = virt_to_phys(child) | (src[i] & ~PTE_ADDR_MASK);
+        } else {
+            ok = false;
+        }
+    }
+
+    /* Only a complete copy shares the source's pages */
+    for (int i = 0; i < PT_ENTRIES / 2 && ok; i++) {
+        if (!(src[i] & PTE_PRESENT)) continue;
+        cow_protect(phys_to_virt(src[i] & PTE_ADDR_MASK), 3, i * level_size(4), &tlb);
+    }
+    guard_exit(&guard);
+    tlb_batch_flush(&tlb, src);
+
+    if (!ok) {
+        vmm_destroy_address_space(dst);
+        return NULL;
+    }
+    return dst;
+}
+
+/*
+ * Resolve a write fault on a copy-on-write page
+ * The last mapping of a frame takes it over instead of copying.
+ */
+bool vmm_resolve_cow(pagetable_t pml4, uint64_t virt, bool user) {
+    if (!pml4) pml4 = kernel_pml4;
+
+    struct vmm_guard guard = { .lock = NULL };
+    guard_enter(&guard, pml4, virt);
+
+    int level;
+    uint64_t *pte = lookup(pml4, virt, &level);
+    uint64_t entry = pte_read(pte);
+    if (level != 1 || !(entry & PTE_PRESENT) || !(entry & PTE_COW) ||
+        (user && !(entry & PTE_USER))) {
+        guard_exit(&guard);
+        return false;
+    }
+
+    uint64_t old = entry & PTE_ADDR_MASK;
+    uint64_t flags = (entry & ~(PTE_ADDR_MASK | PTE_COW)) | PTE_WRITABLE;
+    struct page *page = page_of(old);
+    struct tlb_batch tlb = { .count = 0 };
+
+    if (__atomic_load_n(&page->refcount, __ATOMIC_ACQUIRE) == 1) {
+        pte_write(pte, old | flags);
+        tlb_batch_add(&tlb, virt);
+    } else {
+        void *copy = pmm_alloc_page();
+        if (!copy) {
+            guard_exit(&guard);
+            return false;
+        }
+        page_set_owner((uint64_t)copy, 1, page->owner);
+        memcpy(phys_to_virt((uint64_t)copy), phys_to_virt(old), PAGE_SIZE);
+
+        pte_write(pte, (uint64_t)copy | flags);
+        tlb_batch_add(&tlb, virt);
+        tlb_batch_release(&tlb, pml4, entry, &guard, NULL);
+    }
+    guard_exit(&guard);
+    tlb_batch_flush(&tlb, pml4);
+    return true;
+}
+
+/*
+ * Direct-map address
+ */
+void *vmm_phys_to_virt(uint64_t phys) {
+    return phys_to_virt(phys);
+}
+
+uint64_t vmm_direct_to_phys(const void *virt) {
+    return virt_to_phys((void *)virt);
+}
+
+/*
+ * Virtual to physical translation
+ * Lock-free: the entry is read once, so a concurrent change yields
+ * either the old or the new translation.
+ */
+uint64_t vmm_virt_to_phys(pagetable_t pml4, uint64_t virt) {
+    if (!pml4) pml4 = kernel_pml4;
+
+    int level;
+    uint64_t entry = pte_read(lookup(pml4, virt, &level));
+    if (!(entry & PTE_PRESENT)) return 0;
+
+    uint64_t mask = level_size(level) - 1;
+    return (entry & PTE_ADDR_MASK & ~mask) | (virt & mask);
+}
+
+/*
+ * Switch address space
+ * With PCIDs the other address spaces keep their TLB entries, so the
+ * CR3 write only flushes when the PCID may hold stale entries.
+ */
+void vmm_switch_address_space(pagetable_t pml4) {
+    uint64_t phys = virt_to_phys(pml4);
+    uint64_t old = cpu_read_cr3() & PTE_ADDR_MASK;
+    if (old == phys) return;
+
+    /* Join the new mask before checking for staleness (see shootdowns) */
+    uint64_t irqflags = cpu_save_flags();
+    cpu_cli();
+    uint32_t cpu = cpu_current_id();
+    __atomic_fetch_and(space_cpus(phys_to_virt(old)), ~(1u << cpu), __ATOMIC_SEQ_CST);
+    __atomic_fetch_or(space_cpus(pml4), 1u << cpu, __ATOMIC_SEQ_CST);
+
+    if (!pcid_enabled) {
+        cpu_write_cr3(phys);
+        cpu_restore_flags(irqflags);
+        return;
+    }
+
+    uint16_t pcid = pcid_of(pml4);
+    uint64_t bit = 1ULL << (pcid % 64);
+    bool stale = __atomic_fetch_and(&pcid_stale[cpu][pcid / 64], ~bit, __ATOMIC_SEQ_CST) & bit;
+
+    if (stale || pcid == PCID_SHARED) {
+        cpu_write_cr3(phys | pcid);
+    } else {
+        cpu_write_cr3(phys | pcid | CR3_NOFLUSH);
+    }
+    cpu_restore_flags(irqflags);
 }
 
 /*
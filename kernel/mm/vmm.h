@@ -21,19 +21,53 @@
 #define PTE_ACCESSED    (1ULL << 5)     /* Page was accessed */
 #define PTE_DIRTY       (1ULL << 6)     /* Page was written */
 #define PTE_HUGE        (1ULL << 7)     /* Huge page (2MB/1GB) */
+#define PTE_PAT         (1ULL << 7)     /* PAT index bit (4KB entries) */
 #define PTE_GLOBAL      (1ULL << 8)     /* Global page */
+#define PTE_COW         (1ULL << 9)     /* Copy on write (software) */
+#define PTE_OWNED       (1ULL << 10)    /* Mapping holds a frame reference (software) */
+#define PTE_SWAP        (1ULL << 11)    /* Non-present: page swapped out (software) */
+#define PTE_HUGE_PAT    (1ULL << 12)    /* PAT index bit (huge entries) */
+#define PTE_SWAP_BUSY   (1ULL << 52)    /* Swap entry: swap-out in progress (software) */
 #define PTE_NX          (1ULL << 63)    /* No execute */
 
+/*
+ * Cache types, passed in the flags of the mapping calls
+ * Each is a PAT index (PAT/PCD/PWT bits) into the layout vmm_init()
+ * programs. Write-back is the default; write-combining suits
+ * framebuffers and other write-mostly apertures.
+ */
+#define PTE_CACHE_WB        0
+#define PTE_CACHE_WT        PTE_WRITETHROUGH
+#define PTE_CACHE_UC_MINUS  PTE_NOCACHE
+#define PTE_CACHE_UC        (PTE_NOCACHE | PTE_WRITETHROUGH)
+#define PTE_CACHE_WP        PTE_PAT
+#define PTE_CACHE_WC        (PTE_PAT | PTE_WRITETHROUGH)
+#define PTE_CACHE_MASK      (PTE_PAT | PTE_NOCACHE | PTE_WRITETHROUGH)
+
+/*
+ * Physical address bits of a page table entry
+ */
+#define PTE_ADDR_MASK   0x000FFFFFFFFFF000ULL
+
 /*
  * Page table structure
  */
 #define PT_ENTRIES      512
 
+/*
+ * Huge page sizes (1 GB pages need CPU support)
+ */
+#define PAGE_SIZE_2M    (1ULL << 21)
+#define PAGE_SIZE_1G    (1ULL << 30)
+
 /*
  * Virtual address space regions
  */
+#define KERNEL_HALF_BASE 0xFFFF800000000000ULL  /* Shared by all address spaces */
 #define KERNEL_VBASE    0xFFFFFFFF80000000ULL   /* Kernel virtual base */
 #define HEAP_VBASE      0xFFFF800100000000ULL   /* Kernel heap start */
+#define VMALLOC_VBASE   0xFFFFC90000000000ULL   /* vmalloc area start */
+#define VMALLOC_VSIZE   (1ULL << 35)            /* 32 GB */
 
 /*
  * Page table type
@@ -50,26 +84,141 @@ void vmm_init(uint64_t hhdm_offset);
  */
 pagetable_t vmm_get_kernel_pml4(void);
 
+/*
+ * Get the address space loaded on this CPU
+ */
+pagetable_t vmm_get_current_pml4(void);
+
 /*
  * Create new address space (PML4)
  */
 pagetable_t vmm_create_address_space(void);
 
+/*
+ * Clone an address space copy-on-write
+ * The lower half is shared: writable pages the mappings own
+ * (PTE_OWNED) become read-only in both copies and are copied on the
+ * first write fault. Shared frames are reference counted, so each copy
+ * frees only what it alone uses; other mappings are shared as they are.
+ * Returns NULL on failure, leaving the source unchanged
+ */
+pagetable_t vmm_clone_address_space(pagetable_t src);
+
 /*
  * Destroy address space
+ * Frames mapped with PTE_OWNED lose the reference their mapping held.
+ * One still loaded on some CPU is queued for vmm_reap_idle() instead.
  */
 void vmm_destroy_address_space(pagetable_t pml4);
 
+/*
+ * Queue an address space for teardown by vmm_reap_idle()
+ * It may still be loaded; the reaper waits until no CPU runs on it.
+ */
+void vmm_destroy_address_space_deferred(pagetable_t pml4);
+
+/*
+ * Idle hook: destroy one queued address space
+ * Returns true if there was one
+ */
+bool vmm_reap_idle(void);
+
+/*
+ * Resolve a write fault on a copy-on-write page
+ * Returns false if virt is not a copy-on-write page (or user is set
+ * and the page is not user accessible) or memory ran out
+ */
+bool vmm_resolve_cow(pagetable_t pml4, uint64_t virt, bool user);
+
 /*
  * Map virtual address to physical
  * Returns true on success
  */
 bool vmm_map_page(pagetable_t pml4, uint64_t virt, uint64_t phys, uint64_t flags);
 
+/*
+ * Map a physically contiguous range
+ * Uses the largest page size that virt, phys and the remaining length
+ * are aligned to. Flags are given as for 4 KB pages. On failure nothing
+ * of the range stays mapped. Returns true on success
+ */
+bool vmm_map_range(pagetable_t pml4, uint64_t virt, uint64_t phys, size_t size, uint64_t flags);
+
+/*
+ * Map count pages starting at virt to the frames listed in phys
+ * On failure nothing of the range stays mapped. Returns true on success
+ */
+bool vmm_map_pages(pagetable_t pml4, uint64_t virt, const uint64_t *phys, size_t count, uint64_t flags);
+
+/*
+ * Unmap a range, splitting huge pages that are only partly covered
+ * References held by PTE_OWNED mappings are dropped once the TLB has
+ * been flushed. Returns false, with nothing unmapped, if there is no
+ * memory for the page tables a split needs
+ */
+bool vmm_unmap_range(pagetable_t pml4, uint64_t virt, size_t size);
+
+/*
+ * Copy a mapped page to a different frame and point the mapping at it,
+ * keeping its flags
+ * Returns false if virt is not mapped by a 4 KB page, or was unmapped
+ * during the copy
+ */
+bool vmm_migrate_page(pagetable_t pml4, uint64_t virt, uint64_t phys);
+
+/*
+ * Change the cache type (PTE_CACHE_*) of the mapped pages in a range
+ * Huge pages only partly covered are split; unmapped pages are skipped.
+ * Returns false if a split ran out of memory (the rest of the range is
+ * left unchanged)
+ */
+bool vmm_set_cache(pagetable_t pml4, uint64_t virt, size_t size, uint64_t cache);
+
+/*
+ * Test and clear the accessed or dirty bit of a 4 KB page
+ * The TLB entry is flushed, so the next access (write) sets the bit
+ * again. Returns false if the bit was clear or virt is not mapped
+ */
+bool vmm_test_and_clear_accessed(pagetable_t pml4, uint64_t virt);
+bool vmm_test_and_clear_dirty(pagetable_t pml4, uint64_t virt);
+
+/*
+ * Replace the 4 KB page at virt with a non-present swap entry
+ * entry must have PTE_SWAP set and PTE_PRESENT clear; the VMM keeps
+ * the rest of its bits for the caller. The TLB is flushed before
+ * returning, and the reference a PTE_OWNED mapping held passes to the
+ * caller. Returns the old entry, or 0 if virt was not mapped by a
+ * 4 KB page
+ */
+uint64_t vmm_swap_out_page(pagetable_t pml4, uint64_t virt, uint64_t entry);
+
+/*
+ * Get the swap entry at virt, or 0 if there is none
+ */
+uint64_t vmm_get_swap_entry(pagetable_t pml4, uint64_t virt);
+
+/*
+ * Replace the swap entry at virt (0 clears it)
+ * Returns false if virt holds no swap entry
+ */
+bool vmm_set_swap_entry(pagetable_t pml4, uint64_t virt, uint64_t entry);
+
 /*
  * Unmap virtual address
+ * A huge page containing virt is split so only this page goes away.
+ * Returns false, with the page still mapped, if that split fails
  */
-void vmm_unmap_page(pagetable_t pml4, uint64_t virt);
+bool vmm_unmap_page(pagetable_t pml4, uint64_t virt);
+
+/*
+ * Direct-map (HHDM) address of a physical address
+ */
+void *vmm_phys_to_virt(uint64_t phys);
+
+/*
+ * Physical address of a direct-map (HHDM) address
+ */
+uint64_t vmm_direct_to_phys(const void *virt);
 
 /*
  * Get physical address for virtual address
@@ -87,4 +236,35 @@ void vmm_switch_address_space(pagetable_t pml4);
  */
 void vmm_invalidate_page(uint64_t virt);
 
+/*
+ * Page table and teardown statistics
+ */
+struct vmm_stats {
+    uint64_t pt_cached;         /* Table pages waiting on the free list */
+    uint64_t pt_reused;         /* Table allocations served from it */
+    uint64_t teardowns;         /* Address spaces destroyed */
+    uint64_t teardown_cycles;   /* TSC cycles spent destroying them */
+    uint64_t teardown_max;      /* Longest single teardown */
+    uint64_t reap_pending;      /* Queued for the idle reaper */
+};
+
+void vmm_get_stats(struct vmm_stats *stats);
+
+/*
+ * IPI handler for TLB shootdowns
+ */
+void vmm_shootdown_ipi(void);
+
+/*
+ * TLB shootdown statistics
+ */
+struct vmm_tlb_stats {
+    uint64_t flushes;           /* Batches flushed */
+    uint64_t shootdowns;        /* Batches sent to other CPUs */
+    uint64_t ipis;              /* IPIs sent for them */
+    uint64_t skipped;           /* CPUs skipped as running another address space */
+};
+
+void vmm_get_tlb_stats(struct vmm_tlb_stats *stats);
+
 #endif /* _ASTRA_MM_VMM_H */
@@ -0,0 +1,337 @@
+/*
+ * AstraOS - Compressed Page Store Implementation
+ * Cold anonymous pages kept LZ4-compressed in RAM
+ *
+ * When free memory runs low, committed pages of anonymous kernel
+ * regions (the heap) that have not been touched since the last look
+ * are compressed into the store and their frames freed. The page table
+ * entry keeps a swap entry naming the slot, and the next access faults
+ * the page back in through the VMA layer. All-zero pages take no slot.
+ *
+ * Slots of one size class are packed into whole frames taken straight
+ * from the PMM (not the heap, whose pages are what gets swapped out).
+ * Each frame's descriptor holds its class and a bitmap of used slots,
+ * and frames with free slots sit on a list per class; a frame goes
+ * back to the PMM when its last slot is freed. The store never grows
+ * past a quarter of memory.
+ *
+ * Candidates are the movable frames (see PAGE_FLAG_MOVABLE), visited
+ * by a clock hand; the accessed bit gives each one a second chance.
+ *
+ * Pages come back in from the page fault handler, which runs with
+ * interrupts off and so cannot reclaim. Reclaim therefore keeps a few
+ * frames set aside for it to fall back on.
+ */
+
+#include "zram.h"
+#include "vma.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "page.h"
+#include "../lib/lz4.h"
+#include "../lib/string.h"
+#include "../sync/spinlock.h"
+
+/*
+ * Handles are the frame number and the slot within the frame
+ */
+#define ZRAM_SLOT_BITS      5           /* Up to 32 slots per frame */
+#define ZRAM_SLOT_MASK      ((1u << ZRAM_SLOT_BITS) - 1)
+
+/*
+ * Each slot starts with the 16-bit length of its data
+ */
+#define ZRAM_SLOT_HEADER    2
+#define ZRAM_MAX_DATA       (ZRAM_GRANULE * ZRAM_CLASSES - ZRAM_SLOT_HEADER)
+
+/*
+ * Reclaim policy
+ */
+#define ZRAM_SCAN_MAX       256         /* Candidates looked at per call */
+#define ZRAM_SCAN_FRAMES    1024        /* Frames searched per candidate */
+#define ZRAM_IDLE_BATCH     16          /* Pages per idle call */
+#define ZRAM_LOW_FREE_DIV   8           /* Idle reclaim below 1/8 free */
+#define ZRAM_MAX_FRAMES_DIV 4           /* Store limit: 1/4 of memory */
+#define ZRAM_RESERVE_PAGES  32          /* Frames kept for swap-in */
+
+/*
+ * Frames with free slots, per class
+ */
+static struct page *partial[ZRAM_CLASSES];
+
+static struct lz4_state lz4_state;
+static uint8_t buffer[ZRAM_MAX_DATA];
+static spinlock_t zram_lock = SPINLOCK_INIT;
+
+static uint64_t scan_hand = 0;
+static bool reclaiming = false;
+
+static void *reserve[ZRAM_RESERVE_PAGES];
+static uint32_t reserve_count = 0;
+
+static uint64_t stored_pages = 0;
+static uint64_t zero_pages = 0;
+static uint64_t compressed_bytes = 0;
+static uint64_t frame_count = 0;
+static uint64_t swap_out_count = 0;
+static uint64_t swap_in_count = 0;
+static uint64_t reject_count = 0;
+
+/*
+ * Frame descriptor fields: class in bits 32+ of private, used slots
+ * in bits 0-31
+ */
+static inline uint32_t frame_class(struct page *frame) {
+    return frame->private >> 32;
+}
+
+static inline uint32_t slot_size(uint32_t cls) {
+    return (cls + 1) * ZRAM_GRANULE;
+}
+
+static inline uint32_t full_mask(uint32_t cls) {
+    return (uint32_t)((1ULL << (PAGE_SIZE / slot_size(cls))) - 1);
+}
+
+static inline uint8_t *slot_data(struct page *frame, uint32_t slot) {
+    return (uint8_t *)vmm_phys_to_virt(page_to_phys(frame)) + slot * slot_size(frame_class(frame));
+}
+
+/*
+ * Partial list linkage (zram_lock held)
+ */
+static void partial_push(struct page *frame) {
+    uint32_t cls = frame_class(frame);
+    frame->prev = NULL;
+    frame->next = partial[cls];
+    if (frame->next) frame->next->prev = frame;
+    partial[cls] = frame;
+}
+
+static void partial_remove(struct page *frame) {
+    if (frame->prev) {
+        frame->prev->next = frame->next;
+    } else {
+        partial[frame_class(frame)] = frame->next;
+    }
+    if (frame->next) frame->next->prev = frame->prev;
+}
+
+/*
+ * Frame of a handle, or NULL if it does not name a store frame
+ */
+static struct page *handle_frame(uint64_t handle) {
+    struct page *frame = page_of((handle >> ZRAM_SLOT_BITS) * PAGE_SIZE);
+    if (!frame || frame->owner != PAGE_OWNER_ZRAM) return NULL;
+    return frame;
+}
+
+/*
+ * Store a page
+ */
+bool zram_store(const void *page, uint64_t *handle) {
+    const uint64_t *words = page;
+    bool zero = true;
+    for (uint32_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+        if (words[i]) {
+            zero = false;
+            break;
+        }
+    }
+
+    uint64_t irqflags;
+    spinlock_acquire_irqsave(&zram_lock, &irqflags);
+
+    if (zero) {
+        stored_pages++;
+        zero_pages++;
+        spinlock_release_irqrestore(&zram_lock, irqflags);
+        *handle = ZRAM_HANDLE_ZERO;
+        return true;
+    }
+
+    size_t len = lz4_compress(&lz4_state, page, PAGE_SIZE, buffer, sizeof(buffer));
+    uint32_t cls = (len + ZRAM_SLOT_HEADER + ZRAM_GRANULE - 1) / ZRAM_GRANULE - 1;
+
+    struct page *frame = len ? partial[cls] : NULL;
+    if (len && !frame &&
+        frame_count < pmm_get_total_memory() / PAGE_SIZE / ZRAM_MAX_FRAMES_DIV) {
+        void *phys = pmm_alloc_page();
+        if (phys) {
+            page_set_owner((uint64_t)phys, 1, PAGE_OWNER_ZRAM);
+            frame = page_of((uint64_t)phys);
+            frame->private = (uint64_t)cls << 32;
+            partial_push(frame);
+            frame_count++;
+        }
+    }
+
+    if (!frame) {
+        reject_count++;
+        spinlock_release_irqrestore(&zram_lock, irqflags);
+        return false;
+    }
+
+    uint32_t slot = __builtin_ctz(~(uint32_t)frame->private);
+    frame->private |= 1ULL << slot;
+    if (((uint32_t)frame->private & full_mask(cls)) == full_mask(cls)) {
+        partial_remove(frame);
+    }
+
+    uint8_t *data = slot_data(frame, slot);
+    data[0] = len & 0xFF;
+    data[1] = len >> 8;
+    memcpy(data + ZRAM_SLOT_HEADER, buffer, len);
+
+    stored_pages++;
+    compressed_bytes += len;
+    *handle = (page_to_pfn(frame) << ZRAM_SLOT_BITS) | slot;
+
+    spinlock_release_irqrestore(&zram_lock, irqflags);
+    return true;
+}
+
+/*
+ * Load a page
+ */
+bool zram_load(uint64_t handle, void *page) {
+    if (handle == ZRAM_HANDLE_ZERO) {
+        memset(page, 0, PAGE_SIZE);
+        __atomic_add_fetch(&swap_in_count, 1, __ATOMIC_RELAXED);
+        return true;
+    }
+
+    uint64_t irqflags;
+    spinlock_acquire_irqsave(&zram_lock, &irqflags);
+
+    struct page *frame = handle_frame(handle);
+    int size = -1;
+    if (frame) {
+        uint8_t *data = slot_data(frame, handle & ZRAM_SLOT_MASK);
+        size_t len = data[0] | (data[1] << 8);
+        size = lz4_decompress(data + ZRAM_SLOT_HEADER, len, page, PAGE_SIZE);
+        swap_in_count++;
+    }
+
+    spinlock_release_irqrestore(&zram_lock, irqflags);
+    return size == PAGE_SIZE;
+}
+
+/*
+ * Free a page
+ */
+void zram_free(uint64_t handle) {
+    uint64_t irqflags;
+    spinlock_acquire_irqsave(&zram_lock, &irqflags);
+
+    if (handle == ZRAM_HANDLE_ZERO) {
+        stored_pages--;
+        zero_pages--;
+        spinlock_release_irqrestore(&zram_lock, irqflags);
+        return;
+    }
+
+    struct page *frame = handle_frame(handle);
+    uint32_t slot = handle & ZRAM_SLOT_MASK;
+    if (!frame || !(frame->private & (1ULL << slot))) {
+        spinlock_release_irqrestore(&zram_lock, irqflags);
+        return;
+    }
+
+    uint8_t *data = slot_data(frame, slot);
+    compressed_bytes -= data[0] | (data[1] << 8);
+    stored_pages--;
+
+    uint32_t cls = frame_class(frame);
+    bool was_full = ((uint32_t)frame->private & full_mask(cls)) == full_mask(cls);
+    frame->private &= ~(1ULL << slot);
+
+    if ((uint32_t)frame->private == 0) {
+        if (!was_full) partial_remove(frame);
+        frame_count--;
+        pmm_free_page((void *)page_to_phys(frame));
+    } else if (was_full) {
+        partial_push(frame);
+    }
+
+    spinlock_release_irqrestore(&zram_lock, irqflags);
+}
+
+/*
+ * Swap-in reserve
+ * Topped up by up to max frames, outside zram_lock since the PMM may
+ * reclaim.
+ */
+static void reserve_fill(uint64_t max) {
+    for (uint64_t i = 0; i < max; i++) {
+        if (__atomic_load_n(&reserve_count, __ATOMIC_RELAXED) >= ZRAM_RESERVE_PAGES) return;
+
+        void *frame = pmm_alloc_page();
+        if (!frame) return;
+
+        uint64_t irqflags;
+        spinlock_acquire_irqsave(&zram_lock, &irqflags);
+        if (reserve_count < ZRAM_RESERVE_PAGES) {
+            reserve[reserve_count++] = frame;
+            frame = NULL;
+        }
+        spinlock_release_irqrestore(&zram_lock, irqflags);
+
+        if (frame) {
+            pmm_free_page(frame);
+            return;
+        }
+    }
+}
+
+void *zram_reserve_take(void) {
+    uint64_t irqflags;
+    spinlock_acquire_irqsave(&zram_lock, &irqflags);
+    void *frame = reserve_count > 0 ? reserve[--reserve_count] : NULL;
+    spinlock_release_irqrestore(&zram_lock, irqflags);
+    return frame;
+}
+
+/*
+ * Reclaim
+ */
+uint64_t zram_reclaim(uint64_t count) {
+    if (__atomic_exchange_n(&reclaiming, true, __ATOMIC_ACQUIRE)) return 0;
+
+    uint64_t done = 0;
+    for (uint32_t i = 0; i < ZRAM_SCAN_MAX && done < count; i++) {
+        struct page *page = page_next_movable(&scan_hand, ZRAM_SCAN_FRAMES);
+        if (page && vma_swap_out(page->private)) done++;
+    }
+
+    /* Half the frames freed may top up the reserve; the rest are the caller's */
+    reserve_fill(done / 2);
+
+    __atomic_add_fetch(&swap_out_count, done, __ATOMIC_RELAXED);
+    __atomic_store_n(&reclaiming, false, __ATOMIC_RELEASE);
+    return done;
+}
+
+bool zram_reclaim_idle(void) {
+    if (pmm_get_free_memory() >= pmm_get_total_memory() / ZRAM_LOW_FREE_DIV) {
+        reserve_fill(ZRAM_RESERVE_PAGES);
+        return false;
+    }
+    return zram_reclaim(ZRAM_IDLE_BATCH) > 0;
+}
+
+/*
+ * Statistics
+ */
+void zram_get_stats(struct zram_stats *stats) {
+    uint64_t irqflags;
+    spinlock_acquire_irqsave(&zram_lock, &irqflags);
+    stats->stored = stored_pages;
+    stats->zero_pages = zero_pages;
+    stats->compressed = compressed_bytes;
+    stats->frames = frame_count;
+    stats->swap_outs = swap_out_count;
+    stats->swap_ins = swap_in_count;
+    stats->rejected = reject_count;
+    spinlock_release_irqrestore(&zram_lock, irqflags);
+}
@@ -0,0 +1,82 @@
+/*
+ * AstraOS - Compressed Page Store Header
+ * Cold anonymous pages kept LZ4-compressed in RAM
+ */
+
+#ifndef _ASTRA_MM_ZRAM_H
+#define _ASTRA_MM_ZRAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Store layout
+ * Compressed pages live in slots of a size class (multiples of
+ * ZRAM_GRANULE), packed into frames of their class. Pages that do not
+ * compress below the largest class are not stored.
+ */
+#define ZRAM_GRANULE        128
+#define ZRAM_CLASSES        24          /* Largest slot: 3 KB */
+
+/*
+ * Handle of an all-zero page (stored without a slot)
+ */
+#define ZRAM_HANDLE_ZERO    0
+
+/*
+ * Compress a page into the store
+ * Returns false if it does not compress well enough or the store is
+ * full; otherwise *handle identifies it (below 2^40, so it fits the
+ * address bits of a page table entry).
+ */
+bool zram_store(const void *page, uint64_t *handle);
+
+/*
+ * Decompress a stored page into page
+ * The page stays stored until zram_free().
+ */
+bool zram_load(uint64_t handle, void *page);
+
+/*
+ * Drop a stored page
+ */
+void zram_free(uint64_t handle);
+
+/*
+ * Swap out up to count cold pages of anonymous kernel regions
+ * Pages whose accessed bit is set get a second chance instead.
+ * Returns the number of pages swapped out. Safe to call from the PMM:
+ * does nothing if reclaim is already running.
+ */
+uint64_t zram_reclaim(uint64_t count);
+
+/*
+ * Idle hook: reclaim a batch while free memory is low
+ * Also tops up the swap-in reserve. Returns true if any page was
+ * swapped out
+ */
+bool zram_reclaim_idle(void);
+
+/*
+ * Take a frame from the swap-in reserve
+ * For page faults, which cannot reclaim. Returns NULL if it is empty
+ */
+void *zram_reserve_take(void);
+
+/*
+ * Store statistics
+ */
+struct zram_stats {
+    uint64_t stored;        /* Pages held, zero pages included */
+    uint64_t zero_pages;    /* ... of which all zero */
+    uint64_t compressed;    /* Bytes of compressed data */
+    uint64_t frames;        /* Frames holding slots */
+    uint64_t swap_outs;     /* Pages swapped out */
+    uint64_t swap_ins;      /* Pages faulted back in */
+    uint64_t rejected;      /* Pages that did not compress or fit */
+};
+
+void zram_get_stats(struct zram_stats *stats);
+
+#endif /* _ASTRA_MM_ZRAM_H */
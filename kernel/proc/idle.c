@@ -0,0 +1,36 @@
+/*
+ * AstraOS - Idle Work Implementation
+ * Background work run from the kernel's idle loops
+ */
+
+#include "idle.h"
+
+/*
+ * Registered callbacks
+ */
+#define IDLE_MAX_WORK   8
+
+static idle_work_fn idle_work[IDLE_MAX_WORK];
+static int idle_work_count = 0;
+
+/*
+ * Register idle work
+ */
+bool idle_register(idle_work_fn fn) {
+    if (!fn || idle_work_count >= IDLE_MAX_WORK) return false;
+    idle_work[idle_work_count++] = fn;
+    return true;
+}
+
+/*
+ * Run idle work
+ */
+bool idle_run(void) {
+    bool busy = false;
+    for (int i = 0; i < idle_work_count; i++) {
+        if (idle_work[i]()) {
+            busy = true;
+        }
+    }
+    return busy;
+}
@@ -0,0 +1,31 @@
+/*
+ * AstraOS - Idle Work Header
+ * Background work run from the kernel's idle loops
+ */
+
+#ifndef _ASTRA_PROC_IDLE_H
+#define _ASTRA_PROC_IDLE_H
+
+#include <stdbool.h>
+
+/*
+ * Idle work callback
+ * Should do a small, bounded amount of work and return true
+ * if there was anything to do, false if it is idle too.
+ */
+typedef bool (*idle_work_fn)(void);
+
+/*
+ * Register a callback to run whenever the CPU would otherwise halt
+ * Returns false if the table is full
+ */
+bool idle_register(idle_work_fn fn);
+
+/*
+ * Run every registered callback once
+ * Returns true if any of them did work (the caller should poll
+ * again instead of halting)
+ */
+bool idle_run(void);
+
+#endif /* _ASTRA_PROC_IDLE_H */
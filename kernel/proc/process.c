@@ -7,9 +7,12 @@
 #include "scheduler.h"
 #include "../mm/pmm.h"
 #include "../mm/vmm.h"
+#include "../mm/page.h"
 #include "../mm/heap.h"
+#include "../mm/vmalloc.h"
 #include "../lib/string.h"
 #include "../sync/spinlock.h"
+#include "../arch/x86_64/cpu.h"
 
 /*
  * Process table
@@ -19,6 +22,13 @@ static uint64_t next_pid = 1;
 static struct process *current_process = NULL;
 static spinlock_t process_lock = SPINLOCK_INIT;
 
+/*
+ * Stack of the last exited process
+ * A process cannot unmap the stack it exits on, so it is freed by the
+ * next exit instead.
+ */
+static void *dead_stack = NULL;
+
 /*
  * External context switch function (in context.asm)
  */
@@ -77,6 +87,10 @@ static void process_entry_wrapper(void) {
  * Create a new kernel process
  */
 struct process *process_create(const char *name, void (*entry)(void)) {
+    /* Allocate kernel stack (guard page below, no contiguity needed) */
+    void *stack = vmalloc(KERNEL_STACK_SIZE, PAGE_OWNER_STACK);
+    if (!stack) return NULL;
+
     uint64_t flags;
     spinlock_acquire_irqsave(&process_lock, &flags);
 
@@ -84,20 +98,11 @@ struct process *process_create(const char *name, void (*entry)(void)) {
     struct process *proc = find_free_slot();
     if (!proc) {
         spinlock_release_irqrestore(&process_lock, flags);
+        vfree(stack);
         return NULL;
     }
 
-    /* Allocate kernel stack */
-    size_t stack_pages = (KERNEL_STACK_SIZE + PAGE_SIZE - 1) / PAGE_SIZE;
-    void *stack_phys = pmm_alloc_pages(stack_pages);
-    if (!stack_phys) {
-        spinlock_release_irqrestore(&process_lock, flags);
-        return NULL;
-    }
-
-    /* Map kernel stack (use HHDM for simplicity) */
-    extern uint64_t hhdm_offset;
-    uint64_t stack_base = (uint64_t)stack_phys + hhdm_offset;
+    uint64_t stack_base = (uint64_t)stack;
     uint64_t stack_top = stack_base + KERNEL_STACK_SIZE;
 
     /* Initialize process */
@@ -143,6 +148,8 @@ struct process *process_create(const char *name, void (*entry)(void)) {
  * Exit current process
  */
 void process_exit(int exit_code) {
+    void *old_stack = NULL;
+
     uint64_t flags;
     spinlock_acquire_irqsave(&process_lock, &flags);
 
@@ -150,19 +157,26 @@ void process_exit(int exit_code) {
         current_process->exit_code = exit_code;
         current_process->state = PROCESS_ZOMBIE;
 
-        /* Free kernel stack */
+        /* Free the previous exited stack; this one is still in use */
         if (current_process->kernel_stack_base) {
-            extern uint64_t hhdm_offset;
-            void *phys = (void *)(current_process->kernel_stack_base - hhdm_offset);
-            size_t pages = (KERNEL_STACK_SIZE + PAGE_SIZE - 1) / PAGE_SIZE;
-            pmm_free_pages(phys, pages);
+            old_stack = dead_stack;
+            dead_stack = (void *)current_process->kernel_stack_base;
+        }
+
+        /* Still loaded until schedule(); the idle reaper tears it down */
+        if (current_process->page_table != vmm_get_kernel_pml4()) {
+            vmm_destroy_address_space_deferred(current_process->page_table);
+            current_process->page_table = vmm_get_kernel_pml4();
         }
 
         /* Mark slot as unused */
         current_process->state = PROCESS_UNUSED;
     }
 
-    spinlock_release_irqrestore(&process_lock, flags);
+    /* Unmapping may wait for other CPUs, so not under the lock */
+    spinlock_release(&process_lock);
+    vfree(old_stack);
+    cpu_restore_flags(flags);
 
     /* Schedule next process */
     schedule();
@@ -9,6 +9,7 @@
 #include "scheduler.h"
 #include "process.h"
 #include "../sync/spinlock.h"
+#include "../mm/vmm.h"
 #include "../arch/x86_64/cpu.h"
 
 /*
@@ -162,6 +163,11 @@ void schedule(void) {
     process_set_current(next);
     context_switches++;
 
+    /* Load the next address space (a no-op when it is shared) */
+    if (next->page_table) {
+        vmm_switch_address_space(next->page_table);
+    }
+
     /* Perform context switch */
     if (current) {
         spinlock_release_irqrestore(&sched_lock, flags);
@@ -8,7 +8,7 @@
 #include "../lib/string.h"
 #include "../lib/theme.h"
 #include "../fs/vfs.h"
-#include "../mm/heap.h"
+#include "../mm/vmalloc.h"
 
 #define MAX_FILE_SIZE (1024 * 1024)  /* 1 MB max */
 #define LINES_PER_PAGE 20
@@ -121,16 +121,14 @@ void cmd_view(int argc, char **argv) {
         return;
     }
     
-    /* Read file */
-    char *buffer = (char*)kmalloc(node->size + 1);
+    /* Map file (pages come from the page cache as they are shown) */
+    uint64_t bytes_read = node->size;
+    const char *buffer = bytes_read ? (const char*)vmap_file(node, 0, bytes_read) : "";
     if (!buffer) {
-        kprintf("%sError:%s Out of memory\n", theme->error, ANSI_RESET);
+        kprintf("%sError:%s Cannot map file\n", theme->error, ANSI_RESET);
         vfs_close(node);
         return;
     }
-    
-    uint64_t bytes_read = vfs_read(node, 0, node->size, (uint8_t*)buffer);
-    buffer[bytes_read] = '\0';
     vfs_close(node);
     
     /* Get file extension */
@@ -155,7 +153,8 @@ void cmd_view(int argc, char **argv) {
     int line_pos = 0;
     
     for (uint64_t i = 0; i <= bytes_read; i++) {
-        if (buffer[i] == '\n' || buffer[i] == '\0' || line_pos >= 255) {
+        char ch = i < bytes_read ? buffer[i] : '\0';
+        if (ch == '\n' || ch == '\0' || line_pos >= 255) {
             line[line_pos] = '\0';
             
             /* Print line number */
@@ -185,12 +184,12 @@ void cmd_view(int argc, char **argv) {
                 lines_shown = 0;
             }
             
-            if (buffer[i] == '\0') break;
+            if (ch == '\0') break;
         } else {
-            line[line_pos++] = buffer[i];
+            line[line_pos++] = ch;
         }
     }
     
     kprintf("\n%s[End of file]%s\n\n", theme->info, ANSI_RESET);
-    kfree(buffer);
+    if (bytes_read) vfree((void*)buffer);
 }
@@ -8,9 +8,17 @@
 #include "../lib/string.h"
 #include "../lib/theme.h"
 #include "../mm/pmm.h"
+#include "../mm/numa.h"
+#include "../mm/page.h"
 #include "../mm/heap.h"
+#include "../mm/vma.h"
+#include "../mm/vmalloc.h"
+#include "../mm/filemap.h"
+#include "../mm/zram.h"
+#include "../mm/slab.h"
 #include "../drivers/pit.h"
 #include "../arch/x86_64/cpu.h"
+#include "../arch/x86_64/percpu.h"
 #include "../arch/x86_64/io.h"
 #include "../drivers/acpi.h"
 #include "../fs/vfs.h"
@@ -37,6 +45,10 @@ void cmd_help(int argc, char **argv) {
     kprintf("  %sstatus%s    - Live system dashboard\n", theme->accent2, ANSI_RESET);
     kprintf("  %sinfo%s      - System information\n", theme->accent2, ANSI_RESET);
     kprintf("  %smem%s       - Memory usage\n", theme->accent2, ANSI_RESET);
+    kprintf("  %spmm%s       - Page allocator statistics\n", theme->accent2, ANSI_RESET);
+    kprintf("  %stlb%s       - TLB shootdown statistics\n", theme->accent2, ANSI_RESET);
+    kprintf("  %sslab%s      - Object cache statistics\n", theme->accent2, ANSI_RESET);
+    kprintf("  %sheap%s      - Heap stress benchmark\n", theme->accent2, ANSI_RESET);
     kprintf("  %suptime%s    - System uptime\n", theme->accent2, ANSI_RESET);
     kprintf("  %scpuinfo%s   - CPU information\n", theme->accent2, ANSI_RESET);
     
@@ -107,10 +119,290 @@ void cmd_mem(int argc, char **argv) {
     kprintf("  Used:   %llu MB (%llu bytes)\n", used / (1024 * 1024), used);
     kprintf("  Free:   %llu MB (%llu bytes)\n", free / (1024 * 1024), free);
     kprintf("  Usage:  %llu%%\n", (used * 100) / total);
+    kprintf("  Reclaimed from bootloader/ACPI: %llu KB\n",
+            pmm_get_reclaimed_memory() / 1024);
+
+    static const char *zone_names[PMM_ZONE_COUNT] = { "DMA", "DMA32", "Normal" };
+    kprintf("\nZones:\n");
+    for (uint32_t zone = 0; zone < PMM_ZONE_COUNT; zone++) {
+        uint64_t zone_total, zone_free;
+        pmm_get_zone_stats(zone, &zone_total, &zone_free);
+        if (zone_total == 0) continue;
+        kprintf("  %s: %llu MB free of %llu MB\n", zone_names[zone],
+                zone_free / (1024 * 1024), zone_total / (1024 * 1024));
+    }
+
+    if (numa_node_count() > 1) {
+        kprintf("\nNUMA Nodes:\n");
+        for (uint32_t node = 0; node < numa_node_count(); node++) {
+            uint64_t node_free = pmm_get_node_free_memory(node);
+            kprintf("  Node %u: %llu MB free\n", node, node_free / (1024 * 1024));
+        }
+    }
+
+    struct pmm_pcp_stats pcp;
+    pmm_get_pcp_stats(&pcp);
+    uint64_t requests = pcp.hits + pcp.misses;
+
+    kprintf("\nPer-CPU Page Cache:\n");
+    kprintf("  Hits:   %llu / %llu (%llu%%)\n", pcp.hits, requests,
+            requests ? (pcp.hits * 100) / requests : 0);
+    kprintf("  Refills: %llu, Drains: %llu, Cached: %llu pages\n",
+            pcp.refills, pcp.drains, pcp.cached);
+
+    static const char *owner_names[PAGE_OWNER_COUNT] = {
+        "Free", "Boot", "Kernel", "Page tables", "Heap", "Stacks", "Page map",
+        "Page cache", "Compressed", "Slabs"
+    };
+    uint64_t owners[PAGE_OWNER_COUNT];
+    page_get_owner_stats(owners);
+
+    kprintf("\nPage Owners:\n");
+    for (int i = 0; i < PAGE_OWNER_COUNT; i++) {
+        if (owners[i] == 0) continue;
+        kprintf("  %s: %llu KB\n", owner_names[i], owners[i] * (PAGE_SIZE / 1024));
+    }
+
+    struct pmm_zero_stats zero;
+    pmm_get_zero_stats(&zero);
+    uint64_t zero_requests = zero.hits + zero.misses;
+
+    kprintf("\nZeroed Page Pool:\n");
+    kprintf("  Hits:   %llu / %llu (%llu%%), Pooled: %llu pages\n", zero.hits, zero_requests,
+            zero_requests ? (zero.hits * 100) / zero_requests : 0, zero.pooled);
+
+    struct pmm_compact_stats compact;
+    pmm_get_compact_stats(&compact);
+
+    kprintf("\nCompaction:\n");
+    kprintf("  Succeeded: %llu, Failed: %llu, Frames moved: %llu\n",
+            compact.successes, compact.failures, compact.migrated);
+
+    struct vma_stats vma;
+    vma_get_stats(&vma);
+
+    kprintf("\nDemand Paging:\n");
+    kprintf("  Faults: %llu, Committed: %llu KB of %llu KB reserved\n", vma.faults,
+            vma.committed * (PAGE_SIZE / 1024), vma.reserved * (PAGE_SIZE / 1024));
+    kprintf("  Copy-on-write faults: %llu\n", vma.cow_faults);
+
+    struct zram_stats zram;
+    zram_get_stats(&zram);
+
+    kprintf("\nCompressed Swap (zram):\n");
+    kprintf("  Stored: %llu KB (%llu zero pages) in %llu KB, Swapped out: %llu KB\n",
+            zram.stored * (PAGE_SIZE / 1024), zram.zero_pages,
+            zram.frames * (PAGE_SIZE / 1024), vma.swapped * (PAGE_SIZE / 1024));
+    kprintf("  Compressed data: %llu bytes, Swap-outs: %llu, Swap-ins: %llu, Rejected: %llu\n",
+            zram.compressed, zram.swap_outs, zram.swap_ins, zram.rejected);
+
+    struct filemap_stats fstats;
+    filemap_get_stats(&fstats);
+
+    kprintf("\nPage Cache:\n");
+    kprintf("  Files: %llu, Cached: %llu KB, Hits: %llu, Misses: %llu\n", fstats.files,
+            fstats.pages * (PAGE_SIZE / 1024), fstats.hits, fstats.misses);
+
+    struct vmalloc_stats vstats;
+    vmalloc_get_stats(&vstats);
+
+    kprintf("\nvmalloc:\n");
+    kprintf("  Areas: %llu, Mapped: %llu KB\n", vstats.areas, vstats.pages * (PAGE_SIZE / 1024));
+
+    struct vmm_stats vmm;
+    vmm_get_stats(&vmm);
+
+    kprintf("\nPage Tables:\n");
+    kprintf("  Cached: %llu, Reused: %llu\n", vmm.pt_cached, vmm.pt_reused);
+    kprintf("  Teardowns: %llu, Avg: %llu cycles, Max: %llu cycles, Queued: %llu\n",
+            vmm.teardowns, vmm.teardowns ? vmm.teardown_cycles / vmm.teardowns : 0,
+            vmm.teardown_max, vmm.reap_pending);
+
+    struct heap_stats heap;
+    heap_get_stats(&heap);
 
     kprintf("\nHeap Information:\n");
-    kprintf("  Used:   %u bytes\n", (unsigned int)heap_get_used());
-    kprintf("  Free:   %u bytes\n", (unsigned int)heap_get_free());
+    kprintf("  Size:   %llu KB\n", heap.size / 1024);
+    kprintf("  Used:   %llu bytes\n", heap.used);
+    kprintf("  Free:   %llu bytes in %llu blocks (largest %llu)\n",
+            heap.free, heap.free_blocks, heap.largest_free);
+    uint64_t mag_requests = heap.mag_hits + heap.mag_misses;
+    kprintf("  Magazines: %llu bytes cached, Hits: %llu / %llu (%llu%%), Flushes: %llu\n",
+            heap.cached, heap.mag_hits, mag_requests,
+            mag_requests ? (heap.mag_hits * 100) / mag_requests : 0, heap.mag_flushes);
+    kprintf("\n");
+}
+
+/*
+ * heap - Kernel heap stress benchmark
+ * Leaves the heap fragmented by a long-lived set of small blocks, then
+ * times random kmalloc/kfree calls over a working set.
+ */
+#define HEAP_BENCH_PINNED   2048
+#define HEAP_BENCH_SLOTS    256
+#define HEAP_BENCH_OPS      200000
+
+static void *bench_pinned[HEAP_BENCH_PINNED];
+static void *bench_slots[HEAP_BENCH_SLOTS];
+
+static inline uint32_t bench_rand(uint32_t *seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+void cmd_heap(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+
+    uint32_t seed = 12345;
+
+    /* Fragment: keep every other small block */
+    for (int i = 0; i < HEAP_BENCH_PINNED * 2; i++) {
+        void *ptr = kmalloc(16 + bench_rand(&seed) % 240);
+        if (i & 1) {
+            bench_pinned[i / 2] = ptr;
+        } else {
+            kfree(ptr);
+        }
+    }
+
+    struct heap_stats before;
+    heap_get_stats(&before);
+
+    uint64_t failed = 0;
+    uint64_t start = cpu_rdtsc();
+    for (int i = 0; i < HEAP_BENCH_OPS; i++) {
+        uint32_t slot = bench_rand(&seed) % HEAP_BENCH_SLOTS;
+        if (bench_slots[slot]) {
+            kfree(bench_slots[slot]);
+            bench_slots[slot] = NULL;
+        } else {
+            uint32_t r = bench_rand(&seed);
+            size_t size = (r & 3) ? 16 + r % 512 : 512 + r % 8192;
+            bench_slots[slot] = kmalloc(size);
+            if (!bench_slots[slot]) failed++;
+        }
+    }
+    uint64_t cycles = cpu_rdtsc() - start;
+
+    for (int i = 0; i < HEAP_BENCH_SLOTS; i++) {
+        kfree(bench_slots[i]);
+        bench_slots[i] = NULL;
+    }
+    for (int i = 0; i < HEAP_BENCH_PINNED; i++) {
+        kfree(bench_pinned[i]);
+        bench_pinned[i] = NULL;
+    }
+
+    kprintf("\nHeap Benchmark (%u pinned blocks, %u slots):\n",
+            HEAP_BENCH_PINNED, HEAP_BENCH_SLOTS);
+    struct heap_stats after;
+    heap_get_stats(&after);
+    uint64_t hits = after.mag_hits - before.mag_hits;
+    uint64_t misses = after.mag_misses - before.mag_misses;
+
+    kprintf("  Free blocks at start: %llu\n", before.free_blocks);
+    kprintf("  %u kmalloc/kfree calls: %llu cycles (%llu per call)\n",
+            HEAP_BENCH_OPS, cycles, cycles / HEAP_BENCH_OPS);
+    kprintf("  Magazine hits: %llu / %llu small allocations\n", hits, hits + misses);
+    if (failed) kprintf("  Failed allocations: %llu\n", failed);
+    kprintf("\n");
+}
+
+/*
+ * pmm - Display page allocator statistics
+ * 'pmm reset' clears the counters.
+ */
+void cmd_pmm(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+        pmm_reset_stats();
+        kprintf("PMM statistics cleared.\n");
+        return;
+    }
+
+    struct pmm_stats st;
+    pmm_get_stats(&st);
+
+    kprintf("\nPage Allocator:\n");
+    kprintf("---------------\n");
+    kprintf("  Allocations: %llu (%llu pages), Failed: %llu\n",
+            st.allocs, st.pages_allocated, st.alloc_failures);
+    kprintf("  Frees:       %llu (%llu pages)\n", st.frees, st.pages_freed);
+
+    kprintf("\nAllocation Latency (cycles):\n");
+    kprintf("  p50 < %llu, p90 < %llu, p99 < %llu, max %llu\n",
+            st.latency_p50, st.latency_p90, st.latency_p99, st.latency_max);
+    for (int b = 0; b < PMM_LAT_BUCKETS; b++) {
+        if (st.latency[b] == 0) continue;
+        kprintf("  < %llu: %llu\n", 2ULL << b, st.latency[b]);
+    }
+
+    kprintf("\nLock Contention:\n");
+    kprintf("  Acquired: %llu, Contended: %llu (%llu%%), Wait: %llu cycles\n",
+            st.lock_acquires, st.lock_contended,
+            st.lock_acquires ? (st.lock_contended * 100) / st.lock_acquires : 0,
+            st.lock_wait_cycles);
+
+    kprintf("\nFree Blocks (order: count):\n ");
+    for (int o = 0; o < PMM_MAX_ORDER; o++) {
+        kprintf(" %u:%llu", o, st.free_blocks[o]);
+    }
+    kprintf("\n");
+
+    kprintf("\nFree Extents:\n");
+    for (int b = 0; b < PMM_EXTENT_BUCKETS; b++) {
+        if (st.extents[b] == 0) continue;
+        kprintf("  >= %llu KB: %llu\n", (1ULL << b) * (PAGE_SIZE / 1024), st.extents[b]);
+    }
+    kprintf("  Largest: %llu KB\n\n", st.largest_extent * (PAGE_SIZE / 1024));
+}
+
+/*
+ * tlb - Display TLB shootdown statistics
+ * Samples the counters over one second to show the current rates.
+ */
+void cmd_tlb(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+
+    struct vmm_tlb_stats before, after;
+    vmm_get_tlb_stats(&before);
+    pit_sleep_ms(1000);
+    vmm_get_tlb_stats(&after);
+
+    kprintf("\nTLB Shootdowns (CPUs online: %u):\n", percpu_cpu_count());
+    kprintf("  Flushes:    %llu (%llu/s)\n", after.flushes, after.flushes - before.flushes);
+    kprintf("  Shootdowns: %llu (%llu/s)\n", after.shootdowns, after.shootdowns - before.shootdowns);
+    kprintf("  IPIs:       %llu (%llu/s)\n", after.ipis, after.ipis - before.ipis);
+    kprintf("  Skipped:    %llu (%llu/s)\n\n", after.skipped, after.skipped - before.skipped);
+}
+
+/*
+ * slab - Display object cache statistics
+ */
+void cmd_slab(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+
+    static struct kmem_cache_stats stats[KMEM_MAX_CACHES];
+    int count = kmem_cache_get_stats(stats, KMEM_MAX_CACHES);
+
+    kprintf("\nObject Caches:\n");
+    if (count == 0) {
+        kprintf("  (none)\n\n");
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct kmem_cache_stats *st = &stats[i];
+        kprintf("  %s: %llu/%llu objects of %u bytes (stride %u, %u per %u KB slab)\n",
+                st->name, st->active, st->total, st->object_size, st->stride,
+                st->per_slab, st->slab_pages * (PAGE_SIZE / 1024));
+        kprintf("    Slabs: %llu (%llu created), Allocs: %llu, Frees: %llu\n",
+                st->slabs, st->grows, st->allocs, st->frees);
+        kprintf("    Per-CPU: %llu cached, Hits: %llu (%llu%%)\n",
+                st->cached, st->hits, st->allocs ? (st->hits * 100) / st->allocs : 0);
+    }
     kprintf("\n");
 }
 
@@ -226,6 +518,7 @@ void cmd_ls(int argc, char **argv) {
 
     if (!vfs_is_directory(node)) {
         kprintf("ls: '%s': Not a directory\n", path);
+        vfs_close(node);
         return;
     }
 
@@ -244,6 +537,7 @@ void cmd_ls(int argc, char **argv) {
             } else {
                 kprintf("  %6llu  %s\n", child->size, entry->name);
             }
+            vfs_close(child);
             count++;
         }
     }
@@ -252,6 +546,7 @@ void cmd_ls(int argc, char **argv) {
         kprintf("  (empty)\n");
     }
     kprintf("\n");
+    vfs_close(node);
 }
 
 /*
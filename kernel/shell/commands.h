@@ -18,6 +18,10 @@ void cmd_help(int argc, char **argv);
 void cmd_clear(int argc, char **argv);
 void cmd_echo(int argc, char **argv);
 void cmd_mem(int argc, char **argv);
+void cmd_pmm(int argc, char **argv);
+void cmd_tlb(int argc, char **argv);
+void cmd_slab(int argc, char **argv);
+void cmd_heap(int argc, char **argv);
 void cmd_uptime(int argc, char **argv);
 void cmd_cpuinfo(int argc, char **argv);
 void cmd_reboot(int argc, char **argv);
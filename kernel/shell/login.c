@@ -10,6 +10,7 @@
 #include "../lib/theme.h"
 #include "../drivers/pit.h"
 #include "../drivers/graphics.h"
+#include "../proc/idle.h"
 
 /* Simple delay for animations */
 static void delay_ms(uint32_t ms) {
@@ -68,7 +69,7 @@ bool login_prompt(void) {
         int pos = 0;
         memset(username, 0, 32);
         while (1) {
-            if (!khaschar()) { __asm__ volatile ("hlt"); continue; }
+            if (!khaschar()) { if (!idle_run()) __asm__ volatile ("hlt"); continue; }
             char c = kgetc();
             if (c == '\n') { username[pos] = '\0'; break; }
             else if (c == '\b' && pos > 0) {
@@ -88,7 +89,7 @@ bool login_prompt(void) {
         pos = 0;
         memset(password, 0, 32);
         while (1) {
-            if (!khaschar()) { __asm__ volatile ("hlt"); continue; }
+            if (!khaschar()) { if (!idle_run()) __asm__ volatile ("hlt"); continue; }
             char c = kgetc();
             if (c == '\n') { password[pos] = '\0'; break; }
             else if (c == '\b' && pos > 0) {
@@ -13,6 +13,7 @@
 #include "../drivers/keyboard.h"
 #include "../drivers/pit.h"
 #include "../drivers/boot_animation.h"
+#include "../proc/idle.h"
 
 /*
  * Command buffer
@@ -89,6 +90,14 @@ void shell_execute(const char *line) {
         cmd_echo(argc, argv);
     } else if (strcmp(cmd, "mem") == 0 || strcmp(cmd, "memory") == 0) {
         cmd_mem(argc, argv);
+    } else if (strcmp(cmd, "pmm") == 0) {
+        cmd_pmm(argc, argv);
+    } else if (strcmp(cmd, "tlb") == 0) {
+        cmd_tlb(argc, argv);
+    } else if (strcmp(cmd, "slab") == 0) {
+        cmd_slab(argc, argv);
+    } else if (strcmp(cmd, "heap") == 0) {
+        cmd_heap(argc, argv);
     } else if (strcmp(cmd, "uptime") == 0) {
         cmd_uptime(argc, argv);
     } else if (strcmp(cmd, "cpuinfo") == 0) {
@@ -181,7 +190,10 @@ void shell_run(void) {
 
         /* Get character from available input sources */
         if (!khaschar()) {
-            __asm__ volatile ("hlt");
+            /* Do background work, halt only when there is none */
+            if (!idle_run()) {
+                __asm__ volatile ("hlt");
+            }
             continue;
         }
 